@@ -26,7 +26,10 @@
 // #include <can.h>
 #include "Railuino.h"
 // #include "canbus/canbus.c"
-#if defined(__ESP__)
+#if defined(CAN_SIMULATOR)
+#include "can/mcp2515.h"
+#include "can/simulator.c"
+#elif defined(__ESP__)
 #define __NOCAN__ 1
 // Can-Bus not supported for ESP-Boards
 #else
@@ -34,6 +37,8 @@
 #include "can/mcp2515.c"
 #endif
 
+#include "ir/rc5.c"
+
 #if defined(__LEONARDO__)
 #include "ir/infrared2.c"
 #elif defined(__ESP__)
@@ -83,6 +88,9 @@ int parseHex(String &s, int start, int end, boolean *ok) {
 
 #if !defined(__NOCAN__)
     can_t _buffer[SIZE];
+
+    // Arrival times, in units of 16 us, so they fit into a word
+    word _times[SIZE];
 #endif
 
 volatile int posRead = 0;
@@ -100,6 +108,11 @@ void enqueue() {
     }
 
     if (can_get_message(&_buffer[posWrite])) {
+#if defined(CAN_SIMULATOR)
+        _times[posWrite] = simulatorArrival >> 4;
+#else
+        _times[posWrite] = micros() >> 4;
+#endif
         posWrite = (posWrite + 1) % SIZE;
     } else {
         // Serial.println("!!! No message");
@@ -108,7 +121,41 @@ void enqueue() {
     lastOpWasWrite = true;
 }
 
-boolean dequeue(can_t *p) {
+/**
+ * The controller that does an emergency stop when its pin is pulled
+ * low, and the pin.
+ */
+TrackController *emergencyController = NULL;
+int emergencyPin = -1;
+
+void emergencyInterrupt() {
+    if (emergencyController != NULL) {
+        emergencyController->emergencyStop();
+    }
+}
+
+#if defined(CAN_SIMULATOR)
+/**
+ * The simulator has no interrupt line, so this is called whenever the
+ * controller sends or receives, fetching what the simulator has ready.
+ */
+void simulateInterrupt() {
+    while (can_check_message() && !(posWrite == posRead && lastOpWasWrite)) {
+        enqueue();
+    }
+}
+#endif
+
+/**
+ * Removes the oldest message from the buffer and reports the time it
+ * arrived. The time is only right if the message was buffered for less
+ * than a second, which it really should be.
+ */
+boolean dequeue(can_t *p, unsigned long *time) {
+#if defined(CAN_SIMULATOR)
+    simulateInterrupt();
+#endif
+
     noInterrupts();
 
     if (posWrite == posRead && !lastOpWasWrite) {
@@ -127,6 +174,9 @@ boolean dequeue(can_t *p) {
 */
 //*p = _buffer[posRead];
 
+unsigned long now = micros();
+*time = (now & ~15UL) - ((unsigned long) (word) ((now >> 4) - _times[posRead]) << 4);
+
 posRead = (posRead + 1) % SIZE;
 lastOpWasWrite = false;
 
@@ -202,11 +252,23 @@ boolean TrackMessage::parseFrom(String &s) {
 // === TrackController ===============================================
 // ===================================================================
 
+#define STARTUP_OFF      0 // Not begun
+#define STARTUP_SETTLING 1 // Waiting for things to settle
+#define STARTUP_HASHING  2 // Checking the hash for conflicts
+#define STARTUP_READY    3 // Up and running
+
+#define STARTUP_TIME 500 // Time (ms) for settling and for each hash
+
+#define SEND_TIMEOUT 2000 // Time (us) to wait for a free transmit buffer
+
 TrackController::TrackController() {
     if (mDebug) {
         Serial.println(F("### Creating controller"));
     }
 
+    mListeners = NULL;
+    mReadyHandler = NULL;
+
     init(0, false, false);
 }
 
@@ -215,6 +277,9 @@ TrackController::TrackController(word hash, boolean debug) {
         Serial.println(F("### Creating controller"));
     }
 
+    mListeners = NULL;
+    mReadyHandler = NULL;
+
     init(hash, debug, false);
 }
 
@@ -230,6 +295,18 @@ void TrackController::init(word hash, boolean debug, boolean loopback) {
     mHash = hash;
     mDebug = debug;
     mLoopback = loopback;
+
+    mRampCount = 0;
+    mRampNext = 0;
+    mEmergency = false;
+    mRampInterval = RAMP_INTERVAL;
+    mRampLast = 0;
+
+    mReceived = 0;
+    mReceiving = false;
+
+    mStartup = STARTUP_OFF;
+    mQueueLength = 0;
 }
 
 word TrackController::getHash() {
@@ -249,18 +326,32 @@ void TrackController::begin() {
     // on all boards, it must be set to out,
     // otherwise SPI might switch to slave
     // and we just hang. Do not delete!
+#if !defined(CAN_SIMULATOR)
     pinMode(SS, OUTPUT);
 
     attachInterrupt(CAN_INT, enqueue, LOW);
+#endif
 
     if (!can_init(5, mLoopback)) {
         Serial.println(F("!?! Init error"));
-        Serial.println(F("!?! Emergency stop"));
-        for (;;);
     }
 
-    delay(500);
+    mGenerated = mHash == 0;
+
+    if (mGenerated) {
+        generateHash();
+    }
 
+    // Nobody else to talk to in loopback mode
+    if (mLoopback) {
+        ready();
+    } else {
+        mStartup = STARTUP_SETTLING;
+        mStartTime = millis();
+    }
+}
+
+void TrackController::bootstrap() {
     if (!mLoopback) {
         TrackMessage message;
 
@@ -269,63 +360,205 @@ void TrackController::begin() {
         message.length = 0x05;
         message.data[4] = 0x11;
 
-        sendMessage(message);
+        transmit(message);
     }
+}
 
-    if (mHash == 0) {
-        generateHash();
+boolean TrackController::restart() {
+    // Keep the interrupt handler away from the SPI bus meanwhile
+    noInterrupts();
+    boolean result = can_init(5, mLoopback);
+    interrupts();
+
+    if (result) {
+        bootstrap();
     }
 
+    return result;
+}
+
+byte TrackController::getBusErrors(byte *transmit, byte *receive) {
+    return can_read_errors(transmit, receive);
 }
 
 void TrackController::generateHash() {
-    TrackMessage message;
+    mHash = random(0x10000) & 0xff7f | 0x0300;
+    mConflict = false;
+
+    if (mDebug) {
+        Serial.print(F("### Trying new hash "));
+        printHex(Serial, mHash, 4);
+        Serial.println();
+    }
+}
 
-    boolean ok = false;
+void TrackController::startup() {
+    unsigned long now = millis();
 
-    while(!ok) {
-        mHash = random(0x10000) & 0xff7f | 0x0300;
+    switch (mStartup) {
+        case STARTUP_SETTLING:
+            // Give the Gleisbox some time before waking it up
+            if (now - mStartTime < STARTUP_TIME) {
+                return;
+            }
 
-        if (mDebug) {
-            Serial.print(F("### Trying new hash "));
-            printHex(Serial, mHash, 4);
-            Serial.println();
-        }
+            bootstrap();
+            break;
+
+        case STARTUP_HASHING:
+            // Wait for anyone else using our hash
+            if (now - mStartTime < STARTUP_TIME) {
+                return;
+            }
+
+            if (!mConflict) {
+                if (mDebug) {
+                    Serial.println(F("### New hash looks good"));
+                }
+
+                mGenerated = false;
+            } else {
+                generateHash();
+            }
+            break;
+
+        default:
+            return;
+    }
+
+    if (mGenerated) {
+        TrackMessage message;
 
         message.clear();
         message.command = 0x18;
 
-        sendMessage(message);
+        transmit(message);
+
+        mStartup = STARTUP_HASHING;
+        mStartTime = now;
+    } else {
+        ready();
+    }
+}
+
+void TrackController::ready() {
+    mStartup = STARTUP_READY;
 
-        delay(500);
+    flush();
 
-        ok = true;
-        while(receiveMessage(message)) {
-            if (message.hash == mHash) {
-                ok = false;
-            }
-        }
+    if (mReadyHandler != NULL) {
+        mReadyHandler(*this);
     }
+}
 
-    if (mDebug) {
-        Serial.println(F("### New hash looks good"));
+void TrackController::flush() {
+    byte n = 0;
+
+    while (n < mQueueLength && transmit(mQueue[n])) {
+        n++;
+    }
+
+    mQueueLength -= n;
+
+    for (byte i = 0; i < mQueueLength; i++) {
+        mQueue[i] = mQueue[i + n];
+    }
+}
+
+void TrackController::waitUntilReady() {
+    TrackMessage message;
+
+    while (mStartup == STARTUP_SETTLING || mStartup == STARTUP_HASHING) {
+        receive(message);
     }
 }
 
+boolean TrackController::isReady() {
+    return mStartup == STARTUP_READY;
+}
+
+void TrackController::setReadyHandler(void (*handler)(TrackController &controller)) {
+    mReadyHandler = handler;
+}
+
 // end - no interrupts
 
 void TrackController::end() {
+#if !defined(CAN_SIMULATOR)
     detachInterrupt(CAN_INT);
+#endif
+
+    if (emergencyController == this) {
+        setEmergencyPin(-1);
+    }
+
+    mStartup = STARTUP_OFF;
+    mQueueLength = 0;
 
     can_t t;
+    unsigned long time;
 
-    boolean b = dequeue(&t);
+    boolean b = dequeue(&t, &time);
     while (b) {
-        b = dequeue(&t);
+        b = dequeue(&t, &time);
     }
 }
 
 boolean TrackController::sendMessage(TrackMessage &message) {
+    if (mStartup == STARTUP_OFF || (mStartup == STARTUP_READY && mQueueLength == 0)) {
+        return transmit(message);
+    }
+
+    startup();
+
+    // Keep the order, so queue behind whatever is waiting. Nothing may
+    // go out before the startup is done.
+    if (mQueueLength == CONTROLLER_QUEUE) {
+        if (mStartup == STARTUP_READY) {
+            flush();
+        }
+
+        if (mQueueLength == CONTROLLER_QUEUE) {
+            return false;
+        }
+    }
+
+    mQueue[mQueueLength++] = message;
+
+    if (mStartup == STARTUP_READY) {
+        flush();
+    }
+
+    return true;
+}
+
+boolean TrackController::transmit(TrackMessage &message) {
+    message.hash = mHash;
+
+    if (mDebug) {
+        Serial.print("==> ");
+        Serial.println(message);
+    }
+
+    // After a burst, all three transmit buffers may still be busy, so
+    // allow for the time it takes to send three frames
+    unsigned long time = micros();
+    boolean result;
+
+    while (!(result = sendMessageNow(message)) && micros() - time < SEND_TIMEOUT) {
+#if defined(CAN_SIMULATOR)
+        simulateInterrupt();
+#endif
+    }
+
+#if defined(CAN_SIMULATOR)
+    simulateInterrupt();
+#endif
+
+    return result;
+}
+
+boolean TrackController::sendMessageNow(TrackMessage &message) {
     can_t can;
 
     message.hash = mHash;
@@ -339,18 +572,33 @@ boolean TrackController::sendMessage(TrackMessage &message) {
         can.data[i] = message.data[i];
     }
 
-    if (mDebug) {
-        Serial.print("==> ");
-        Serial.println(message);
-    }
-
     return can_send_message(&can);
 }
 
 boolean TrackController::receiveMessage(TrackMessage &message) {
+    mReceiving = true;
+
+    return receive(message);
+}
+
+void TrackController::poll() {
+    TrackMessage message;
+
+    if (!mReceiving) {
+        while (receive(message)) {
+            // Listeners do the work
+        }
+    }
+}
+
+boolean TrackController::receive(TrackMessage &message) {
     can_t can;
 
-    boolean result = dequeue(&can);
+    if (mStartup != STARTUP_READY) {
+        startup();
+    }
+
+    boolean result = dequeue(&can, &mReceived);
     //	boolean result = /* can_check_message() && */ can_get_message(&can);
 
     if (result) {
@@ -391,21 +639,49 @@ if (mDebug) {
     Serial.print("<== ");
     Serial.println(message);
 }
+
+// Someone else is using the hash we would like to have
+if (mStartup == STARTUP_HASHING && message.hash == mHash) {
+    mConflict = true;
+}
+
+for (TrackListener *l = mListeners; l != NULL; l = l->mNext) {
+    l->messageReceived(message);
+}
+
+// A stop, halt or emergency halt, for instance from the MS2, ends ramps
+if (message.command == 0x00 && message.length >= 5 && !message.response) {
+    word address = word(message.data[2], message.data[3]);
+
+    if (message.data[4] == 0x00 || message.data[4] == 0x02 || (message.data[4] == 0x03 && address == 0)) {
+        cancelRamps();
+    } else if (message.data[4] == 0x03) {
+        cancelRamp(address);
+    }
+}
 }
 
 return result;
 }
 
+unsigned long TrackController::getReceiveTime() {
+    return mReceived;
+}
+
 boolean TrackController::exchangeMessage(TrackMessage &out, TrackMessage &in, word timeout) {
     int command = out.command;
 
+    // This blocks anyway, so wait until we are ready
+    waitUntilReady();
+
     if (!sendMessage(out)) {
         if (mDebug) {
             Serial.println(F("!?! Send error"));
             Serial.println(F("!?! Emergency stop"));
-            setPower(false);
-            for (;;);
+            emergencyStop();
         }
+
+        return false;
     }
 
     ulong time = millis();
@@ -414,7 +690,7 @@ boolean TrackController::exchangeMessage(TrackMessage &out, TrackMessage &in, wo
 
     while (millis() < time + timeout) {
         in.clear();
-        boolean result = receiveMessage(in);
+        boolean result = receive(in);
 
         if (result && in.command == command && in.response) {
             return true;
@@ -428,9 +704,31 @@ boolean TrackController::exchangeMessage(TrackMessage &out, TrackMessage &in, wo
     return false;
 }
 
+void TrackController::addListener(TrackListener *listener) {
+    listener->mNext = mListeners;
+    mListeners = listener;
+}
+
+void TrackController::removeListener(TrackListener *listener) {
+    TrackListener **p = &mListeners;
+
+    while (*p != NULL) {
+        if (*p == listener) {
+            *p = listener->mNext;
+            return;
+        }
+
+        p = &(*p)->mNext;
+    }
+}
+
 boolean TrackController::setPower(boolean power) {
     TrackMessage message;
 
+    if (!power) {
+        cancelRamps();
+    }
+
     if (power) {
         message.clear();
         message.command = 0x00;
@@ -457,9 +755,48 @@ boolean TrackController::setPower(boolean power) {
     return exchangeMessage(message, message, 1000);
 }
 
+boolean TrackController::emergencyStop() {
+    can_t can;
+
+    // Ramps are cancelled by whoever touches them next
+    mEmergency = true;
+
+    // System stop, command 0x00 to everyone
+    can.id = mHash;
+    can.flags.extended = 1;
+    can.flags.rtr = 0;
+    can.length = 5;
+    memset(can.data, 0, sizeof(can.data));
+
+    boolean result = can_send_urgent(&can);
+
+#if defined(CAN_SIMULATOR)
+    simulateInterrupt();
+#endif
+
+    return result;
+}
+
+void TrackController::setEmergencyPin(int pin) {
+    if (emergencyPin != -1) {
+        detachInterrupt(digitalPinToInterrupt(emergencyPin));
+    }
+
+    emergencyController = NULL;
+    emergencyPin = pin;
+
+    if (pin != -1) {
+        pinMode(pin, INPUT_PULLUP);
+        emergencyController = this;
+        attachInterrupt(digitalPinToInterrupt(pin), emergencyInterrupt, FALLING);
+    }
+}
+
 boolean TrackController::setLocoDirection(word address, byte direction) {
     TrackMessage message;
 
+    cancelRamp(address);
+
     message.clear();
     message.command = 0x00;
     message.length = 0x05;
@@ -486,6 +823,8 @@ boolean TrackController::toggleLocoDirection(word address) {
 boolean TrackController::setLocoSpeed(word address, word speed) {
     TrackMessage message;
 
+    cancelRamp(address);
+
     message.clear();
     message.command = 0x04;
     message.length = 0x06;
@@ -497,6 +836,174 @@ boolean TrackController::setLocoSpeed(word address, word speed) {
     return exchangeMessage(message, message, 1000);
 }
 
+void TrackController::checkEmergency() {
+    if (mEmergency) {
+        mEmergency = false;
+        cancelRamps();
+    }
+}
+
+int TrackController::findRamp(word address) {
+    checkEmergency();
+
+    for (int i = 0; i < mRampCount; i++) {
+        if (mRampLocos[i] == address) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+word TrackController::getRampSpeed(int i, unsigned long time) {
+    unsigned long elapsed = time - mRampStart[i];
+
+    if (elapsed >= mRampTime[i]) {
+        return mRampTo[i];
+    }
+
+    // Progress from 0 to 1000
+    unsigned long x = elapsed * 1000 / mRampTime[i];
+
+    if (mRampCurves[i] == RAMP_S_CURVE) {
+        // Smoothstep, 3x^2 - 2x^3
+        x = x * x / 1000 * (3000 - 2 * x) / 1000;
+    }
+
+    return mRampFrom[i] + ((long) mRampTo[i] - (long) mRampFrom[i]) * (long) x / 1000;
+}
+
+boolean TrackController::rampLocoSpeed(word address, word speed, word time, byte curve) {
+    int i = findRamp(address);
+    word from;
+
+    if (i != -1) {
+        from = getRampSpeed(i, millis());
+    } else if (mRampCount == CONTROLLER_RAMPS || !getLocoSpeed(address, &from)) {
+        return false;
+    }
+
+    return rampLocoSpeed(address, from, speed, time, curve);
+}
+
+boolean TrackController::rampLocoSpeed(word address, word from, word speed, word time, byte curve) {
+    int i = findRamp(address);
+
+    if (i == -1) {
+        if (mRampCount == CONTROLLER_RAMPS) {
+            return false;
+        }
+
+        i = mRampCount++;
+        mRampSent[i] = from;
+    }
+
+    mRampLocos[i] = address;
+    mRampFrom[i] = from;
+    mRampTo[i] = speed;
+    mRampStart[i] = millis();
+    mRampTime[i] = time;
+    mRampCurves[i] = curve;
+
+    return true;
+}
+
+boolean TrackController::brakeLoco(word address, word distance, word velocity) {
+    if (velocity == 0) {
+        return setLocoSpeed(address, 0);
+    }
+
+    // Constant deceleration covers the distance in twice the time
+    unsigned long time = 2000UL * distance / velocity;
+
+    return rampLocoSpeed(address, 0, time > 0xffff ? 0xffff : time, RAMP_LINEAR);
+}
+
+boolean TrackController::isRamping(word address) {
+    return findRamp(address) != -1;
+}
+
+void TrackController::cancelRamp(word address) {
+    int i = findRamp(address);
+
+    if (i != -1) {
+        // Move the last one here
+        mRampCount--;
+        mRampLocos[i] = mRampLocos[mRampCount];
+        mRampFrom[i] = mRampFrom[mRampCount];
+        mRampTo[i] = mRampTo[mRampCount];
+        mRampSent[i] = mRampSent[mRampCount];
+        mRampStart[i] = mRampStart[mRampCount];
+        mRampTime[i] = mRampTime[mRampCount];
+        mRampCurves[i] = mRampCurves[mRampCount];
+    }
+}
+
+void TrackController::cancelRamps() {
+    mRampCount = 0;
+}
+
+void TrackController::setRampInterval(word interval) {
+    mRampInterval = interval;
+}
+
+void TrackController::update() {
+    if (mStartup != STARTUP_READY) {
+        startup();
+    } else if (mQueueLength != 0) {
+        flush();
+    }
+
+    // Look out for hash conflicts and stops that end the ramps
+    poll();
+
+    unsigned long now = millis();
+
+    checkEmergency();
+
+    if (mRampCount == 0 || now - mRampLast < mRampInterval) {
+        return;
+    }
+
+    // Ramps take turns, the first one that needs a message gets it
+    for (int n = 0; n < mRampCount; n++) {
+        int i = (mRampNext + n) % mRampCount;
+        word speed = getRampSpeed(i, now);
+        boolean done = speed == mRampTo[i];
+
+        if (done || abs((long) speed - (long) mRampSent[i]) >= RAMP_STEP) {
+            TrackMessage message;
+
+            message.clear();
+            message.command = 0x04;
+            message.length = 0x06;
+            message.data[2] = highByte(mRampLocos[i]);
+            message.data[3] = lowByte(mRampLocos[i]);
+            message.data[4] = highByte(speed);
+            message.data[5] = lowByte(speed);
+
+            // Don't follow an emergency stop with a speed
+            if (mEmergency) {
+                checkEmergency();
+                return;
+            }
+
+            sendMessage(message);
+
+            mRampSent[i] = speed;
+            mRampLast = now;
+            mRampNext = i + 1;
+
+            if (done) {
+                cancelRamp(mRampLocos[i]);
+                mRampNext = i;
+            }
+
+            return;
+        }
+    }
+}
+
 boolean TrackController::accelerateLoco(word address) {
     word speed;
 
@@ -696,11 +1203,13 @@ boolean TrackController::getVersion(byte *high, byte *low) {
     message.clear();
     message.command = 0x18;
 
+    waitUntilReady();
+
     sendMessage(message);
 
     delay(500);
 
-    while(receiveMessage(message)) {
+    while(receive(message)) {
         if (message.command = 0x18 && message.data[6] == 0x00 && message.data[7] == 0x10) {
             (*high) = message.data[4];
             (*low) = message.data[5];
@@ -735,6 +1244,15 @@ boolean TrackController::getVersion(byte *high, byte *low) {
 
 static word locoBits[] = { ADDR_LOCO_1, ADDR_LOCO_2, ADDR_LOCO_3, ADDR_LOCO_4 };
 
+/**
+* The controller whose queue the IR transmitter drains.
+*/
+static TrackControllerInfrared *irController = NULL;
+
+bool irNextFrame(unsigned long *data, int *nbits, bool *extended) {
+    return irController != NULL && irController->nextFrame(data, nbits, extended);
+}
+
 /**
 * Creates a new TrackControllerInfrared and does some
 * initializing. Assumes the IR LED is on pin 9.
@@ -745,6 +1263,17 @@ static word locoBits[] = { ADDR_LOCO_1, ADDR_LOCO_2, ADDR_LOCO_3, ADDR_LOCO_4 };
 */
 TrackControllerInfrared::TrackControllerInfrared() {
     mPower = true;
+    mToggle = 0;
+    mRead = 0;
+    mLength = 0;
+
+    for (int i = 0; i < 4; i++) {
+        mSpeeds[i] = 0;
+        mDirections[i] = DIR_FORWARD;
+        mFunctions[i] = 0;
+    }
+
+    irController = this;
 }
 
 /**
@@ -765,23 +1294,15 @@ void TrackControllerInfrared::start() {
 * Added for testing
 */
 boolean TrackControllerInfrared::sendRaw(unsigned long data, int nbits) {
-    sendRC5(data,nbits,false);
+    while (isIRBusy());
+    startRC5(data,nbits,false);
     return true;
 }
 
 boolean TrackControllerInfrared::sendMessage(word address, word command) {
     if (mPower) {
-        int transmission = (address << 6) | (command & 0x3f);
-
-        if (command >= 0x40) {
-            sendRC5(mToggle | transmission, 12, true);
-        } else {
-            sendRC5(mToggle | transmission, 12, false);
-        }
-
-        mToggle ^= 1 << 11;
-
-        delay(50);
+        enqueue(address, command, 12);
+        pump();
 
         return true;
     }
@@ -789,9 +1310,142 @@ boolean TrackControllerInfrared::sendMessage(word address, word command) {
     return false;
 }
 
-boolean TrackControllerInfrared::accelerateLoco(int loco) {
+void TrackControllerInfrared::enqueue(word address, word command, byte nbits) {
+    signed char delta = command == CMD_FASTER ? 1 : command == CMD_SLOWER ? -1 : 0;
+
+    while (true) {
+        noInterrupts();
+
+        // Merge speed changes into the latest pending command for the
+        // same loco, provided nothing else (direction!) came in between
+        // and it goes the same way. The loco stops at steps 0 and 14,
+        // so FASTER and SLOWER don't simply cancel out.
+        if (delta != 0) {
+            for (int i = mLength - 1; i >= 0; i--) {
+                byte j = (mRead + i) % IR_QUEUE;
+                if (mAddresses[j] == address) {
+                    if (mCommands[j] == CMD_FASTER && (mCounts[j] < 0) == (delta < 0)) {
+                        // More than 14 steps in one direction are moot
+                        if (abs(mCounts[j] + delta) <= 14) {
+                            mCounts[j] += delta;
+                        }
+                        interrupts();
+                        return;
+                    }
+                    break;
+                }
+            }
+        }
+
+        // A turnout only needs the last position it was asked for
+        if (address == ADDR_TURNOUT_A || address == ADDR_TURNOUT_B) {
+            for (int i = 0; i < mLength; i++) {
+                byte j = (mRead + i) % IR_QUEUE;
+                if (mAddresses[j] == address && ((mCommands[j] ^ command) & 0x07) == 0) {
+                    mCommands[j] = command;
+                    interrupts();
+                    return;
+                }
+            }
+        }
+
+        if (mLength < IR_QUEUE) {
+            byte j = (mRead + mLength) % IR_QUEUE;
+            mAddresses[j] = address;
+            mCommands[j] = delta != 0 ? CMD_FASTER : command;
+            mBits[j] = nbits;
+            mCounts[j] = delta != 0 ? delta : 1;
+            mLength++;
+            interrupts();
+            return;
+        }
+
+        interrupts();
+
+        // Queue full, wait for the transmitter to make room
+        pump();
+    }
+}
+
+void TrackControllerInfrared::pump() {
+    unsigned long data;
+    int nbits;
+    bool extended;
+
+    if (!isIRBusy()) {
+        noInterrupts();
+        boolean ready = nextFrame(&data, &nbits, &extended);
+        interrupts();
+
+        if (ready) {
+            startRC5(data, nbits, extended);
+        }
+    }
+}
+
+boolean TrackControllerInfrared::nextFrame(unsigned long *data, int *nbits, bool *extended) {
+    if (mLength == 0) {
+        return false;
+    }
+
+    byte j = mRead;
+    word command = mCommands[j];
+
+    if (mCounts[j] < 0) {
+        command = CMD_SLOWER;
+        mCounts[j]++;
+    } else {
+        mCounts[j]--;
+    }
+
+    if (mCounts[j] == 0) {
+        mRead = (mRead + 1) % IR_QUEUE;
+        mLength--;
+    }
+
+    // Every frame is a new key press, so the toggle bit alternates
+    *data = mToggle | (mAddresses[j] << 6) | (command & 0x3f);
+    *nbits = mBits[j];
+    *extended = command >= 0x40;
+    mToggle ^= 1 << 11;
+
+    return true;
+}
+
+byte TrackControllerInfrared::encode(unsigned long data, int nbits, bool extended, byte runs[]) {
+    unsigned long halfBits = rc5Schedule(data, nbits, extended);
+
+    byte count = 0;
+    boolean level = true;
+
+    runs[0] = 0;
+
+    for (int i = 2 + 2 * nbits; i >= 0; i--) {
+        boolean mark = bitRead(halfBits, i);
+        if (mark != level) {
+            runs[++count] = 0;
+            level = mark;
+        }
+        runs[count]++;
+    }
+
+    return level ? count + 1 : count;
+}
+
+boolean TrackControllerInfrared::isBusy() {
+    return mLength != 0 || isIRBusy();
+}
+
+void TrackControllerInfrared::update() {
+    pump();
+}
+
+boolean TrackControllerInfrared::accelerateLoco(int loco) {
     if (loco >= 1 && loco <= 4) {
-        return sendMessage(locoBits[loco - 1], CMD_FASTER);
+        if (sendMessage(locoBits[loco - 1], CMD_FASTER)) {
+            mSpeeds[loco - 1] = min(mSpeeds[loco - 1] + 1, 14);
+            return true;
+        }
     }
 
     return false;
@@ -799,7 +1453,44 @@ boolean TrackControllerInfrared::accelerateLoco(int loco) {
 
 boolean TrackControllerInfrared::decelerateLoco(int loco) {
     if (loco >= 1 && loco <= 4) {
-        return sendMessage(locoBits[loco - 1], CMD_SLOWER);
+        if (sendMessage(locoBits[loco - 1], CMD_SLOWER)) {
+            mSpeeds[loco - 1] = max(mSpeeds[loco - 1] - 1, 0);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+boolean TrackControllerInfrared::setLocoSpeedStep(int loco, byte step) {
+    if (loco >= 1 && loco <= 4 && step <= 14 && mPower) {
+        byte speed = mSpeeds[loco - 1];
+
+        // Two direction changes stop the loco and keep its direction
+        if (step < speed && 2 + step < speed - step) {
+            toggleLocoDirection(loco);
+            toggleLocoDirection(loco);
+            speed = 0;
+        }
+
+        for (; speed < step; speed++) {
+            accelerateLoco(loco);
+        }
+
+        for (; speed > step; speed--) {
+            decelerateLoco(loco);
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+boolean TrackControllerInfrared::getLocoSpeedStep(int loco, byte *step) {
+    if (loco >= 1 && loco <= 4) {
+        *step = mSpeeds[loco - 1];
+        return true;
     }
 
     return false;
@@ -807,7 +1498,20 @@ boolean TrackControllerInfrared::decelerateLoco(int loco) {
 
 boolean TrackControllerInfrared::toggleLocoDirection(int loco) {
     if (loco >= 1 && loco <= 4) {
-        return sendMessage(locoBits[loco - 1], CMD_DIRECTION);
+        if (sendMessage(locoBits[loco - 1], CMD_DIRECTION)) {
+            mSpeeds[loco - 1] = 0;
+            mDirections[loco - 1] = mDirections[loco - 1] == DIR_FORWARD ? DIR_REVERSE : DIR_FORWARD;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+boolean TrackControllerInfrared::getLocoDirection(int loco, byte *direction) {
+    if (loco >= 1 && loco <= 4) {
+        *direction = mDirections[loco - 1];
+        return true;
     }
 
     return false;
@@ -815,7 +1519,19 @@ boolean TrackControllerInfrared::toggleLocoDirection(int loco) {
 
 boolean TrackControllerInfrared::toggleLocoFunction(int loco, int function) {
     if (loco >= 1 && loco <= 4 && function >= 0 && function <= 8) {
-        return sendMessage(locoBits[loco - 1], CMD_FUNCTION | function);
+        if (sendMessage(locoBits[loco - 1], CMD_FUNCTION | function)) {
+            mFunctions[loco - 1] ^= 1 << function;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+boolean TrackControllerInfrared::getLocoFunction(int loco, int function, byte *power) {
+    if (loco >= 1 && loco <= 4 && function >= 0 && function <= 8) {
+        *power = bitRead(mFunctions[loco - 1], function);
+        return true;
     }
 
     return false;
@@ -853,185 +1569,2200 @@ boolean TrackControllerInfrared::setTurnout(int turnout, boolean through) {
 }
 
 // ===================================================================
-// === TrackReporterS88 ==============================================
+// === TrackDecoderInfrared ==========================================
 // ===================================================================
 
-const int DATA = A0;
-const int CLOCK = 2;
-const int LOAD = 3;
-const int RESET = 4;
+#define RC5_HALF_BIT 889
+#define RC5_FRAME    27 // half bits, including start bits
 
-const int TIME = 50;
+TrackDecoderInfrared::TrackDecoderInfrared() {
+    mAddress = 0;
+    mCommand = 0;
+    mToggle = false;
+    mTimingError = 0;
+    mFrames = 0;
+    mErrors = 0;
 
-TrackReporterS88::TrackReporterS88(int modules) {
-    mSize = modules;
+    clear();
+}
 
-    // pinMode(DATA, INPUT);
-    pinMode(CLOCK, OUTPUT);
-    pinMode(LOAD, OUTPUT);
-    pinMode(RESET, OUTPUT);
+void TrackDecoderInfrared::clear() {
+    mHalfBits = 0;
+    mCount = 0;
+    mError = 0;
 }
 
-void TrackReporterS88::refresh() {
-    int myByte = 0;
-    int myBit = 0;
+boolean TrackDecoderInfrared::feed(boolean mark, word duration) {
+    byte n = min((duration + RC5_HALF_BIT / 2UL) / RC5_HALF_BIT, 3UL);
+
+    if (!mark && n > 2) {
+        boolean result = false;
+
+        if (mCount != 0) {
+            // A trailing space (from a zero bit) merges into the gap
+            if (mCount == RC5_FRAME - 1) {
+                mHalfBits <<= 1;
+                mCount++;
+            }
+
+            result = decode();
+
+            if (result) {
+                mFrames++;
+            } else {
+                mErrors++;
+            }
+        }
 
-    for (int i = 0; i <= sizeof(mSwitches); i++) {
-        mSwitches[i] = 0;
+        clear();
+        return result;
     }
 
-    digitalWrite(LOAD, HIGH);
-    delayMicroseconds( TIME);
-    digitalWrite(CLOCK, HIGH);
-    delayMicroseconds(TIME);
-    digitalWrite(CLOCK, LOW);
-    delayMicroseconds(TIME);
-    digitalWrite(RESET, HIGH);
-    delayMicroseconds(TIME);
-    digitalWrite(RESET, LOW);
-    delayMicroseconds(TIME);
-    digitalWrite(LOAD, LOW);
+    if (mCount == 0 && !mark) {
+        return false; // Idle line
+    }
 
-    delayMicroseconds(TIME / 2);
+    if (n == 0 || n > 2 || mCount + n > RC5_FRAME) {
+        mErrors++;
+        clear();
+        return false;
+    }
 
-    bitWrite(mSwitches[myByte], myBit++, digitalRead(DATA));
-    delayMicroseconds(TIME / 2);
+    mError = max(mError, (word) abs((long) duration - n * RC5_HALF_BIT));
 
-    for (int i = 1; i < 16 * mSize; i++) {
-        digitalWrite(CLOCK, HIGH);
-        delayMicroseconds(TIME);
-        digitalWrite(CLOCK, LOW);
+    for (int i = 0; i < n; i++) {
+        mHalfBits = (mHalfBits << 1) | (mark ? 1 : 0);
+        mCount++;
+    }
 
-        delayMicroseconds(TIME / 2);
-        bitWrite(mSwitches[myByte], myBit++, digitalRead(DATA));
+    return false;
+}
 
-        if (myBit == 8) {
-            myByte++;
-            myBit = 0;
-        }
+boolean TrackDecoderInfrared::decode() {
+    if (mCount != RC5_FRAME || !bitRead(mHalfBits, RC5_FRAME - 1)) {
+        return false;
+    }
 
-        delayMicroseconds(TIME / 2);
+    // Second start bit is a one for RC5, a zero (inverted bit 6) for RC5X
+    byte start = (mHalfBits >> (RC5_FRAME - 3)) & 0b11;
+    if (start != 0b01 && start != 0b10) {
+        return false;
+    }
+
+    word data = 0;
+
+    for (int i = 11; i >= 0; i--) {
+        byte pair = (mHalfBits >> (2 * i)) & 0b11;
+        if (pair == 0b01) {
+            data = (data << 1) | 1;
+        } else if (pair == 0b10) {
+            data = data << 1;
+        } else {
+            return false;
+        }
     }
+
+    mToggle = bitRead(data, 11);
+    mAddress = (data >> 6) & 0x1f;
+    mCommand = (data & 0x3f) | (start == 0b10 ? 0x40 : 0x00);
+    mTimingError = mError;
+
+    return true;
 }
 
-boolean TrackReporterS88::getValue(int index) {
-    index--;
-    return bitRead(mSwitches[index / 8], index % 8);
+word TrackDecoderInfrared::getAddress() {
+    return mAddress;
 }
 
+word TrackDecoderInfrared::getCommand() {
+    return mCommand;
+}
+
+boolean TrackDecoderInfrared::getToggle() {
+    return mToggle;
+}
+
+word TrackDecoderInfrared::getTimingError() {
+    return mTimingError;
+}
+
+word TrackDecoderInfrared::getFrames() {
+    return mFrames;
+}
+
+word TrackDecoderInfrared::getErrors() {
+    return mErrors;
+}
+
+#if !defined(__NOCAN__)
 
-#if !defined(__ESP__)
 // ===================================================================
-// === TrackReporterIOX ==============================================
+// === TrackCapture ==================================================
 // ===================================================================
 
+TrackCapture::TrackCapture() {
+    mController = NULL;
+    mOut = NULL;
+    mStart = 0;
+    mCount = 0;
+}
 
-void SPI_begin() {
-    digitalWrite(SS, HIGH);
-    pinMode(SS, OUTPUT);
+void TrackCapture::begin(TrackController &controller, Print &out) {
+    end();
 
-    SPCR |= _BV(MSTR);
-    SPCR |= _BV(SPE);
+    mController = &controller;
+    mOut = &out;
+    mStart = millis();
+    mCount = 0;
 
-    pinMode(SCK, OUTPUT);
-    pinMode(MOSI, OUTPUT);
+    writeHeader(out);
+
+    mController->addListener(this);
 }
 
-byte SPI_transfer(byte _data) {
-    SPDR = _data;
-    while (!(SPSR & _BV(SPIF)))
-    ;
-    return SPDR;
+void TrackCapture::end() {
+    if (mController != NULL) {
+        mController->removeListener(this);
+    }
+
+    mController = NULL;
+    mOut = NULL;
 }
 
-byte ioxCount;
+unsigned long TrackCapture::getCount() {
+    return mCount;
+}
+
+void TrackCapture::messageReceived(TrackMessage &message) {
+    if (mOut != NULL) {
+        // Microseconds wrap after 71 minutes, so only the age of the
+        // message is taken from them
+        unsigned long age = (micros() - mController->getReceiveTime()) / 1000;
+        unsigned long time = millis() - mStart;
+
+        writeRecord(*mOut, message, age < time ? time - age : 0);
+        mCount++;
+    }
+}
+
+size_t TrackCapture::writeHeader(Print &p) {
+    return p.print(F("RLC1"));
+}
 
-byte ioxSwitches[16];
+size_t TrackCapture::writeRecord(Print &p, TrackMessage &message, unsigned long time) {
+    byte record[16];
+    byte length = message.length > 8 ? 8 : message.length;
 
-byte ioxSwitches2[16];
+    for (int i = 0; i < 4; i++) {
+        record[i] = (time >> (8 * i)) & 0xff;
+    }
 
-unsigned int readRegister(byte address, byte index) {
-    digitalWrite(6, LOW);
+    record[4] = message.command;
+    record[5] = highByte(message.hash);
+    record[6] = lowByte(message.hash);
+    record[7] = (message.response ? 0x80 : 0x00) | length;
 
-    SPI_transfer(65 | (address << 1));
-    SPI_transfer(index);
-    unsigned int result = SPI_transfer(255);
+    for (int i = 0; i < length; i++) {
+        record[8 + i] = message.data[i];
+    }
+
+    return p.write(record, 8 + length);
+}
 
-    digitalWrite(6, HIGH);
+boolean TrackCapture::readHeader(Stream &s) {
+    char header[4];
 
-    return result;
+    return s.readBytes(header, 4) == 4 && memcmp(header, "RLC1", 4) == 0;
 }
 
-void writeRegister(byte address, byte index, byte value) {
-    digitalWrite(6, LOW);
+boolean TrackCapture::readRecord(Stream &s, TrackMessage &message, unsigned long *time) {
+    byte record[16];
 
-    SPI_transfer(64 | (address << 1));
-    SPI_transfer(index);
-    SPI_transfer(value);
+    if (s.readBytes((char *) record, 8) != 8) {
+        return false;
+    }
 
-    digitalWrite(6, HIGH);
+    byte length = record[7] & 0x0f;
+
+    if (length > 8 || s.readBytes((char *) record + 8, length) != length) {
+        return false;
+    }
+
+    message.clear();
+
+    *time = 0;
+    for (int i = 3; i >= 0; i--) {
+        *time = (*time << 8) | record[i];
+    }
+
+    message.command = record[4];
+    message.hash = word(record[5], record[6]);
+    message.response = (record[7] & 0x80) != 0;
+    message.length = length;
+
+    for (int i = 0; i < length; i++) {
+        message.data[i] = record[8 + i];
+    }
+
+    return true;
 }
 
-void handleInterrupt0() {
-    noInterrupts();
+#endif // !defined(__NOCAN__)
 
-    for (int i = 0; i < ioxCount; i++) {
-        ioxSwitches[2 * i] = readRegister(i, 9);
-        ioxSwitches[2 * i + 1] = readRegister(16 + i, 9);
+// ===================================================================
+// === TrackFilter ===================================================
+// ===================================================================
+
+TrackFilter::TrackFilter() {
+    memset(mCount, 0, sizeof(mCount));
+    memset(mDebounce, 0, sizeof(mDebounce));
+    memset(mHold, 0, sizeof(mHold));
+
+    mHoldTick = 0;
+    mLastTick = 0;
+}
 
-        ioxSwitches2[2 * i] |= ioxSwitches[2 * i];
-        ioxSwitches2[2 * i + 1] |= ioxSwitches[2 * i + 1];
+/**
+ * Writes the given value into the bit planes of the given contact, or
+ * of all contacts for index 0. Each plane holds one bit of the value.
+ */
+static void setPlanes(byte *planes, int count, int index, byte value) {
+    int first = 0;
+    int last = 8 * FILTER_BYTES - 1;
+
+    if (index != 0) {
+        first = last = index - 1;
     }
 
-    interrupts();
+    for (int i = first; i <= last; i++) {
+        for (int j = 0; j < count; j++) {
+            bitWrite(planes[j * FILTER_BYTES + i / 8], i % 8, bitRead(value, j));
+        }
+    }
 }
 
-TrackReporterIOX::TrackReporterIOX(int modules) {
-    mCount = modules;
+void TrackFilter::setDebounce(int index, byte samples) {
+    if (samples < 1 || samples > 8 || index < 0 || index > 8 * FILTER_BYTES) {
+        return;
+    }
 
-    ioxCount = modules;
+    setPlanes(&mDebounce[0][0], 3, index, samples - 1);
+}
 
-    digitalWrite(6, HIGH);
-    pinMode(6, OUTPUT);
+void TrackFilter::setHold(int index, byte ticks) {
+    if (ticks > 15 || index < 0 || index > 8 * FILTER_BYTES) {
+        return;
+    }
 
-    SPI_begin();
+    setPlanes(&mHold[0][0], 4, index, ticks);
+}
 
-    noInterrupts();
-    for (int i = 0; i < mCount; i++) {
-        writeRegister(i, 5, 76);   // Open drain, banks in case of 16 bit
+void TrackFilter::setHoldTick(word time) {
+    mHoldTick = time;
+    mLastTick = millis();
+}
+
+void TrackFilter::apply(byte *values, byte *state, int size) {
+    // Releases (occupied -> free) are only counted on hold ticks
+    byte tick = 0xff;
 
-        for (int j = 0; j <= 16; j += 16) {
-            writeRegister(i, j + 0, 255); // IODIR: All GPIOs are inputs
-            writeRegister(i, j + 1, 255); // IOPOL: GND means locial 1
-            writeRegister(i, j + 2, 255); // GPINTEN: All interrupts enabled
-            writeRegister(i, j + 3, 0);   // DEFVAL: Compare default value
-            //writeRegister(i, j + 4, 255); // INTCON: Compare against default value
-            writeRegister(i, j + 6, 255); // Pull-up resistors
-            readRegister(i, j + 9);
+    if (mHoldTick != 0) {
+        if (millis() - mLastTick >= mHoldTick) {
+            mLastTick += mHoldTick;
+        } else {
+            tick = 0x00;
         }
     }
 
-    attachInterrupt(1, &handleInterrupt0, LOW);
-    interrupts();
+    for (int i = 0; i < size && i < FILTER_BYTES; i++) {
+        byte s = state[i];
+        byte d = values[i] ^ s;
+
+        // Contacts agreeing with the filtered value start over
+        byte c0 = mCount[0][i] & d;
+        byte c1 = mCount[1][i] & d;
+        byte c2 = mCount[2][i] & d;
+        byte c3 = mCount[3][i] & d;
+
+        // Free contacts use the debounce, occupied ones the hold time
+        byte t0 = (~s & mDebounce[0][i]) | (s & mHold[0][i]);
+        byte t1 = (~s & mDebounce[1][i]) | (s & mHold[1][i]);
+        byte t2 = (~s & mDebounce[2][i]) | (s & mHold[2][i]);
+        byte t3 = s & mHold[3][i];
+
+        byte e = d & (~s | tick);
+        byte flip = e & ~((c0 ^ t0) | (c1 ^ t1) | (c2 ^ t2) | (c3 ^ t3));
+
+        // Ripple-carry increment for the remaining candidates
+        byte carry = e & ~flip;
+        c0 ^= carry; carry &= ~c0;
+        c1 ^= carry; carry &= ~c1;
+        c2 ^= carry; carry &= ~c2;
+        c3 ^= carry;
+
+        mCount[0][i] = c0 & ~flip;
+        mCount[1][i] = c1 & ~flip;
+        mCount[2][i] = c2 & ~flip;
+        mCount[3][i] = c3 & ~flip;
+
+        state[i] = s ^ flip;
+        values[i] = flip;
+    }
+
+    // Contacts without counters are passed through unfiltered
+    for (int i = FILTER_BYTES; i < size; i++) {
+        values[i] ^= state[i];
+        state[i] ^= values[i];
+    }
 }
 
-TrackReporterIOX::~TrackReporterIOX() {
-    detachInterrupt(1);
+// ===================================================================
+// === TrackEventQueue ===============================================
+// ===================================================================
+
+TrackEventQueue::TrackEventQueue() {
+    clear();
 }
 
-void TrackReporterIOX::refresh() {
+void TrackEventQueue::clear() {
     noInterrupts();
 
-    for (int i = 0; i < mCount; i++) {
-        mSwitches[i] = ioxSwitches2[i];
-        ioxSwitches2[i] = ioxSwitches[i];
-    }
+    mRead = 0;
+    mWrite = 0;
+    mLength = 0;
+    mOverflows = 0;
 
     interrupts();
 }
 
-boolean TrackReporterIOX::getValue(int index) {
-    index--;
-    return bitRead(mSwitches[index / 8], index % 8);
+void TrackEventQueue::push(word contact, boolean active, unsigned long time) {
+    if (mLength == REPORTER_EVENTS) {
+        mOverflows++;
+        return;
+    }
+
+    mContacts[mWrite] = active ? contact | 0x8000 : contact;
+    mTimes[mWrite] = time;
+
+    mWrite = (mWrite + 1) % REPORTER_EVENTS;
+    mLength++;
 }
-#endif // !defined(__ESP__)
+
+boolean TrackEventQueue::pop(TrackEvent &event) {
+    noInterrupts();
+
+    if (mLength == 0) {
+        interrupts();
+        return false;
+    }
+
+    event.contact = mContacts[mRead] & 0x7fff;
+    event.active = (mContacts[mRead] & 0x8000) != 0;
+    event.time = mTimes[mRead];
+
+    mRead = (mRead + 1) % REPORTER_EVENTS;
+    mLength--;
+
+    interrupts();
+
+    return true;
+}
+
+word TrackEventQueue::getOverflows() {
+    noInterrupts();
+    word result = mOverflows;
+    interrupts();
+
+    return result;
+}
+
+// ===================================================================
+// === TrackReporter =================================================
+// ===================================================================
+
+TrackReporterBuffered::TrackReporterBuffered(int size, byte *switches, byte *changes, int bytes) {
+    mSize = min(size, 8 * bytes);
+    mSwitches = switches;
+    mChanges = changes;
+
+    memset(mSwitches, 0, bytes);
+    memset(mChanges, 0, bytes);
+}
+
+void TrackReporterBuffered::update() {
+    mFilter.apply(mChanges, mSwitches, (mSize + 7) / 8);
+}
+
+int TrackReporterBuffered::getSize() {
+    return mSize;
+}
+
+boolean TrackReporterBuffered::getValue(int index) {
+    if (index < 1 || index > mSize) {
+        return false;
+    }
+
+    index--;
+    return bitRead(mSwitches[index / 8], index % 8);
+}
+
+boolean TrackReporterBuffered::hasChanged(int index) {
+    if (index < 1 || index > mSize) {
+        return false;
+    }
+
+    index--;
+    return bitRead(mChanges[index / 8], index % 8);
+}
+
+int TrackReporterBuffered::nextChange(int index) {
+    if (index < 0) {
+        index = 0;
+    }
+
+    while (index < mSize) {
+        byte b = mChanges[index / 8] >> (index % 8);
+
+        if (b == 0) {
+            index = (index / 8 + 1) * 8;
+        } else {
+            while (!(b & 1)) {
+                b >>= 1;
+                index++;
+            }
+
+            return index < mSize ? index + 1 : 0;
+        }
+    }
+
+    return 0;
+}
+
+boolean TrackReporterBuffered::getEvent(TrackEvent &event) {
+    return mEvents.pop(event);
+}
+
+word TrackReporterBuffered::getOverflows() {
+    return mEvents.getOverflows();
+}
+
+void TrackReporterBuffered::setDebounce(int index, byte samples) {
+    mFilter.setDebounce(index, samples);
+}
+
+void TrackReporterBuffered::setHold(int index, byte ticks) {
+    mFilter.setHold(index, ticks);
+}
+
+void TrackReporterBuffered::setHoldTick(word time) {
+    mFilter.setHoldTick(time);
+}
+
+// ===================================================================
+// === TrackReporterS88 ==============================================
+// ===================================================================
+
+const int DATA = A0;
+const int CLOCK = 2;
+const int LOAD = 3;
+const int RESET = 4;
+
+const int TIME = 50;
+
+TrackReporterS88::TrackReporterS88(int modules) : TrackReporterBuffered(16 * modules, mBuffers[0], mBuffers[1], REPORTER_BYTES) {
+    memset(mLast, 0, sizeof(mLast));
+
+    // pinMode(DATA, INPUT);
+    pinMode(CLOCK, OUTPUT);
+    pinMode(LOAD, OUTPUT);
+    pinMode(RESET, OUTPUT);
+}
+
+void TrackReporterS88::refresh() {
+    for (int i = 0; i < (mSize + 7) / 8; i++) {
+        mChanges[i] = 0;
+    }
+
+    digitalWrite(LOAD, HIGH);
+    delayMicroseconds( TIME);
+    digitalWrite(CLOCK, HIGH);
+    delayMicroseconds(TIME);
+    digitalWrite(CLOCK, LOW);
+    delayMicroseconds(TIME);
+    digitalWrite(RESET, HIGH);
+    delayMicroseconds(TIME);
+    digitalWrite(RESET, LOW);
+    delayMicroseconds(TIME);
+    digitalWrite(LOAD, LOW);
+
+    for (int i = 0; i < mSize; i++) {
+        if (i != 0) {
+            digitalWrite(CLOCK, HIGH);
+            delayMicroseconds(TIME);
+            digitalWrite(CLOCK, LOW);
+        }
+
+        delayMicroseconds(TIME / 2);
+
+        boolean value = digitalRead(DATA);
+        bitWrite(mChanges[i / 8], i % 8, value);
+
+        if (value != bitRead(mLast[i / 8], i % 8)) {
+            mEvents.push(i + 1, value, micros());
+        }
+
+        delayMicroseconds(TIME / 2);
+    }
+
+    memcpy(mLast, mChanges, (mSize + 7) / 8);
+
+    update();
+}
+
+#if !defined(__ESP__)
+// ===================================================================
+// === TrackReporterIOX ==============================================
+// ===================================================================
+
+
+void SPI_begin() {
+    digitalWrite(SS, HIGH);
+    pinMode(SS, OUTPUT);
+
+    SPCR |= _BV(MSTR);
+    SPCR |= _BV(SPE);
+
+    pinMode(SCK, OUTPUT);
+    pinMode(MOSI, OUTPUT);
+}
+
+byte SPI_transfer(byte _data) {
+    SPDR = _data;
+    while (!(SPSR & _BV(SPIF)))
+    ;
+    return SPDR;
+}
+
+/**
+ * Register numbers in BANK=1 mode, which gives the MCP 23S17 the same
+ * layout as the MCP 23S08 for port A, with port B following at 0x10.
+ */
+#define IOX_IODIR   0x00
+#define IOX_IPOL    0x01
+#define IOX_GPINTEN 0x02
+#define IOX_DEFVAL  0x03
+#define IOX_IOCON   0x05
+#define IOX_GPPU    0x06
+#define IOX_INTF    0x07
+#define IOX_INTCAP  0x08
+#define IOX_GPIO    0x09
+#define IOX_PORT_B  0x10
+
+/**
+ * The shared (open drain) interrupt line, read back in the handler.
+ */
+const int INTERRUPT = 3;
+
+/**
+ * Number of chip select groups, each with up to eight expanders.
+ */
+#define IOX_GROUPS ((IOX_BYTES + 15) / 16)
+
+/**
+ * Default chip select pins, one per group of eight expanders.
+ */
+const byte ioxDefaultSelects[] = { 6, 7, 8, 9 };
+
+byte ioxCount;
+
+byte ioxSelects[IOX_GROUPS];
+
+byte ioxSwitches[IOX_BYTES];
+
+byte ioxSwitches2[IOX_BYTES];
+
+TrackEventQueue *ioxEvents;
+
+/**
+ * Starts a transfer to the given expander, which is selected by its
+ * group's chip select pin and its hardware address within the group.
+ */
+void ioxSelect(byte chip, byte opcode) {
+    digitalWrite(ioxSelects[chip / 8], LOW);
+    SPI_transfer(opcode | ((chip % 8) << 1));
+}
+
+void ioxDeselect(byte chip) {
+    digitalWrite(ioxSelects[chip / 8], HIGH);
+}
+
+unsigned int readRegister(byte chip, byte index) {
+    ioxSelect(chip, 65);
+
+    SPI_transfer(index);
+    unsigned int result = SPI_transfer(255);
+
+    ioxDeselect(chip);
+
+    return result;
+}
+
+void writeRegister(byte chip, byte index, byte value) {
+    ioxSelect(chip, 64);
+
+    SPI_transfer(index);
+    SPI_transfer(value);
+
+    ioxDeselect(chip);
+}
+
+/**
+ * Reads the interrupt flags of the given port and, only if any are
+ * set, the port value captured at interrupt time, all in a single
+ * sequential transfer. Reading INTCAP clears the interrupt.
+ */
+boolean readCapture(byte chip, byte port, byte *value) {
+    boolean result = false;
+
+    ioxSelect(chip, 65);
+
+    SPI_transfer(port + IOX_INTF);
+
+    if (SPI_transfer(255) != 0) {
+        *value = SPI_transfer(255);
+        result = true;
+    }
+
+    ioxDeselect(chip);
+
+    return result;
+}
+
+/**
+ * Configures one port of the given expander in a single sequential
+ * transfer covering IODIR up to GPPU.
+ */
+void writePort(byte chip, byte port) {
+    ioxSelect(chip, 64);
+
+    SPI_transfer(port + IOX_IODIR);
+    SPI_transfer(255); // IODIR: All GPIOs are inputs
+    SPI_transfer(255); // IPOL: GND means locial 1
+    SPI_transfer(255); // GPINTEN: All interrupts enabled
+    SPI_transfer(0);   // DEFVAL: Compare default value
+    SPI_transfer(0);   // INTCON: Compare against previous value
+    SPI_transfer(204); // IOCON: Banks, mirror, HAEN, open drain
+    SPI_transfer(255); // GPPU: Pull-up resistors
+
+    ioxDeselect(chip);
+}
+
+void ioxUpdate(int index, byte value) {
+    byte changes = value ^ ioxSwitches[index];
+
+    if (changes != 0) {
+        unsigned long time = micros();
+
+        for (int i = 0; i < 8; i++) {
+            if (bitRead(changes, i)) {
+                ioxEvents->push(8 * index + i + 1, bitRead(value, i), time);
+            }
+        }
+    }
+
+    ioxSwitches[index] = value;
+    ioxSwitches2[index] |= value;
+}
+
+void handleInterrupt0() {
+    noInterrupts();
+
+    byte value;
+
+    for (int i = 0; i < ioxCount; i++) {
+        if (readCapture(i, 0, &value)) {
+            ioxUpdate(2 * i, value);
+        }
+
+        if (readCapture(i, IOX_PORT_B, &value)) {
+            ioxUpdate(2 * i + 1, value);
+        }
+
+        // Line released means no other chip has anything pending
+        if (digitalRead(INTERRUPT) == HIGH) {
+            break;
+        }
+    }
+
+    interrupts();
+}
+
+TrackReporterIOX::TrackReporterIOX(int modules) : TrackReporterBuffered(16 * modules, mBuffers[0], mBuffers[1], IOX_BYTES) {
+    init(min(modules, 8 * (int)sizeof(ioxDefaultSelects)), ioxDefaultSelects);
+}
+
+TrackReporterIOX::TrackReporterIOX(int modules, const byte selects[]) : TrackReporterBuffered(16 * modules, mBuffers[0], mBuffers[1], IOX_BYTES) {
+    init(modules, selects);
+}
+
+void TrackReporterIOX::init(int modules, const byte selects[]) {
+    mCount = min(modules, IOX_BYTES / 2);
+    mSize = 16 * mCount;
+
+    ioxCount = mCount;
+    ioxEvents = &mEvents;
+
+    for (int i = 0; i < (mCount + 7) / 8; i++) {
+        ioxSelects[i] = selects[i];
+
+        digitalWrite(selects[i], HIGH);
+        pinMode(selects[i], OUTPUT);
+    }
+
+    SPI_begin();
+
+    noInterrupts();
+
+    // Until HAEN is set all chips of a group listen to address 0. The
+    // MCP 23S17 powers up with BANK=0, where IOCON lives at 0x0a, which
+    // is the (unused) OLAT on the MCP 23S08. Afterwards both have it
+    // at 0x05.
+    for (int i = 0; i < mCount; i += 8) {
+        writeRegister(i, 0x0a, 204); // Banks, mirror, HAEN, open drain
+        writeRegister(i, IOX_IOCON, 204);
+    }
+
+    for (int i = 0; i < mCount; i++) {
+        for (int j = 0; j <= IOX_PORT_B; j += IOX_PORT_B) {
+            writePort(i, j);
+            ioxSwitches[2 * i + j / IOX_PORT_B] = readRegister(i, j + IOX_GPIO);
+        }
+    }
+
+    attachInterrupt(1, &handleInterrupt0, LOW);
+    interrupts();
+}
+
+TrackReporterIOX::~TrackReporterIOX() {
+    detachInterrupt(1);
+}
+
+void TrackReporterIOX::refresh() {
+    noInterrupts();
+
+    for (int i = 0; i < 2 * mCount; i++) {
+        mChanges[i] = ioxSwitches2[i];
+        ioxSwitches2[i] = ioxSwitches[i];
+    }
+
+    interrupts();
+
+    update();
+}
+
+#endif // !defined(__ESP__)
+
+#if !defined(__NOCAN__)
+
+// ===================================================================
+// === TrackReporterCAN ==============================================
+// ===================================================================
+
+TrackReporterCAN::TrackReporterCAN(TrackController &controller, word device, int size) : TrackReporterBuffered(size, mBuffers[0], mBuffers[1], CAN_REPORTER_BYTES) {
+    mController = &controller;
+    mDevice = device;
+
+    memset(mCurrent, 0, sizeof(mCurrent));
+    memset(mLatched, 0, sizeof(mLatched));
+
+    mController->addListener(this);
+}
+
+TrackReporterCAN::~TrackReporterCAN() {
+    mController->removeListener(this);
+}
+
+void TrackReporterCAN::messageReceived(TrackMessage &message) {
+    if (message.command != 0x11 || message.length < 6) {
+        return;
+    }
+
+    word device = word(message.data[0], message.data[1]);
+    word contact = word(message.data[2], message.data[3]);
+
+    if (device != mDevice || contact < 1 || contact > mSize) {
+        return;
+    }
+
+    boolean value = message.data[5] != 0;
+
+    int index = contact - 1;
+
+    if (value != bitRead(mCurrent[index / 8], index % 8)) {
+        mEvents.push(contact, value, mController->getReceiveTime());
+    }
+
+    bitWrite(mCurrent[index / 8], index % 8, value);
+
+    if (value) {
+        bitSet(mLatched[index / 8], index % 8);
+    }
+}
+
+void TrackReporterCAN::refresh() {
+    mController->poll();
+
+    for (int i = 0; i < (mSize + 7) / 8; i++) {
+        mChanges[i] = mLatched[i];
+        mLatched[i] = mCurrent[i];
+    }
+
+    update();
+}
+
+#endif // !defined(__NOCAN__)
+
+// ===================================================================
+// === TrackReporterComposite ========================================
+// ===================================================================
+
+TrackReporterComposite::TrackReporterComposite() {
+    mCount = 0;
+}
+
+boolean TrackReporterComposite::add(TrackReporter &reporter) {
+    if (mCount == REPORTER_CHILDREN) {
+        return false;
+    }
+
+    mChildren[mCount++] = &reporter;
+
+    return true;
+}
+
+TrackReporter *TrackReporterComposite::find(int &index) {
+    for (int i = 0; i < mCount; i++) {
+        int size = mChildren[i]->getSize();
+
+        if (index <= size) {
+            return mChildren[i];
+        }
+
+        index -= size;
+    }
+
+    return NULL;
+}
+
+void TrackReporterComposite::refresh() {
+    for (int i = 0; i < mCount; i++) {
+        mChildren[i]->refresh();
+    }
+}
+
+int TrackReporterComposite::getSize() {
+    int size = 0;
+
+    for (int i = 0; i < mCount; i++) {
+        size += mChildren[i]->getSize();
+    }
+
+    return size;
+}
+
+boolean TrackReporterComposite::getValue(int index) {
+    TrackReporter *child = find(index);
+    return child != NULL && child->getValue(index);
+}
+
+boolean TrackReporterComposite::hasChanged(int index) {
+    TrackReporter *child = find(index);
+    return child != NULL && child->hasChanged(index);
+}
+
+int TrackReporterComposite::nextChange(int index) {
+    int offset = 0;
+
+    for (int i = 0; i < mCount; i++) {
+        int size = mChildren[i]->getSize();
+
+        if (index < offset + size) {
+            int next = mChildren[i]->nextChange(max(index - offset, 0));
+
+            if (next != 0) {
+                return offset + next;
+            }
+        }
+
+        offset += size;
+    }
+
+    return 0;
+}
+
+boolean TrackReporterComposite::getEvent(TrackEvent &event) {
+    int offset = 0;
+
+    for (int i = 0; i < mCount; i++) {
+        if (mChildren[i]->getEvent(event)) {
+            event.contact += offset;
+            return true;
+        }
+
+        offset += mChildren[i]->getSize();
+    }
+
+    return false;
+}
+
+word TrackReporterComposite::getOverflows() {
+    word result = 0;
+
+    for (int i = 0; i < mCount; i++) {
+        result += mChildren[i]->getOverflows();
+    }
+
+    return result;
+}
+
+void TrackReporterComposite::setDebounce(int index, byte samples) {
+    if (index == 0) {
+        for (int i = 0; i < mCount; i++) {
+            mChildren[i]->setDebounce(0, samples);
+        }
+    } else {
+        TrackReporter *child = find(index);
+
+        if (child != NULL) {
+            child->setDebounce(index, samples);
+        }
+    }
+}
+
+void TrackReporterComposite::setHold(int index, byte ticks) {
+    if (index == 0) {
+        for (int i = 0; i < mCount; i++) {
+            mChildren[i]->setHold(0, ticks);
+        }
+    } else {
+        TrackReporter *child = find(index);
+
+        if (child != NULL) {
+            child->setHold(index, ticks);
+        }
+    }
+}
+
+void TrackReporterComposite::setHoldTick(word time) {
+    for (int i = 0; i < mCount; i++) {
+        mChildren[i]->setHoldTick(time);
+    }
+}
+
+#if !defined(__NOCAN__)
+
+// ===================================================================
+// === TrackScheduler ================================================
+// ===================================================================
+
+#define TASK_READY    0 // Run on next update
+#define TASK_TIME     1 // Run after timeout
+#define TASK_CONTACT  2 // Run on contact change or after timeout
+#define TASK_RESPONSE 3 // Run on response or after timeout
+#define TASK_DONE     4 // Finished
+
+TrackTask::TrackTask() {
+    mScheduler = NULL;
+    mNext = NULL;
+    mWait = TASK_DONE;
+    mResult = true;
+    mState = 0;
+}
+
+boolean TrackTask::isRunning() {
+    return mScheduler != NULL;
+}
+
+void TrackTask::sleep(word time) {
+    mWait = TASK_TIME;
+    mStart = millis();
+    mTimeout = time;
+}
+
+void TrackTask::waitForContact(int index, boolean active, word timeout) {
+    mWait = TASK_CONTACT;
+    mContact = index;
+    mActive = active;
+    mStart = millis();
+    mTimeout = timeout;
+}
+
+void TrackTask::request(TrackMessage &message, word timeout) {
+    mMessage = message;
+    mWait = TASK_RESPONSE;
+    mStart = millis();
+    mTimeout = timeout;
+
+    if (mScheduler == NULL || !mScheduler->sendMessage(mMessage)) {
+        mWait = TASK_READY;
+        mResult = false;
+    }
+}
+
+void TrackTask::setLocoSpeed(word address, word speed) {
+    TrackMessage message;
+
+    message.clear();
+    message.command = 0x04;
+    message.length = 0x06;
+    message.data[2] = highByte(address);
+    message.data[3] = lowByte(address);
+    message.data[4] = highByte(speed);
+    message.data[5] = lowByte(speed);
+
+    request(message, 1000);
+}
+
+void TrackTask::setLocoDirection(word address, byte direction) {
+    TrackMessage message;
+
+    message.clear();
+    message.command = 0x05;
+    message.length = 0x05;
+    message.data[2] = highByte(address);
+    message.data[3] = lowByte(address);
+    message.data[4] = direction;
+
+    request(message, 1000);
+}
+
+void TrackTask::setLocoFunction(word address, byte function, byte power) {
+    TrackMessage message;
+
+    message.clear();
+    message.command = 0x06;
+    message.length = 0x06;
+    message.data[2] = highByte(address);
+    message.data[3] = lowByte(address);
+    message.data[4] = function;
+    message.data[5] = power;
+
+    request(message, 1000);
+}
+
+void TrackTask::setAccessory(word address, byte position, byte power) {
+    TrackMessage message;
+
+    message.clear();
+    message.command = 0x0b;
+    message.length = 0x06;
+    message.data[2] = highByte(address);
+    message.data[3] = lowByte(address);
+    message.data[4] = position;
+    message.data[5] = power;
+
+    request(message, 1000);
+}
+
+boolean TrackTask::getResult() {
+    return mResult;
+}
+
+TrackMessage &TrackTask::getResponse() {
+    return mMessage;
+}
+
+void TrackTask::finish() {
+    mWait = TASK_DONE;
+}
+
+boolean TrackTask::isDue(TrackReporter *reporter, unsigned long now) {
+    boolean expired = mTimeout != 0 && now - mStart >= mTimeout;
+
+    switch (mWait) {
+        case TASK_READY:
+            return true;
+
+        case TASK_TIME:
+            return now - mStart >= mTimeout;
+
+        case TASK_CONTACT:
+            if (reporter != NULL && reporter->hasChanged(mContact) && reporter->getValue(mContact) == mActive) {
+                mResult = true;
+                return true;
+            }
+            // Fall through
+
+        case TASK_RESPONSE:
+            if (expired) {
+                mResult = false;
+                return true;
+            }
+    }
+
+    return false;
+}
+
+TrackScheduler::TrackScheduler(TrackController &controller, TrackReporter *reporter) {
+    mController = &controller;
+    mReporter = reporter;
+    mTasks = NULL;
+
+    mController->addListener(this);
+}
+
+TrackScheduler::~TrackScheduler() {
+    mController->removeListener(this);
+}
+
+void TrackScheduler::start(TrackTask &task) {
+    if (task.mScheduler != NULL) {
+        return;
+    }
+
+    task.mScheduler = this;
+    task.mNext = NULL;
+    task.mWait = TASK_READY;
+    task.mResult = true;
+    task.mState = 0;
+
+    // Append, so tasks run in the order they were started
+    TrackTask **p = &mTasks;
+    while (*p != NULL) {
+        p = &(*p)->mNext;
+    }
+
+    *p = &task;
+}
+
+void TrackScheduler::stop(TrackTask &task) {
+    if (task.mScheduler != this) {
+        return;
+    }
+
+    // Keep task.mNext, update() might still be walking through it
+    TrackTask **p = &mTasks;
+    while (*p != NULL) {
+        if (*p == &task) {
+            *p = task.mNext;
+            break;
+        }
+
+        p = &(*p)->mNext;
+    }
+
+    task.mScheduler = NULL;
+    task.mWait = TASK_DONE;
+}
+
+int TrackScheduler::getCount() {
+    int count = 0;
+
+    for (TrackTask *t = mTasks; t != NULL; t = t->mNext) {
+        count++;
+    }
+
+    return count;
+}
+
+void TrackScheduler::update() {
+    if (mReporter != NULL) {
+        mReporter->refresh();
+    }
+
+    // Answers come in through messageReceived()
+    mController->poll();
+
+    unsigned long now = millis();
+
+    TrackTask *task = mTasks;
+    while (task != NULL) {
+        TrackTask *next = task->mNext;
+
+        if (task->mScheduler == this && task->isDue(mReporter, now)) {
+            task->mWait = TASK_READY;
+            task->run();
+
+            if (task->mWait == TASK_DONE) {
+                stop(*task);
+            }
+        }
+
+        task = next;
+    }
+}
+
+void TrackScheduler::messageReceived(TrackMessage &message) {
+    if (!message.response) {
+        return;
+    }
+
+    for (TrackTask *t = mTasks; t != NULL; t = t->mNext) {
+        if (t->mWait == TASK_RESPONSE
+                && t->mMessage.command == message.command
+                && memcmp(t->mMessage.data, message.data, 4) == 0) {
+            t->mMessage = message;
+            t->mWait = TASK_READY;
+            t->mResult = true;
+            return;
+        }
+    }
+}
+
+boolean TrackScheduler::sendMessage(TrackMessage &message) {
+    return mController->sendMessage(message);
+}
+
+#endif // !defined(__NOCAN__)
+
+// ===================================================================
+// === TrackLayout ===================================================
+// ===================================================================
+
+TrackLayout::TrackLayout(const TrackBlock *blocks, byte blockCount, byte contactCount,
+                         const byte *entered, const byte *left, const byte *previous,
+                         const word *turnouts, byte turnoutCount,
+                         const TrackRoute *routes, const uint64_t *conflicts, byte routeCount) {
+    mBlocks = blocks;
+    mBlockCount = blockCount;
+    mContactCount = contactCount;
+    mEntered = entered;
+    mLeft = left;
+    mPrevious = previous;
+    mTurnouts = turnouts;
+    mTurnoutCount = turnoutCount;
+    mRoutes = routes;
+    mConflicts = conflicts;
+    mRouteCount = routeCount;
+}
+
+int TrackLayout::getBlockCount() {
+    return mBlockCount;
+}
+
+int TrackLayout::getContactCount() {
+    return mContactCount;
+}
+
+int TrackLayout::getTurnoutCount() {
+    return mTurnoutCount;
+}
+
+int TrackLayout::getRouteCount() {
+    return mRouteCount;
+}
+
+TrackBlock TrackLayout::getBlock(int index) {
+    TrackBlock block;
+
+    memcpy_P(&block, &mBlocks[index - 1], sizeof(TrackBlock));
+
+    return block;
+}
+
+int TrackLayout::getEnteredBlock(int contact) {
+    return contact <= mContactCount ? pgm_read_byte(&mEntered[contact]) : 0;
+}
+
+int TrackLayout::getLeftBlock(int contact) {
+    return contact <= mContactCount ? pgm_read_byte(&mLeft[contact]) : 0;
+}
+
+int TrackLayout::getPreviousBlock(int index) {
+    return pgm_read_byte(&mPrevious[index]);
+}
+
+word TrackLayout::getTurnout(int index) {
+    return pgm_read_word(&mTurnouts[index]);
+}
+
+TrackRoute TrackLayout::getRoute(int index) {
+    TrackRoute route;
+
+    memcpy_P(&route, &mRoutes[index - 1], sizeof(TrackRoute));
+
+    return route;
+}
+
+uint64_t TrackLayout::getConflicts(int index) {
+    uint64_t conflicts;
+
+    // A layout without routes has no conflicts either
+    if (mConflicts == NULL) {
+        return 0;
+    }
+
+    memcpy_P(&conflicts, &mConflicts[index - 1], sizeof(uint64_t));
+
+    return conflicts;
+}
+
+#if !defined(__NOCAN__)
+
+// ===================================================================
+// === TrackBlocks ===================================================
+// ===================================================================
+
+TrackBlocks::TrackBlocks(TrackController &controller, TrackReporter &reporter, TrackLayout &layout) {
+    mController = &controller;
+    mReporter = &reporter;
+    mLayout = &layout;
+    mCount = layout.getBlockCount() > TRACK_BLOCKS ? TRACK_BLOCKS : layout.getBlockCount();
+
+    reset();
+}
+
+void TrackBlocks::reset() {
+    memset(mTrains, 0, sizeof(mTrains));
+    memset(mSpeeds, 0, sizeof(mSpeeds));
+    memset(mOccupied, 0, sizeof(mOccupied));
+    memset(mRed, 0, sizeof(mRed));
+    memset(mPowered, 0, sizeof(mPowered));
+    mSwitched = 0;
+}
+
+void TrackBlocks::setTrain(int index, word address, word speed) {
+    index--;
+    mTrains[index] = address;
+    mSpeeds[index] = speed;
+    bitSet(mOccupied[index / 8], index % 8);
+}
+
+word TrackBlocks::getTrain(int index) {
+    return mTrains[index - 1];
+}
+
+boolean TrackBlocks::isOccupied(int index) {
+    index--;
+    return bitRead(mOccupied[index / 8], index % 8);
+}
+
+boolean TrackBlocks::isRed(int index) {
+    index--;
+    return bitRead(mRed[index / 8], index % 8);
+}
+
+void TrackBlocks::send(byte command, word address, byte value1, byte value2) {
+    TrackMessage message;
+
+    message.clear();
+    message.command = command;
+    message.length = 0x06;
+    message.data[2] = highByte(address);
+    message.data[3] = lowByte(address);
+    message.data[4] = value1;
+    message.data[5] = value2;
+
+    mController->sendMessage(message);
+}
+
+void TrackBlocks::protect(int i, boolean red) {
+    TrackBlock block = mLayout->getBlock(i + 1);
+
+    bitWrite(mRed[i / 8], i % 8, red);
+
+    if (block.signal != 0) {
+        send(0x0b, block.signal, red ? ACC_RED : ACC_GREEN, 1);
+        bitSet(mPowered[i / 8], i % 8);
+        mSwitched = millis();
+    }
+
+    if (mTrains[i] != 0 && bitRead(mOccupied[i / 8], i % 8)) {
+        word speed = red ? 0 : mSpeeds[i];
+        send(0x04, mTrains[i], highByte(speed), lowByte(speed));
+    }
+}
+
+void TrackBlocks::update() {
+    // Occupancy, following the trains from block to block
+    for (int c = mReporter->nextChange(0); c != 0; c = mReporter->nextChange(c)) {
+        if (!mReporter->getValue(c)) {
+            continue;
+        }
+
+        int i = mLayout->getLeftBlock(c) - 1;
+
+        if (i >= 0 && i < mCount) {
+            bitClear(mOccupied[i / 8], i % 8);
+            mTrains[i] = 0;
+        }
+
+        i = mLayout->getEnteredBlock(c) - 1;
+
+        if (i >= 0 && i < mCount) {
+            bitSet(mOccupied[i / 8], i % 8);
+
+            int j = mLayout->getPreviousBlock(i + 1) - 1;
+
+            if (j >= 0 && j < mCount && j != i) {
+                // Take over the train from the block before, if we know it
+                if (mTrains[j] != 0) {
+                    mTrains[i] = mTrains[j];
+                    mSpeeds[i] = mSpeeds[j];
+                    mTrains[j] = 0;
+                }
+
+                // Without an exit contact, this is the only sign that
+                // the train has left, known or not
+                if (mLayout->getBlock(j + 1).exit == 0) {
+                    bitClear(mOccupied[j / 8], j % 8);
+                }
+            }
+
+            // Entering on red stops the train right away
+            if (bitRead(mRed[i / 8], i % 8)) {
+                protect(i, true);
+            }
+        }
+    }
+
+    // Protection, one signal per block
+    for (int i = 0; i < mCount; i++) {
+        int next = mLayout->getBlock(i + 1).next - 1;
+        boolean red = next >= 0 && bitRead(mOccupied[next / 8], next % 8);
+
+        if (red != bitRead(mRed[i / 8], i % 8)) {
+            protect(i, red);
+        }
+    }
+
+    // Power signals off once they had time to switch
+    if (millis() - mSwitched >= BLOCK_SIGNAL_TIME) {
+        for (int i = 0; i < mCount; i++) {
+            if (bitRead(mPowered[i / 8], i % 8)) {
+                send(0x0b, mLayout->getBlock(i + 1).signal, bitRead(mRed[i / 8], i % 8) ? ACC_RED : ACC_GREEN, 0);
+                bitClear(mPowered[i / 8], i % 8);
+            }
+        }
+    }
+}
+
+// ===================================================================
+// === TrackInterlocking =============================================
+// ===================================================================
+
+TrackInterlocking::TrackInterlocking(TrackController &controller, TrackLayout &layout, TrackBlocks *blocks) {
+    mController = &controller;
+    mLayout = &layout;
+    mBlocks = blocks;
+    mStraight = 0;
+    mPowered = 0;
+    mPoweredStraight = 0;
+    mSwitched = 0;
+
+    reset();
+}
+
+void TrackInterlocking::reset() {
+    mSet = 0;
+    mPending = 0;
+}
+
+boolean TrackInterlocking::isValid(int route) {
+    return route >= 1 && route <= mLayout->getRouteCount();
+}
+
+boolean TrackInterlocking::isSet(int route) {
+    return isValid(route) && (mSet & (1ULL << (route - 1))) != 0;
+}
+
+boolean TrackInterlocking::isFree(int route) {
+    if (!isValid(route)) {
+        return false;
+    }
+
+    if ((mLayout->getConflicts(route) & mSet) != 0) {
+        return false;
+    }
+
+    if (mBlocks != NULL) {
+        byte to = mLayout->getRoute(route).to;
+        return to == 0 || !mBlocks->isOccupied(to);
+    }
+
+    return true;
+}
+
+boolean TrackInterlocking::setRoute(int route) {
+    if (!isValid(route)) {
+        return false;
+    }
+
+    if (isSet(route)) {
+        return true;
+    }
+
+    if (!isFree(route)) {
+        return false;
+    }
+
+    TrackRoute r = mLayout->getRoute(route);
+
+    mSet |= 1ULL << (route - 1);
+    mStraight = (mStraight & ~r.turnouts) | (r.straight & r.turnouts);
+    mPending |= r.turnouts;
+
+    return true;
+}
+
+void TrackInterlocking::releaseRoute(int route) {
+    if (isValid(route)) {
+        mSet &= ~(1ULL << (route - 1));
+    }
+}
+
+boolean TrackInterlocking::isSwitching() {
+    return mPending != 0 || mPowered != 0;
+}
+
+void TrackInterlocking::send(int turnout, boolean straight, byte power) {
+    TrackMessage message;
+    word address = mLayout->getTurnout(turnout);
+
+    message.clear();
+    message.command = 0x0b;
+    message.length = 0x06;
+    message.data[2] = highByte(address);
+    message.data[3] = lowByte(address);
+    message.data[4] = straight ? ACC_STRAIGHT : ACC_ROUND;
+    message.data[5] = power;
+
+    mController->sendMessage(message);
+}
+
+void TrackInterlocking::update() {
+    unsigned long now = millis();
+    int count = mLayout->getTurnoutCount();
+
+    // Power off the last batch once it had time to switch, using the
+    // positions it was switched to, since routes may have been set
+    // in the meantime
+    if (mPowered != 0 && now - mSwitched >= ROUTE_SWITCH_TIME) {
+        for (int i = 0; i < count; i++) {
+            if (bitRead(mPowered, i)) {
+                send(i, bitRead(mPoweredStraight, i), 0);
+            }
+        }
+
+        mPowered = 0;
+    }
+
+    // Then switch the next one
+    if (mPending != 0 && mPowered == 0) {
+        for (int i = 0; i < count; i++) {
+            if (bitRead(mPending, i)) {
+                send(i, bitRead(mStraight, i), 1);
+            }
+        }
+
+        mPowered = mPending;
+        mPoweredStraight = mStraight;
+        mPending = 0;
+        mSwitched = now;
+    }
+
+    // Release routes the trains have passed
+    if (mBlocks != NULL && mSet != 0) {
+        for (int i = 0; i < mLayout->getRouteCount(); i++) {
+            if (mSet & (1ULL << i)) {
+                TrackRoute r = mLayout->getRoute(i + 1);
+
+                if (r.to != 0 && mBlocks->isOccupied(r.to) && (r.from == 0 || !mBlocks->isOccupied(r.from))) {
+                    mSet &= ~(1ULL << i);
+                }
+            }
+        }
+    }
+}
+
+// ===================================================================
+// === TrackTimetable ================================================
+// ===================================================================
+
+#define ACTION_NONE 0xff // No more actions in the timetable
+
+TrackTimetable::TrackTimetable(TrackController &controller) {
+    mController = &controller;
+    mLatency = 0;
+    mSent = 0;
+
+    end();
+
+    mController->addListener(this);
+}
+
+TrackTimetable::~TrackTimetable() {
+    mController->removeListener(this);
+}
+
+void TrackTimetable::begin(const TrackAction *actions, int count, unsigned long period) {
+    mActions = actions;
+    mCount = count;
+    mCursor = 0;
+    mPeriod = period;
+    mStart = millis();
+    mLateness = 0;
+    mRunning = true;
+
+    fetch();
+}
+
+void TrackTimetable::end() {
+    mActions = NULL;
+    mCount = 0;
+    mCursor = 0;
+    mNext.type = ACTION_NONE;
+    mLength = 0;
+    mRunning = false;
+    mLateness = 0;
+}
+
+boolean TrackTimetable::isRunning() {
+    return (mRunning && mNext.type != ACTION_NONE) || mLength != 0;
+}
+
+void TrackTimetable::fetch() {
+    if (mCursor == mCount && mPeriod != 0 && mCount != 0) {
+        mCursor = 0;
+        mStart += mPeriod;
+    }
+
+    if (mCursor < mCount) {
+        memcpy_P(&mNext, &mActions[mCursor++], sizeof(TrackAction));
+    } else {
+        mNext.type = ACTION_NONE;
+    }
+}
+
+boolean TrackTimetable::schedule(TrackAction &action) {
+    if (mLength == TIMETABLE_ACTIONS) {
+        return false;
+    }
+
+    // Sift up
+    int i = mLength++;
+    unsigned long time = millis() + action.time;
+
+    while (i > 0 && (long) (time - mHeap[(i - 1) / 2].time) < 0) {
+        mHeap[i] = mHeap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    mHeap[i] = action;
+    mHeap[i].time = time;
+
+    return true;
+}
+
+void TrackTimetable::pop() {
+    TrackAction last = mHeap[--mLength];
+
+    // Sift down
+    int i = 0;
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= mLength) {
+            break;
+        }
+
+        if (child + 1 < mLength && (long) (mHeap[child + 1].time - mHeap[child].time) < 0) {
+            child++;
+        }
+
+        if ((long) (mHeap[child].time - last.time) >= 0) {
+            break;
+        }
+
+        mHeap[i] = mHeap[child];
+        i = child;
+    }
+
+    mHeap[i] = last;
+}
+
+void TrackTimetable::setLatency(word latency) {
+    mLatency = latency;
+}
+
+word TrackTimetable::getLatency() {
+    return mLatency;
+}
+
+word TrackTimetable::getLateness() {
+    return mLateness;
+}
+
+void TrackTimetable::execute(TrackAction &action) {
+    TrackMessage message;
+
+    message.clear();
+    message.data[2] = highByte(action.address);
+    message.data[3] = lowByte(action.address);
+
+    switch (action.type) {
+        case ACTION_POWER:
+            message.command = 0x00;
+            message.length = 0x05;
+            message.data[2] = 0;
+            message.data[3] = 0;
+            message.data[4] = action.value ? 0x01 : 0x00;
+            break;
+
+        case ACTION_SPEED:
+            message.command = 0x04;
+            message.length = 0x06;
+            message.data[4] = highByte(action.value);
+            message.data[5] = lowByte(action.value);
+            break;
+
+        case ACTION_DIRECTION:
+            message.command = 0x05;
+            message.length = 0x05;
+            message.data[4] = action.value;
+            break;
+
+        case ACTION_FUNCTION:
+            message.command = 0x06;
+            message.length = 0x06;
+            message.data[4] = action.value;
+            message.data[5] = action.power;
+            break;
+
+        case ACTION_ACCESSORY:
+            message.command = 0x0b;
+            message.length = 0x06;
+            message.data[4] = action.value;
+            message.data[5] = action.power;
+            break;
+
+        default:
+            return;
+    }
+
+    mCommand = message.command;
+    mSent = millis();
+
+    mController->sendMessage(message);
+}
+
+void TrackTimetable::update() {
+    // Answers come in through messageReceived()
+    mController->poll();
+
+    // Send early by the latency, so things happen in time
+    unsigned long now = millis() + mLatency;
+
+    for (;;) {
+        long table = -1, heap = -1;
+
+        if (mRunning && mNext.type != ACTION_NONE) {
+            table = (long) (now - (mStart + mNext.time));
+        }
+
+        if (mLength != 0) {
+            heap = (long) (now - mHeap[0].time);
+        }
+
+        if (table < 0 && heap < 0) {
+            break;
+        }
+
+        // The larger one is more overdue
+        long late;
+
+        if (table >= heap) {
+            late = table;
+            execute(mNext);
+            fetch();
+        } else {
+            TrackAction action = mHeap[0];
+            late = heap;
+            pop();
+            execute(action);
+        }
+
+        if (late > mLateness) {
+            mLateness = late > 0xffff ? 0xffff : late;
+        }
+    }
+}
+
+void TrackTimetable::messageReceived(TrackMessage &message) {
+    if (mSent != 0 && message.response && message.command == mCommand) {
+        // Half the round trip, the command only has to get there
+        word latency = (millis() - mSent) / 2;
+
+        mLatency = (3 * mLatency + latency + 2) / 4;
+        mSent = 0;
+    }
+}
+
+// ===================================================================
+// === TrackStopper ==================================================
+// ===================================================================
+
+// On AVR boards with a real CAN controller, a compare interrupt of
+// Timer0, which also drives millis(), sends the first brake command.
+// Timer0 runs at 1/64 of the clock and wraps every 256 ticks.
+#if !defined(__ESP__) && !defined(CAN_SIMULATOR)
+#define STOPPER_TIMER 1
+#define STOPPER_TICK  ((long) (64000000UL / F_CPU)) // us per timer tick
+#endif
+
+/**
+ * All stoppers, for the timer interrupt.
+ */
+TrackStopper *stoppers = NULL;
+
+#if defined(STOPPER_TIMER)
+ISR(TIMER0_COMPB_vect) {
+    unsigned long now = micros();
+    long next = -1;
+
+    for (TrackStopper *s = stoppers; s != NULL; s = s->mNextStopper) {
+        long left = s->tick(now);
+
+        if (left >= 0 && (next == -1 || left < next)) {
+            next = left;
+        }
+    }
+
+    if (next == -1) {
+        TIMSK0 &= ~_BV(OCIE0B);
+    } else if (next < 256 * STOPPER_TICK) {
+        OCR0B = TCNT0 + (next < STOPPER_TICK ? 1 : next / STOPPER_TICK);
+    } else {
+        // Look again after a full turn
+        OCR0B = TCNT0;
+    }
+}
+#endif
+
+TrackStopper::TrackStopper(TrackController &controller, TrackReporter &reporter) {
+    mController = &controller;
+    mReporter = &reporter;
+    mFirst = 0;
+    mSecond = 0;
+    mDistance = 0;
+    mTarget = 0;
+    mBrakeTime = 0;
+    mLatency = 0;
+
+    disarm();
+
+    noInterrupts();
+    mNextStopper = stoppers;
+    stoppers = this;
+    interrupts();
+}
+
+TrackStopper::~TrackStopper() {
+    noInterrupts();
+
+    TrackStopper **p = &stoppers;
+
+    while (*p != NULL) {
+        if (*p == this) {
+            *p = mNextStopper;
+            break;
+        }
+
+        p = &(*p)->mNextStopper;
+    }
+
+    interrupts();
+}
+
+void TrackStopper::setContacts(word first, word second, word distance, word target) {
+    mFirst = first;
+    mSecond = second;
+    mDistance = distance;
+    mTarget = target;
+}
+
+void TrackStopper::setBrakeTime(word time) {
+    mBrakeTime = time;
+}
+
+void TrackStopper::setLatency(word latency) {
+    mLatency = latency;
+}
+
+void TrackStopper::arm(word address, word speed) {
+    noInterrupts();
+    mAddress = address;
+    mSpeed = speed;
+    mVelocity = 0;
+    mLateness = 0;
+    mRamped = false;
+    mState = STOPPER_ARMED;
+    interrupts();
+}
+
+void TrackStopper::disarm() {
+    mState = STOPPER_IDLE;
+}
+
+byte TrackStopper::getState() {
+    return mState;
+}
+
+word TrackStopper::getVelocity() {
+    return mVelocity;
+}
+
+unsigned long TrackStopper::getLateness() {
+    noInterrupts();
+    unsigned long lateness = mLateness;
+    interrupts();
+
+    return lateness;
+}
+
+void TrackStopper::plan(unsigned long time) {
+    unsigned long elapsed = time - mTime;
+
+    if (elapsed < 1000) {
+        elapsed = 1000;
+    }
+
+    // Time stamps have a resolution of 16 us anyway, which keeps the
+    // product within 32 bits
+    unsigned long velocity = mDistance * 62500UL / (elapsed >> 4);
+
+    velocity = constrain(velocity, 1, 65535);
+    mVelocity = velocity;
+
+    // The loco goes on at full speed until it reacts
+    unsigned long reaction = velocity * mLatency / 1000;
+    unsigned long distance = mTarget > reaction ? mTarget - reaction : 0;
+
+    // Constant deceleration covers half the distance of full speed
+    unsigned long braking = velocity * mBrakeTime / 2000;
+
+    if (braking >= distance) {
+        mBrake = distance * 2000 / velocity;
+        mTime = time;
+    } else {
+        // (distance - braking) * 1000000 / velocity, in two steps so
+        // nothing overflows
+        unsigned long rest = (distance - braking) * 1000;
+
+        mBrake = mBrakeTime;
+        mTime = time + rest / velocity * 1000 + rest % velocity * 1000 / velocity;
+    }
+
+    mState = STOPPER_WAITING;
+
+#if defined(STOPPER_TIMER)
+    // Have the timer interrupt take it from here
+    noInterrupts();
+    OCR0B = TCNT0 + 1;
+    TIFR0 = _BV(OCF0B);
+    TIMSK0 |= _BV(OCIE0B);
+    interrupts();
+#endif
+}
+
+void TrackStopper::brake() {
+    TrackMessage message;
+
+    mLateness = micros() - mTime;
+
+    // Speed 0 or the first step of the ramp
+    word speed = mBrake == 0 || mSpeed < RAMP_STEP ? 0 : mSpeed - RAMP_STEP;
+
+    message.clear();
+    message.command = 0x04;
+    message.length = 0x06;
+    message.data[2] = highByte(mAddress);
+    message.data[3] = lowByte(mAddress);
+    message.data[4] = highByte(speed);
+    message.data[5] = lowByte(speed);
+
+    mController->sendMessageNow(message);
+
+    mState = STOPPER_BRAKING;
+}
+
+void TrackStopper::ramp() {
+    mRamped = true;
+
+    if (mBrake == 0) {
+        mController->cancelRamp(mAddress);
+        return;
+    }
+
+    // Pick up the ramp where it is by now
+    unsigned long elapsed = (micros() - mTime) / 1000;
+    word left = elapsed < mBrake ? mBrake - elapsed : 0;
+    word from = (unsigned long) mSpeed * left / mBrake;
+
+    mController->rampLocoSpeed(mAddress, from, 0, left, RAMP_LINEAR);
+}
+
+long TrackStopper::tick(unsigned long now) {
+    if (mState != STOPPER_WAITING) {
+        return -1;
+    }
+
+    long left = (long) (mTime - now);
+
+    if (left <= 0) {
+        brake();
+        return -1;
+    }
+
+    return left;
+}
+
+void TrackStopper::update() {
+    TrackEvent event;
+
+    while (mReporter->getEvent(event)) {
+        if (!event.active) {
+            continue;
+        }
+
+        if (mState == STOPPER_ARMED && event.contact == mFirst) {
+            mTime = event.time;
+            mState = STOPPER_MEASURING;
+        } else if (mState == STOPPER_MEASURING && event.contact == mSecond) {
+            plan(event.time);
+        }
+    }
+
+    // Without a timer, or if it missed, it is our turn
+    noInterrupts();
+    tick(micros());
+    interrupts();
+
+    if (mState == STOPPER_BRAKING && !mRamped) {
+        ramp();
+    }
+}
+
+// ===================================================================
+// === TrackMonitor ==================================================
+// ===================================================================
+
+TrackMonitor::TrackMonitor(TrackController &controller) {
+    mController = &controller;
+    mState = HEALTH_OK;
+    mTransmitErrors = 0;
+    mReceiveErrors = 0;
+    mRunning = false;
+    mRecoveries = 0;
+    mRecoveryTime = 0;
+
+    mController->addListener(this);
+}
+
+TrackMonitor::~TrackMonitor() {
+    mController->removeListener(this);
+}
+
+byte TrackMonitor::getState() {
+    return mState;
+}
+
+byte TrackMonitor::getTransmitErrors() {
+    return mTransmitErrors;
+}
+
+byte TrackMonitor::getReceiveErrors() {
+    return mReceiveErrors;
+}
+
+word TrackMonitor::getRecoveries() {
+    return mRecoveries;
+}
+
+unsigned long TrackMonitor::getRecoveryTime() {
+    return mRecoveryTime;
+}
+
+void TrackMonitor::ping() {
+    TrackMessage message;
+
+    message.clear();
+    message.command = 0x18;
+
+    mController->sendMessage(message);
+}
+
+void TrackMonitor::fail() {
+    mState = HEALTH_RECOVERING;
+    mFailed = millis();
+}
+
+void TrackMonitor::update() {
+    // Pongs come in through messageReceived()
+    mController->poll();
+
+    unsigned long now = millis();
+
+    if (!mRunning) {
+        mRunning = true;
+        mChecked = now;
+        mAnswered = now;
+        ping();
+        return;
+    }
+
+    if (now - mChecked < (mState == HEALTH_RECOVERING ? MONITOR_RETRY : MONITOR_INTERVAL)) {
+        return;
+    }
+
+    mChecked = now;
+
+    byte flags = mController->getBusErrors(&mTransmitErrors, &mReceiveErrors);
+
+    if (mState != HEALTH_RECOVERING) {
+        if (flags & BUS_OFF) {
+            if (mController->isDebug()) {
+                Serial.println(F("!?! Bus off"));
+            }
+            fail();
+        } else if (now - mAnswered >= MONITOR_TIMEOUT) {
+            if (mController->isDebug()) {
+                Serial.println(F("!?! Gleisbox lost"));
+            }
+            fail();
+        } else {
+            mState = (flags & (BUS_WARNING | BUS_PASSIVE)) ? HEALTH_WARNING : HEALTH_OK;
+        }
+    }
+
+    if (mState == HEALTH_RECOVERING) {
+        mController->restart();
+    }
+
+    ping();
+}
+
+void TrackMonitor::messageReceived(TrackMessage &message) {
+    // Only the Gleisbox counts
+    if (message.command != 0x18 || !message.response || message.length < 8
+        || message.data[6] != 0x00 || message.data[7] != 0x10) {
+        return;
+    }
+
+    mAnswered = millis();
+
+    if (mState == HEALTH_RECOVERING) {
+        mState = HEALTH_OK;
+        mRecoveries++;
+        mRecoveryTime = mAnswered - mFailed;
+
+        if (mController->isDebug()) {
+            Serial.print(F("### Recovered after "));
+            Serial.print(mRecoveryTime);
+            Serial.println(F(" ms"));
+        }
+    }
+}
+
+#endif // !defined(__NOCAN__)
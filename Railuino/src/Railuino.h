@@ -173,6 +173,74 @@ class TrackMessage : public Printable {
 // === TrackController ===============================================
 // ===================================================================
 
+/**
+ * Gets to see every message a TrackController receives, no matter
+ * whether it has been asked for or is skipped while waiting for a
+ * response. Register using TrackController::addListener(). Listeners
+ * are chained through mNext, so they don't need any extra memory.
+ */
+class TrackListener {
+
+  public:
+
+  /**
+   * The next listener of the same controller. Internal field.
+   */
+  TrackListener *mNext;
+
+  /**
+   * Is called for every message received.
+   */
+  virtual void messageReceived(TrackMessage &message) = 0;
+
+};
+
+/**
+ * Number of locos that can ramp their speed at the same time. Each
+ * one costs 15 bytes of RAM. Can be overridden via a compiler flag.
+ */
+#if !defined(CONTROLLER_RAMPS)
+#if defined(__MEGA__) || defined(__ESP__)
+#define CONTROLLER_RAMPS 16
+#else
+#define CONTROLLER_RAMPS 4
+#endif
+#endif
+
+/**
+ * Shapes of speed ramps.
+ */
+#define RAMP_LINEAR  0 // Constant acceleration
+#define RAMP_S_CURVE 1 // Gentle start and end
+
+/**
+ * Smallest change of speed worth a message while ramping, about one
+ * step of a 126-step DCC decoder, and the default time (ms) between
+ * two messages.
+ */
+#define RAMP_STEP     8
+#define RAMP_INTERVAL 20
+
+/**
+ * Number of messages that can be queued while the controller is
+ * starting up. Each one costs 14 bytes of RAM. Can be overridden via a
+ * compiler flag.
+ */
+#if !defined(CONTROLLER_QUEUE)
+#if defined(__MEGA__) || defined(__ESP__)
+#define CONTROLLER_QUEUE 16
+#else
+#define CONTROLLER_QUEUE 4
+#endif
+#endif
+
+/**
+ * Error flags of the CAN hardware.
+ */
+#define BUS_WARNING 0x01 // Many errors
+#define BUS_PASSIVE 0x18 // Even more errors, only listening
+#define BUS_OFF     0x20 // Too many errors, off the bus
+
 /**
  * Controls things on and connected to the track: locomotives,
  * turnouts and other accessories. While there are some low-level
@@ -208,11 +276,132 @@ class TrackController {
 	boolean mLoopback;
 
 	/**
-	 * Generates a new hash and makes sure it does not conflict
-	 * with those of other devices in the setup.
+	 * The first of the listeners to be notified of incoming messages.
+	 */
+	TrackListener *mListeners;
+
+	/**
+	 * The time (us) the message received last arrived.
+	 */
+	unsigned long mReceived;
+
+	/**
+	 * Whether the sketch receives messages itself.
+	 */
+	boolean mReceiving;
+
+	/**
+	 * How far we are with starting up, and since when.
+	 */
+	byte mStartup;
+	unsigned long mStartTime;
+
+	/**
+	 * Whether the hash was generated and still has to be checked, and
+	 * whether someone else turned out to use it.
+	 */
+	boolean mGenerated, mConflict;
+
+	/**
+	 * Messages sent while starting up.
+	 */
+	TrackMessage mQueue[CONTROLLER_QUEUE];
+	byte mQueueLength;
+
+	/**
+	 * The function to call once we are ready.
+	 */
+	void (*mReadyHandler)(TrackController &controller);
+
+	/**
+	 * The locos ramping their speed, with start and target speed,
+	 * the speed sent last, start time, duration (ms) and shape of
+	 * the ramp.
+	 */
+	word mRampLocos[CONTROLLER_RAMPS];
+	word mRampFrom[CONTROLLER_RAMPS];
+	word mRampTo[CONTROLLER_RAMPS];
+	word mRampSent[CONTROLLER_RAMPS];
+	unsigned long mRampStart[CONTROLLER_RAMPS];
+	word mRampTime[CONTROLLER_RAMPS];
+	byte mRampCurves[CONTROLLER_RAMPS];
+
+	/**
+	 * The number of ramps and the one to look at next.
+	 */
+	byte mRampCount, mRampNext;
+
+	/**
+	 * Set by emergencyStop(), which may run in an interrupt handler
+	 * and therefore leaves the ramps to checkEmergency().
+	 */
+	volatile boolean mEmergency;
+
+	/**
+	 * The time between two ramp messages and when the last one was
+	 * sent (ms).
+	 */
+	word mRampInterval;
+	unsigned long mRampLast;
+
+	/**
+	 * Generates a new hash. Whether it conflicts with those of other
+	 * devices in the setup is checked while starting up.
 	 */
 	void generateHash();
 
+	/**
+	 * Takes the next step of starting up, if it is time.
+	 */
+	void startup();
+
+	/**
+	 * Finishes starting up.
+	 */
+	void ready();
+
+	/**
+	 * Sends as many of the queued messages as possible.
+	 */
+	void flush();
+
+	/**
+	 * Blocks until starting up is finished.
+	 */
+	void waitUntilReady();
+
+	/**
+	 * Sends a message right away.
+	 */
+	boolean transmit(TrackMessage &message);
+
+	/**
+	 * Receives a message, like receiveMessage(), but for our own use.
+	 */
+	boolean receive(TrackMessage &message);
+
+	/**
+	 * Sends the message that gets the Gleisbox out of its boot
+	 * loader.
+	 */
+	void bootstrap();
+
+	/**
+	 * Cancels all ramps if there was an emergency stop since the
+	 * last call.
+	 */
+	void checkEmergency();
+
+	/**
+	 * Returns the index of the ramp of the given loco, or -1.
+	 */
+	int findRamp(word address);
+
+	/**
+	 * Returns the speed of a ramp at the given time.
+	 */
+	word getRampSpeed(int index, unsigned long time);
+
     public:
 
 	/**
@@ -260,20 +449,51 @@ class TrackController {
     boolean isLoopback();
 
     /**
-     * Sends a message and reports true on success. Internal method.
-     * Normally you don't want to use this, but the more convenient
-     * methods below instead.
+     * Sends a message and reports true on success. While starting up,
+     * the message is queued and sent once the controller is ready.
+     * Internal method. Normally you don't want to use this, but the
+     * more convenient methods below instead.
      */
     boolean sendMessage(TrackMessage &message);
 
+    /**
+     * Sends a message right away, bypassing the queue used while
+     * starting up, the debug output and the wait for a free transmit
+     * buffer, so this is safe to call from an interrupt handler. The
+     * return value reflects whether the message could be sent.
+     * Internal method.
+     */
+    boolean sendMessageNow(TrackMessage &message);
+
     /**
      * Receives an arbitrary message, if available, and reports true
      * on success. Does not block. Internal method. Normally you
      * don't want to use this, but the more convenient methods below
-     * instead.
+     * instead. Once a sketch calls this, poll() leaves all messages
+     * to it.
      */
     boolean receiveMessage(TrackMessage &message);
 
+    /**
+     * Receives all pending messages, so listeners (reporters, the
+     * timetable, the monitor and so on) get to see them, and drops
+     * them afterwards. This is what the update() methods of those
+     * classes do. A sketch that receives messages itself does this
+     * job already, so once it has called receiveMessage(), this does
+     * nothing and no message gets lost to the sketch. Such a sketch
+     * should receive messages regularly, though, since the listeners
+     * depend on it.
+     */
+    void poll();
+
+    /**
+     * Returns the time (in us, as returned by micros()) the message
+     * received last arrived at the CAN controller. It is taken in the
+     * interrupt handler, so it doesn't depend on how often loop()
+     * gets around to receiving messages.
+     */
+    unsigned long getReceiveTime();
+
     /**
      * Sends a message and waits for the corresponding response,
      * returning true on success. Blocks until either a message with
@@ -281,24 +501,72 @@ class TrackController {
      * timeout (in ms) expires. All non-matching messages are
      * skipped. Internal method. Normally you don't want to use this,
      * but the more convenient methods below instead. 'out' and 'in'
-     * may be the same object.
+     * may be the same object. If the message can't be sent, this
+     * returns false right away (in debug mode, after an emergency
+     * stop).
      */
     boolean exchangeMessage(TrackMessage &out, TrackMessage &in,  word timeout);
 
+    /**
+     * Registers a listener that is notified of every message received,
+     * including those skipped by exchangeMessage().
+     */
+    void addListener(TrackListener *listener);
+
+    /**
+     * Unregisters a listener.
+     */
+    void removeListener(TrackListener *listener);
+
     /**
      * Initializes the CAN hardware and starts receiving CAN
      * messages. CAN messages are put into an internal buffer of
      * limited size, so they don't get lost, but you have to take
      * care of them in time. Otherwise the buffer might overflow.
+     * If the CAN hardware doesn't respond, an error is printed, and
+     * restart() (or a TrackMonitor) can try again later.
+     * This returns right away. Waking up the Gleisbox and making sure
+     * nobody else uses our hash takes about a second, which happens
+     * in the background as long as update() or receiveMessage() are
+     * called. Messages sent meanwhile are queued, and the methods
+     * that wait for a response simply wait a little longer. Once
+     * CONTROLLER_QUEUE messages are waiting, sendMessage() returns
+     * false until starting up is finished.
      */
     void begin();
 
+    /**
+     * Reflects whether starting up is finished.
+     */
+    boolean isReady();
+
+    /**
+     * Sets a function to be called once starting up is finished.
+     * Set it before calling begin(). In loopback mode, it is called
+     * from begin().
+     */
+    void setReadyHandler(void (*handler)(TrackController &controller));
+
     /**
      * Stops receiving messages from the CAN hardware. Clears
      * the internal buffer.
      */
     void end();
 
+    /**
+     * Initializes the CAN hardware again after begin(), for instance
+     * after a bus-off, and wakes up the Gleisbox, which may have been
+     * restarted. Keeps the hash. Doesn't block. The return value
+     * reflects whether the CAN hardware responded.
+     */
+    boolean restart();
+
+    /**
+     * Queries the transmit and receive error counters of the CAN
+     * hardware and returns its error flags (see the BUS_* constants).
+     */
+    byte getBusErrors(byte *transmit, byte *receive);
+
     /**
      * Controls power on the track. When passing false, all
      * locomotives will stop, but remember their previous directions
@@ -309,6 +577,24 @@ class TrackController {
      */
     boolean setPower(boolean power);
 
+    /**
+     * Stops everything right away, the same way setPower(false) does,
+     * but without waiting for anything. The stop goes into the CAN
+     * controller ahead of all other messages, which are aborted, so
+     * it is on the bus within the time of a single frame. Ramps are
+     * cancelled. This is safe to call from an interrupt handler. The
+     * return value reflects whether the message could be sent.
+     */
+    boolean emergencyStop();
+
+    /**
+     * Calls emergencyStop() whenever the given pin is pulled low, for
+     * instance by a big red button. The pin must support interrupts
+     * and its pull-up is enabled. Only one controller can have an
+     * emergency pin. Pass -1 to release it again.
+     */
+    void setEmergencyPin(int pin);
+
     /**
      * Sets the direction of the given locomotive. Valid directions
      * are those specified by the DIR_* constants. The return value
@@ -330,6 +616,65 @@ class TrackController {
      */
     boolean setLocoSpeed(word address, word speed);
 
+    /**
+     * Changes the speed of the given locomotive smoothly to the given
+     * one within the given time (ms), following one of the RAMP_*
+     * curves. update() does the rest in the background. The ramp
+     * starts from the current speed. If the locomotive isn't ramping
+     * already, the speed is queried from the Gleisbox, which blocks
+     * until the answer arrives (up to a second). Use the variant below
+     * if you know the speed. The return value reflects whether the
+     * ramp could be started.
+     */
+    boolean rampLocoSpeed(word address, word speed, word time, byte curve);
+
+    /**
+     * Like the above, but starts the ramp from the given speed, so
+     * nothing is queried and the call never blocks.
+     */
+    boolean rampLocoSpeed(word address, word from, word speed, word time, byte curve);
+
+    /**
+     * Brakes the given locomotive to a stop within the given distance
+     * (mm), with constant deceleration. The velocity is the one at
+     * the current speed (mm/s).
+     */
+    boolean brakeLoco(word address, word distance, word velocity);
+
+    /**
+     * Reflects whether the given locomotive is ramping its speed.
+     */
+    boolean isRamping(word address);
+
+    /**
+     * Stops ramping the given locomotive, leaving it at the speed
+     * sent last. Setting the speed or direction of a locomotive does
+     * this, too.
+     */
+    void cancelRamp(word address);
+
+    /**
+     * Stops all ramps. Switching power off or a stop or halt from the
+     * MS2 does this, too.
+     */
+    void cancelRamps();
+
+    /**
+     * Sets the time (ms) between two messages of the ramp generator.
+     * Ramps take turns, so each one gets a message at most every
+     * interval times the number of ramps.
+     */
+    void setRampInterval(word interval);
+
+    /**
+     * Takes care of starting up and sends the next speed message of
+     * the ramps, if it is time. Also polls for messages (see poll()),
+     * so stops from the MS2 end the ramps even if the sketch doesn't
+     * receive messages itself. Call this from loop() as often as
+     * possible.
+     */
+    void update();
+
     /**
      * Increases the speed of the given locomotive by 1/14th
      * of the maximum speed.
@@ -440,6 +785,20 @@ class TrackController {
 
 };
 
+/**
+ * Number of commands the infrared controller can queue for sending in
+ * the background. Can be overridden via a compiler flag.
+ */
+#if !defined(IR_QUEUE)
+#define IR_QUEUE 8
+#endif
+
+/**
+ * Maximum number of marks and spaces an RC5 frame of up to 14 bits
+ * is encoded into (see TrackControllerInfrared::encode()).
+ */
+#define IR_RUNS 31
+
 /**
  * The little brother of TrackController. This class talks to an IR
  * connector box. The interface is more or less a subset of the one
@@ -447,9 +806,14 @@ class TrackController {
  * numbered 1 to 4, and sixteen turnouts, numbered 1 to 16. The IR
  * controller does not care about protocols, although in reality
  * it's all MM2. Also, no object-oriented mumbo-jumbo here to
- * accomodate for the limited Arduino resources. Note that with
- * the exception of remembering power this class is stateless,
- * so the caller has to keep track of things, if necessary.
+ * accomodate for the limited Arduino resources. Since IR only works
+ * one way, the class keeps a model of the speed, direction and
+ * functions of each locomotive, based on the commands it has sent.
+ * On AVR boards, commands are sent in the background by a compare
+ * interrupt of Timer0 (the one behind millis()), which fires once
+ * per half bit, so about 85 times per command including the gap.
+ * While sending, analogWrite() doesn't work on pin 6 (pin 11 on the
+ * Leonardo).
  */
 class TrackControllerInfrared {
 
@@ -465,6 +829,47 @@ class TrackControllerInfrared {
 	 */
 	word mToggle;
 
+	/**
+	 * The modelled state of the four locomotives, that is, speed step
+	 * (0 to 14), direction (DIR_FORWARD or DIR_REVERSE) and functions
+	 * (one bit each). Infrared is one-way, so this is what we believe
+	 * the decoders do, assuming nobody else is using a Delta remote.
+	 */
+	byte mSpeeds[4];
+	byte mDirections[4];
+	word mFunctions[4];
+
+	/**
+	 * The queued commands, a ring buffer of RC5 addresses, commands
+	 * and frame lengths (bits). Speed changes are kept as a single
+	 * entry with a signed number of FASTER (positive) or SLOWER
+	 * (negative) frames still to be sent, all other entries have a
+	 * count of 1.
+	 */
+	byte mAddresses[IR_QUEUE];
+	byte mCommands[IR_QUEUE];
+	byte mBits[IR_QUEUE];
+	signed char mCounts[IR_QUEUE];
+
+	/**
+	 * Position of the oldest entry and number of entries.
+	 */
+	volatile byte mRead;
+	volatile byte mLength;
+
+	/**
+	 * Puts a command of the given length (bits) into the queue,
+	 * merging it with a pending one where possible. Waits if the
+	 * queue is full.
+	 */
+	void enqueue(word address, word command, byte nbits);
+
+	/**
+	 * Starts sending the next queued frame if the transmitter is
+	 * idle.
+	 */
+	void pump();
+
     public:
 
 	/**
@@ -492,11 +897,46 @@ class TrackControllerInfrared {
     /**
      * Sends a message consisting of address and command (in the
      * sense of RC5). Takes care of the extension and alternating
-     * bits. Internal method. Normally you don't want to use this,
-     * but the more convenient methods below instead.
+     * bits. The message is queued and sent in the background, driven
+     * by the timer interrupt, so this returns immediately unless the
+     * queue is full. Repeated speed changes in the same direction
+     * for the same locomotive and repeated commands for the same
+     * turnout are merged while they are still waiting. Internal
+     * method. Normally you don't want to use this, but the more
+     * convenient methods below instead.
      */
     boolean sendMessage(word address, word command);
 
+    /**
+     * Provides the next frame to send, with its length (bits), and
+     * removes it from the queue. Called by the transmitter with
+     * interrupts disabled. Internal method. Normally you don't want
+     * to use this.
+     */
+    boolean nextFrame(unsigned long *data, int *nbits, bool *extended);
+
+    /**
+     * Encodes an RC5 frame of up to 14 bits into alternating marks
+     * and spaces, each given as its length in half bits (1 or 2).
+     * The first entry is a mark, and so is the last one, because a
+     * trailing space is part of the gap anyway. Returns the number of
+     * entries. Internal method used by the transmitters.
+     */
+    static byte encode(unsigned long data, int nbits, bool extended, byte runs[]);
+
+    /**
+     * Reflects whether there are still commands waiting or being
+     * sent.
+     */
+    boolean isBusy();
+
+    /**
+     * Keeps the transmission going on boards that can't send in the
+     * background (ESP). Call this from loop() there. Does no harm on
+     * other boards.
+     */
+    void update();
+
     /**
      * Controls power on the track. When passing false, all
      * locomotives will stop, but remember their previous directions
@@ -528,6 +968,31 @@ class TrackControllerInfrared {
      */
     boolean decelerateLoco(int loco);
 
+    /**
+     * Brings the given locomotive to the given speed step (0 to 14)
+     * by queueing the minimal number of commands needed, based on the
+     * modelled current speed. Stopping from a higher speed is done by
+     * changing the direction twice. The return value reflects whether
+     * the call was successful.
+     */
+    boolean setLocoSpeedStep(int loco, byte step);
+
+    /**
+     * Queries the modelled speed step (0 to 14) of the given
+     * locomotive. The return value reflects whether the call was
+     * successful.
+     */
+    boolean getLocoSpeedStep(int loco, byte *step);
+
+    /**
+     * Queries the modelled direction of the given locomotive. Values
+     * are DIR_FORWARD and DIR_REVERSE. Since the Delta system has no
+     * absolute directions, forward is simply the direction the
+     * locomotive had when start() was called. The return value
+     * reflects whether the call was successful.
+     */
+    boolean getLocoDirection(int loco, byte *direction);
+
     /**
      * Toggles the given function of the given locomotive (or simply a
      * function decoder). Valid functions are 0 to 4, with 0 normally
@@ -536,6 +1001,13 @@ class TrackControllerInfrared {
      */
     boolean toggleLocoFunction(int loco, int function);
 
+    /**
+     * Queries the modelled state of the given function of the given
+     * locomotive. The return value reflects whether the call was
+     * successful.
+     */
+    boolean getLocoFunction(int loco, int function, byte *power);
+
     /**
      * Switches a turnout. The return value reflects whether the call
      * was successful.
@@ -549,113 +1021,2484 @@ class TrackControllerInfrared {
 };
 
 // ===================================================================
-// === TrackReporterS88 ==============================================
+// === TrackDecoderInfrared ==========================================
 // ===================================================================
 
 /**
- * Implements the S88 bus protocol for reporting the state of tracks.
- * S88 is basically a long shift register where each bit corresponds
- * to a single contact on the track. Flip-flops on each S88 board make
- * sure activations are stored, so it is not necessary to query a
- * contact at the exact time it is activated. This implementation
- * allows a maximum of 512 bits or 32 full-width (16 bit) S88 boards.
- * The S88 standard recommends a maximum of 30 boards, so we should be
- * on the safe side.
+ * Decodes RC5 (and RC5X) frames from a sequence of marks and spaces,
+ * as seen by an IR receiver or as produced by the encoder of
+ * TrackControllerInfrared. Also measures how far the durations are
+ * off the nominal half bit of 889 us, so the transmitter timing can
+ * be checked against a real receiver.
  */
-class TrackReporterS88 {
+class TrackDecoderInfrared {
 
   private:
 
   /**
-   * The number of contacts available.
+   * The half bits received so far (1 = mark), newest in bit 0.
    */
-  int mSize;
+  unsigned long mHalfBits;
 
   /**
-   * The most recent contact values we know.
+   * The number of half bits received so far.
    */
-  byte mSwitches[64];
+  byte mCount;
 
-  public:
+  /**
+   * The largest deviation from the nominal timing within the current
+   * frame (us).
+   */
+  word mError;
 
   /**
-   * Creates a new TrackReporter with the given number of modules
-   * being attached. While this value can be safely set to the
-   * maximum of 32, it makes sense to specify the actual number,
-   * since this speeds up reporting. The method assumes 16 bit
-   * modules. If you use 8 bit modules instead (or both) you need
-   * to do the math yourself.
+   * The last frame decoded.
    */
-  TrackReporterS88(int modules);
+  word mAddress;
+  word mCommand;
+  boolean mToggle;
+  word mTimingError;
 
   /**
-   * Reads the current state of all contacts into the TrackReporter
-   * and clears the flip-flops on all S88 boards. Call this method
-   * periodically to have up-to-date values.
+   * The number of frames decoded and rejected.
    */
-  void refresh();
+  word mFrames;
+  word mErrors;
 
   /**
-   * Returns the state of an individual contact. Valid index values
-   * are 1 to 512.
+   * Turns the half bits into a frame. Returns false if they don't
+   * form a valid one.
    */
-  boolean getValue(int index);
+  boolean decode();
 
-};
+  public:
 
-// ===================================================================
-// === TrackReporterIOX ==============================================
-// ===================================================================
+  /**
+   * Creates a new decoder.
+   */
+  TrackDecoderInfrared();
 
-/**
- * Implements a low-cost track reporting mechanism based on I/O
- * expanders. Currently the MCP 23S08 and MCP 23S17 are supported,
- * with the MCP 23S08 being treaded just like the 16 bit module, so
- * the upper 8 bits are undefined. The IO expanders are connected via
- * SPI. Pin x is being used for chip select. The interrupt line must
- * be connected to Arduino pin 3 (interrupt 1) and pulled up via a
- * resistor. Multiple expanders can be combined, assuming they are
- * configured to different addresses via the hardware pins. All need
- * to share the interrupt line, which is configured for open drain.
- */
-class TrackReporterIOX {
+  /**
+   * Forgets about a partially received frame.
+   */
+  void clear();
 
-private:
+  /**
+   * Feeds a mark or space of the given duration (us) into the decoder.
+   * A space of more than two half bits ends a frame. Since a receiver
+   * produces no edge at the end of the gap, pass a long space (such as
+   * 0xffff) once the line has been idle for a while. Returns true if a
+   * valid frame has been completed.
+   */
+  boolean feed(boolean mark, word duration);
 
   /**
-   * The number of IO expanders being used.
+   * Returns the address (0 to 31) of the last frame.
    */
-  int mCount;
+  word getAddress();
 
   /**
-   * The most recent contact values we know.
+   * Returns the command of the last frame. For RC5X frames this
+   * includes bit 6 (that is, it is 64 to 127).
    */
-  byte mSwitches[16];
+  word getCommand();
 
-public:
+  /**
+   * Returns the toggle bit of the last frame.
+   */
+  boolean getToggle();
 
   /**
-   * Creates a new TrackReporter with the given number of expanders.
+   * Returns the largest deviation of a mark or space of the last frame
+   * from its nominal duration (us).
    */
-  TrackReporterIOX(int modules);
+  word getTimingError();
 
   /**
-   * Is called when a TrackReporter is being destroyed. Does the
-   * necessary cleanup. No need to call this manually.
+   * Returns the number of frames decoded so far.
    */
-  ~TrackReporterIOX();
+  word getFrames();
+
+  /**
+   * Returns the number of frames rejected so far.
+   */
+  word getErrors();
+};
+
+// ===================================================================
+// === TrackCapture ==================================================
+// ===================================================================
+
+/**
+ * Records CAN traffic in a compact binary format, so sessions can be
+ * replayed later (see the Capture and Replay examples). A capture
+ * starts with the four bytes "RLC1", followed by one record per
+ * message, appended in the order received:
+ *
+ *   4 bytes  time in ms since the start of the capture at which the
+ *            message arrived at the CAN controller (LSB first)
+ *   1 byte   command
+ *   2 bytes  hash (MSB first, as on the bus)
+ *   1 byte   response flag (bit 7) and data length (bits 0 to 3)
+ *   n bytes  data
+ *
+ * Once started, a capture writes all messages the given controller
+ * receives to the given output. The time stamp is taken from the
+ * controller's getReceiveTime(), so it doesn't depend on how often
+ * loop() gets around to receiving messages.
+ */
+class TrackCapture : public TrackListener {
+
+  private:
+
+  /**
+   * The controller whose messages we capture.
+   */
+  TrackController *mController;
+
+  /**
+   * Where the records go.
+   */
+  Print *mOut;
+
+  /**
+   * Time the capture started (ms).
+   */
+  unsigned long mStart;
+
+  /**
+   * Number of records written.
+   */
+  unsigned long mCount;
+
+  public:
+
+  /**
+   * Creates a new capture that doesn't write anything yet.
+   */
+  TrackCapture();
+
+  /**
+   * Starts capturing the messages of the given controller to the
+   * given output by writing the header and registering the capture
+   * as a listener.
+   */
+  void begin(TrackController &controller, Print &out);
+
+  /**
+   * Stops capturing and unregisters the capture.
+   */
+  void end();
+
+  /**
+   * Returns the number of records written so far.
+   */
+  unsigned long getCount();
+
+  /**
+   * Writes a record for the given message. Called by the controller.
+   */
+  virtual void messageReceived(TrackMessage &message);
+
+  /**
+   * Writes the header of a capture. Returns the number of bytes.
+   */
+  static size_t writeHeader(Print &p);
+
+  /**
+   * Writes a single record. Returns the number of bytes.
+   */
+  static size_t writeRecord(Print &p, TrackMessage &message, unsigned long time);
+
+  /**
+   * Reads and checks the header of a capture. The return value
+   * reflects whether it was valid.
+   */
+  static boolean readHeader(Stream &s);
+
+  /**
+   * Reads a single record. The return value reflects whether a full
+   * record could be read before the stream timed out.
+   */
+  static boolean readRecord(Stream &s, TrackMessage &message, unsigned long *time);
+};
+
+// ===================================================================
+// === TrackSimulator ================================================
+// ===================================================================
+
+#if defined(CAN_SIMULATOR)
+
+/**
+ * Sizes of the simulated Gleisbox. Can be overridden via compiler
+ * flags.
+ */
+#if !defined(SIM_LOCOS)
+#define SIM_LOCOS 8
+#endif
+
+#if !defined(SIM_ACCESSORIES)
+#define SIM_ACCESSORIES 8
+#endif
+
+#if !defined(SIM_CONFIGS)
+#define SIM_CONFIGS 8
+#endif
+
+#if !defined(SIM_FRAMES)
+#define SIM_FRAMES 16
+#endif
+
+#if !defined(SIM_THROTTLES)
+#define SIM_THROTTLES 2
+#endif
+
+/**
+ * Stands in for the MCP2515 and everything on the other side of the
+ * bus. Compiling the library with CAN_SIMULATOR defined replaces the
+ * CAN driver by this class, so TrackController can be used without
+ * any hardware (even on boards that don't support CAN otherwise).
+ * The simulator answers the commands TrackController uses the way a
+ * Gleisbox does and keeps track of power, locomotives, accessories
+ * and CVs. Responses can be delayed and messages lost on purpose,
+ * and simulated MS2 throttles can add background traffic. Like the
+ * MCP2515, the simulated driver has three transmit buffers and sends
+ * one frame at a time at 250 kbit/s, so messages take their time on
+ * the wire, and a full set of buffers refuses more. There is a single
+ * instance, named simulator.
+ */
+class TrackSimulator {
+
+  private:
+
+  /**
+   * Whether messages are simply echoed, like a MCP2515 in loopback
+   * mode does.
+   */
+  boolean mLoopback;
+
+  /**
+   * Response delay (ms) and loss rate (percent).
+   */
+  word mLatency;
+  byte mLoss;
+
+  /**
+   * Whether the simulated CAN controller is bus-off and whether the
+   * Gleisbox is gone.
+   */
+  boolean mBusOff, mOffline;
+
+  /**
+   * Number of messages lost on purpose or for lack of space.
+   */
+  word mDropped;
+
+  /**
+   * Whether track power is on.
+   */
+  boolean mPower;
+
+  /**
+   * The known locomotives. Unknown ones are added on first use,
+   * replacing the oldest one if necessary.
+   */
+  word mLocos[SIM_LOCOS];
+  word mSpeeds[SIM_LOCOS];
+  byte mDirections[SIM_LOCOS];
+  unsigned long mFunctions[SIM_LOCOS];
+  byte mLocoCount;
+
+  /**
+   * The known accessories, same as above.
+   */
+  word mAccessories[SIM_ACCESSORIES];
+  byte mPositions[SIM_ACCESSORIES];
+  byte mPowers[SIM_ACCESSORIES];
+  byte mAccessoryCount;
+
+  /**
+   * The CVs written so far, same as above. Others read as 0.
+   */
+  word mConfigLocos[SIM_CONFIGS];
+  word mConfigNumbers[SIM_CONFIGS];
+  byte mConfigValues[SIM_CONFIGS];
+  byte mConfigCount;
+
+  /**
+   * Messages waiting to be received by the controller, together
+   * with the time (us) they arrive.
+   */
+  TrackMessage mFrames[SIM_FRAMES];
+  unsigned long mTimes[SIM_FRAMES];
+  byte mRead;
+  byte mLength;
+
+  /**
+   * The simulated MS2 throttles, each driving one locomotive.
+   */
+  word mThrottles[SIM_THROTTLES];
+  word mIntervals[SIM_THROTTLES];
+  unsigned long mLast[SIM_THROTTLES];
+  byte mThrottleCount;
+
+  /**
+   * Find the slot for the given locomotive, accessory or CV, adding
+   * it if necessary.
+   */
+  int findLoco(word address);
+  int findAccessory(word address);
+  int findConfig(word address, word number);
+
+  /**
+   * Queues a message for the controller.
+   */
+  void post(TrackMessage &message, word hash, boolean response, unsigned long time);
+
+  /**
+   * Processes a command as the Gleisbox does.
+   */
+  void process(TrackMessage &message, unsigned long time);
+
+  public:
+
+  /**
+   * Creates a new simulator. Nobody but the library does this.
+   */
+  TrackSimulator();
+
+  /**
+   * Brings the simulator into its initial state (power off, nothing
+   * known). Called by the CAN driver on initialization.
+   */
+  void reset(boolean loopback);
+
+  /**
+   * Sets the time (ms) it takes until responses arrive.
+   */
+  void setLatency(word latency);
+
+  /**
+   * Sets the percentage of messages that get lost on the way to the
+   * Gleisbox (and thus have no response).
+   */
+  void setLoss(byte percent);
+
+  /**
+   * Puts the simulated CAN controller into bus-off state, where it
+   * doesn't send anything. Initializing it again ends this.
+   */
+  void setBusOff(boolean off);
+
+  /**
+   * Reflects whether the simulated CAN controller is bus-off.
+   */
+  boolean isBusOff();
+
+  /**
+   * Takes the Gleisbox off the bus, so nothing gets answered, or puts
+   * it back.
+   */
+  void setOffline(boolean offline);
+
+  /**
+   * Adds a simulated MS2 throttle that changes the speed of the given
+   * locomotive every interval (ms). Returns false if there are no
+   * more throttles.
+   */
+  boolean addThrottle(word address, word interval);
+
+  /**
+   * Returns the number of messages lost so far.
+   */
+  word getDropped();
+
+  /**
+   * Reflects whether track power is on.
+   */
+  boolean getPower();
+
+  /**
+   * Returns the speed (0 to 1000) the given locomotive has been set
+   * to.
+   */
+  word getLocoSpeed(word address);
+
+  /**
+   * Puts a message on the simulated bus as if some other device had
+   * sent it, for instance to replay a capture. Hash and response
+   * flag are kept.
+   */
+  void inject(TrackMessage &message);
+
+  /**
+   * Receives a message sent by the controller, which left the wire at
+   * the given time (us). Internal method.
+   */
+  void receive(TrackMessage &message, unsigned long time);
+
+  /**
+   * Provides the next message for the controller, if there is one
+   * due, and the time (us) it arrived. Internal method.
+   */
+  boolean transmit(TrackMessage &message, unsigned long &time);
+};
+
+/**
+ * The simulated Gleisbox.
+ */
+extern TrackSimulator simulator;
+
+#endif // defined(CAN_SIMULATOR)
+
+// ===================================================================
+// === TrackFilter ===================================================
+// ===================================================================
+
+/**
+ * Number of bytes (that is, groups of eight contacts) the S88
+ * reporter keeps state for. The default of 64 covers the full 512
+ * contacts of 32 S88 boards. Each byte costs 3 bytes of RAM, so on
+ * the smaller boards it pays to lower this to what the layout
+ * actually has. Can be overridden via a compiler flag.
+ *
+ * With the defaults, a reporter takes this much RAM on an Uno:
+ * about 350 bytes for S88, about 230 for I/O expanders (including
+ * the interrupt handler) and about 230 for CAN.
+ */
+#if !defined(REPORTER_BYTES)
+#define REPORTER_BYTES 64
+#endif
+
+/**
+ * Number of bytes the I/O expander reporter keeps state for, two per
+ * expander. Each byte costs 4 bytes of RAM, so the smaller boards
+ * default to 8 expanders, that is, one chip select group. Can be
+ * overridden via a compiler flag.
+ */
+#if !defined(IOX_BYTES)
+#if defined(__MEGA__) || defined(__ESP__)
+#define IOX_BYTES 64
+#else
+#define IOX_BYTES 16
+#endif
+#endif
+
+/**
+ * Number of bytes the CAN reporter keeps state for. Each byte costs
+ * 4 bytes of RAM, so the smaller boards default to 128 contacts. Can
+ * be overridden via a compiler flag.
+ */
+#if !defined(CAN_REPORTER_BYTES)
+#if defined(__MEGA__) || defined(__ESP__)
+#define CAN_REPORTER_BYTES 64
+#else
+#define CAN_REPORTER_BYTES 16
+#endif
+#endif
+
+/**
+ * Number of bytes (that is, groups of eight contacts) that can be
+ * debounced and held. Each byte costs 11 bytes of RAM per reporter,
+ * so the smaller boards default to the first 64 contacts. Contacts
+ * beyond are reported unfiltered. Can be overridden via a compiler
+ * flag.
+ */
+#if !defined(FILTER_BYTES)
+#if defined(__MEGA__) || defined(__ESP__)
+#define FILTER_BYTES 64
+#else
+#define FILTER_BYTES 8
+#endif
+#endif
+
+/**
+ * Filters raw contact samples before they are reported. Wheel
+ * contacts and current detectors tend to chatter, so a contact has
+ * to show a new state for a given number of consecutive samples
+ * (debounce) before the change is accepted. Once a contact is
+ * occupied, it stays so for a given number of hold ticks after the
+ * last active sample. Both values can be set per contact. All state
+ * is kept in vertical counters, that is, bit i of the counter is
+ * spread over several bytes, so eight contacts are handled with the
+ * same handful of logical operations. The defaults (one sample, no
+ * hold time) pass the raw values through unchanged. The filtered
+ * values themselves are kept by the caller.
+ */
+class TrackFilter {
+
+  private:
+
+  /**
+   * Vertical counter of consecutive samples disagreeing with the
+   * filtered value.
+   */
+  byte mCount[4][FILTER_BYTES];
+
+  /**
+   * Per-contact debounce threshold (samples minus one) as bit planes.
+   */
+  byte mDebounce[3][FILTER_BYTES];
+
+  /**
+   * Per-contact hold time (in hold ticks) as bit planes.
+   */
+  byte mHold[4][FILTER_BYTES];
+
+  /**
+   * The length of a hold tick in ms. Zero means every sample.
+   */
+  word mHoldTick;
+
+  /**
+   * The time the last hold tick started.
+   */
+  unsigned long mLastTick;
+
+  public:
+
+  /**
+   * Creates a new TrackFilter that passes all values through.
+   */
+  TrackFilter();
+
+  /**
+   * Sets the number of consecutive samples (1 to 8) a contact needs
+   * to show a new state before it is reported. Contacts are counted
+   * from 1. An index of 0 applies the value to all contacts. Contacts
+   * beyond 8 * FILTER_BYTES are ignored.
+   */
+  void setDebounce(int index, byte samples);
+
+  /**
+   * Sets the number of hold ticks (0 to 15) a contact stays occupied
+   * after its last active sample. Contacts are counted from 1. An
+   * index of 0 applies the value to all contacts. Contacts beyond
+   * 8 * FILTER_BYTES are ignored.
+   */
+  void setHold(int index, byte ticks);
+
+  /**
+   * Sets the length of a hold tick in ms. Zero (the default) means
+   * that hold times are counted in samples instead.
+   */
+  void setHoldTick(word time);
+
+  /**
+   * Filters the given number of bytes of raw contact values. The state
+   * holds the filtered values and is updated in place. The raw values
+   * are replaced by the changes, that is, by the filtered values that
+   * flipped. Call this exactly once per sample.
+   */
+  void apply(byte *values, byte *state, int size);
+
+};
+
+// ===================================================================
+// === TrackEventQueue ===============================================
+// ===================================================================
+
+/**
+ * Number of contact events a reporter can buffer. Each one costs 6
+ * bytes of RAM. Can be overridden via a compiler flag.
+ */
+#if !defined(REPORTER_EVENTS)
+#if defined(__MEGA__) || defined(__ESP__)
+#define REPORTER_EVENTS 16
+#else
+#define REPORTER_EVENTS 8
+#endif
+#endif
+
+/**
+ * Represents a single change of a contact as seen by a reporter.
+ */
+class TrackEvent {
+
+  public:
+
+  /**
+   * The contact that changed, counting from 1.
+   */
+  word contact;
+
+  /**
+   * Whether the contact became active (true) or inactive (false).
+   */
+  boolean active;
+
+  /**
+   * The time (in us, as returned by micros()) the change was sampled.
+   */
+  unsigned long time;
+
+};
+
+/**
+ * A fixed-size ring buffer of contact events. Events are pushed as
+ * soon as the reporter samples them, which may well be inside an
+ * interrupt handler, so pushing never blocks. If the buffer is full,
+ * the new event is dropped and counted as an overflow.
+ */
+class TrackEventQueue {
+
+  private:
+
+  /**
+   * The contacts, with the edge stored in the topmost bit.
+   */
+  word mContacts[REPORTER_EVENTS];
+
+  /**
+   * The time stamps.
+   */
+  unsigned long mTimes[REPORTER_EVENTS];
+
+  /**
+   * Read and write positions plus number of buffered events.
+   */
+  volatile byte mRead, mWrite, mLength;
+
+  /**
+   * The number of events lost since the last clear().
+   */
+  volatile word mOverflows;
+
+  public:
+
+  /**
+   * Creates a new, empty TrackEventQueue.
+   */
+  TrackEventQueue();
+
+  /**
+   * Removes all events and resets the overflow counter.
+   */
+  void clear();
+
+  /**
+   * Appends an event. There must only be a single producer per queue,
+   * but that one may well be an interrupt handler.
+   */
+  void push(word contact, boolean active, unsigned long time);
+
+  /**
+   * Removes the oldest event and reports true, or reports false if
+   * there is none.
+   */
+  boolean pop(TrackEvent &event);
+
+  /**
+   * Returns the number of events lost because the buffer was full.
+   */
+  word getOverflows();
+
+};
+
+// ===================================================================
+// === TrackReporter =================================================
+// ===================================================================
+
+/**
+ * The common interface of all track reporters, so automation code can
+ * be written once and then run against S88, I/O expanders, contacts
+ * reported via CAN or any mix of these. Contacts are counted from 1.
+ * A reporter keeps a snapshot of all contacts that is updated on each
+ * call to refresh(), the changes made by the most recent refresh()
+ * (the diff) and a queue of time-stamped raw events.
+ */
+class TrackReporter {
+
+  public:
+
+  /**
+   * Reads the current state of all contacts into the TrackReporter.
+   * Call this method periodically to have up-to-date values.
+   */
+  virtual void refresh() = 0;
+
+  /**
+   * Returns the number of contacts available.
+   */
+  virtual int getSize() = 0;
+
+  /**
+   * Returns the state of an individual contact as of the last call
+   * to refresh(). Contacts are counted from 1. Returns false for
+   * contacts that do not exist.
+   */
+  virtual boolean getValue(int index) = 0;
+
+  /**
+   * Reflects whether the given contact changed its (filtered) state
+   * during the last call to refresh(). Returns false for contacts
+   * that do not exist.
+   */
+  virtual boolean hasChanged(int index) = 0;
+
+  /**
+   * Returns the first contact after the given one that changed its
+   * state during the last call to refresh(), or 0 if there is none.
+   * Pass 0 to start. This skips unchanged contacts in bulk, so it is
+   * much faster than calling hasChanged() for each contact.
+   */
+  virtual int nextChange(int index) = 0;
+
+  /**
+   * Removes the oldest raw contact change from the event queue and
+   * reports true, or reports false if there is none.
+   */
+  virtual boolean getEvent(TrackEvent &event) = 0;
+
+  /**
+   * Returns the number of events lost because the queue was full.
+   */
+  virtual word getOverflows() = 0;
+
+  /**
+   * Sets the number of consecutive samples (1 to 8) a contact needs
+   * to show a new state before it is reported. An index of 0 applies
+   * the value to all contacts.
+   */
+  virtual void setDebounce(int index, byte samples) = 0;
+
+  /**
+   * Sets the number of hold ticks (0 to 15) a contact stays occupied
+   * after its last active sample. An index of 0 applies the value to
+   * all contacts.
+   */
+  virtual void setHold(int index, byte ticks) = 0;
+
+  /**
+   * Sets the length of a hold tick in ms. Zero (the default) means
+   * that hold times are counted in calls to refresh() instead.
+   */
+  virtual void setHoldTick(word time) = 0;
+
+};
+
+/**
+ * Base class for reporters that sample their contacts themselves. It
+ * keeps the snapshot, the diff, the filter and the event queue, so a
+ * backend only has to implement refresh() by filling mChanges with
+ * raw values and then calling update(). The backend provides the
+ * storage for the snapshot and the diff, so each one can size it to
+ * the contacts it supports.
+ */
+class TrackReporterBuffered : public TrackReporter {
+
+  protected:
+
+  /**
+   * The number of contacts available.
+   */
+  int mSize;
+
+  /**
+   * The most recent contact values we know.
+   */
+  byte *mSwitches;
+
+  /**
+   * The contacts that changed during the last refresh().
+   */
+  byte *mChanges;
+
+  /**
+   * Debounces the raw contact values.
+   */
+  TrackFilter mFilter;
+
+  /**
+   * Holds the raw changes seen by the backend.
+   */
+  TrackEventQueue mEvents;
+
+  /**
+   * Creates a new reporter with the given number of contacts, keeping
+   * them in the given arrays of the given number of bytes each.
+   */
+  TrackReporterBuffered(int size, byte *switches, byte *changes, int bytes);
+
+  /**
+   * Filters the raw values in mChanges into mSwitches and replaces
+   * them by the changes.
+   */
+  void update();
+
+  public:
+
+  virtual int getSize();
+
+  virtual boolean getValue(int index);
+
+  virtual boolean hasChanged(int index);
+
+  virtual int nextChange(int index);
+
+  virtual boolean getEvent(TrackEvent &event);
+
+  virtual word getOverflows();
+
+  virtual void setDebounce(int index, byte samples);
+
+  virtual void setHold(int index, byte ticks);
+
+  virtual void setHoldTick(word time);
+
+};
+
+// ===================================================================
+// === TrackReporterS88 ==============================================
+// ===================================================================
+
+/**
+ * Implements the S88 bus protocol for reporting the state of tracks.
+ * S88 is basically a long shift register where each bit corresponds
+ * to a single contact on the track. Flip-flops on each S88 board make
+ * sure activations are stored, so it is not necessary to query a
+ * contact at the exact time it is activated. This implementation
+ * allows a maximum of 8 * REPORTER_BYTES bits, that is, 512 bits or
+ * 32 full-width (16 bit) S88 boards by default. The S88
+ * standard recommends a maximum of 30 boards, so we should be on the
+ * safe side. Changes are detected per bit while refresh() shifts the
+ * values in, so the event time stamp is that of the read, not of the
+ * actual activation, which the S88 flip-flops do not record.
+ */
+class TrackReporterS88 : public TrackReporterBuffered {
+
+  private:
+
+  /**
+   * Storage for the snapshot and the diff.
+   */
+  byte mBuffers[2][REPORTER_BYTES];
+
+  /**
+   * The previous raw contact values, for detecting changes.
+   */
+  byte mLast[REPORTER_BYTES];
+
+  public:
+
+  /**
+   * Creates a new TrackReporter with the given number of modules
+   * being attached. While this value can be safely set to the
+   * maximum of 32, it makes sense to specify the actual number,
+   * since this speeds up reporting. The method assumes 16 bit
+   * modules. If you use 8 bit modules instead (or both) you need
+   * to do the math yourself.
+   */
+  TrackReporterS88(int modules);
+
+  /**
+   * Reads the current state of all contacts into the TrackReporter
+   * and clears the flip-flops on all S88 boards. Call this method
+   * periodically to have up-to-date values.
+   */
+  virtual void refresh();
+
+};
+
+// ===================================================================
+// === TrackReporterIOX ==============================================
+// ===================================================================
+
+/**
+ * Implements a low-cost track reporting mechanism based on I/O
+ * expanders. Currently the MCP 23S08 and MCP 23S17 are supported,
+ * with the MCP 23S08 being treaded just like the 16 bit module, so
+ * the upper 8 bits are undefined. The IO expanders are connected via
+ * SPI. The interrupt line must be connected to Arduino pin 3
+ * (interrupt 1) and pulled up via a resistor. Multiple expanders can
+ * be combined, assuming they are configured to different addresses
+ * via the hardware pins. Since there are only eight addresses, every
+ * group of eight expanders needs its own chip select pin (by default
+ * pins 6, 7, 8 and 9). All need to share the interrupt line, which is
+ * configured for open drain. A maximum of IOX_BYTES / 2 expanders
+ * is supported, that is, 32 on the Mega and 8 on the smaller boards
+ * by default. Changes are time stamped inside the interrupt handler,
+ * so event time stamps are only off by the interrupt latency.
+ */
+class TrackReporterIOX : public TrackReporterBuffered {
+
+private:
+
+  /**
+   * The number of IO expanders being used.
+   */
+  int mCount;
+
+  /**
+   * Storage for the snapshot and the diff.
+   */
+  byte mBuffers[2][IOX_BYTES];
+
+  /**
+   * Configures the expanders and installs the interrupt handler.
+   */
+  void init(int modules, const byte selects[]);
+
+public:
+
+  /**
+   * Creates a new TrackReporter with the given number of expanders,
+   * using the default chip select pins.
+   */
+  TrackReporterIOX(int modules);
+
+  /**
+   * Creates a new TrackReporter with the given number of expanders.
+   * The array holds one chip select pin for each group of eight
+   * expanders, in the order of the contacts.
+   */
+  TrackReporterIOX(int modules, const byte selects[]);
+
+  /**
+   * Is called when a TrackReporter is being destroyed. Does the
+   * necessary cleanup. No need to call this manually.
+   */
+  ~TrackReporterIOX();
 
   /**
    * Reads the current state of all expanders into the TrackReporter.
    * Call this method periodically to have up-to-date values.
    */
-  void refresh();
+  virtual void refresh();
+
+};
+
+// ===================================================================
+// === TrackReporterCAN ==============================================
+// ===================================================================
+
+/**
+ * Reports contacts that are read by other devices on the CAN bus, for
+ * instance an L88 or a LinkS88, which announce every change using the
+ * S88 event command (0x11). The reporter listens to all messages the
+ * given TrackController receives. A refresh() polls the controller
+ * (see TrackController::poll()), which leaves the messages to the
+ * sketch if it receives them itself. Contact numbers are taken from
+ * the message as is, and only events from the given device ID are
+ * accepted. Events are time-stamped with the arrival of the message,
+ * not with the refresh().
+ */
+class TrackReporterCAN : public TrackReporterBuffered, public TrackListener {
+
+  private:
+
+  /**
+   * The controller we are listening to.
+   */
+  TrackController *mController;
+
+  /**
+   * The device ID of the S88 bus master.
+   */
+  word mDevice;
+
+  /**
+   * Storage for the snapshot and the diff.
+   */
+  byte mBuffers[2][CAN_REPORTER_BYTES];
+
+  /**
+   * The current contact values, updated on every event.
+   */
+  byte mCurrent[CAN_REPORTER_BYTES];
+
+  /**
+   * The contact values seen since the last refresh().
+   */
+  byte mLatched[CAN_REPORTER_BYTES];
+
+  public:
+
+  /**
+   * Creates a new TrackReporter for the given number of contacts of
+   * the given device and registers it with the controller. At most
+   * 8 * CAN_REPORTER_BYTES contacts are supported, see getSize().
+   */
+  TrackReporterCAN(TrackController &controller, word device, int size);
+
+  /**
+   * Is called when a TrackReporter is being destroyed. Does the
+   * necessary cleanup. No need to call this manually.
+   */
+  ~TrackReporterCAN();
+
+  /**
+   * Polls the controller and updates the contacts.
+   */
+  virtual void refresh();
+
+  /**
+   * Handles S88 events. Internal method.
+   */
+  virtual void messageReceived(TrackMessage &message);
+
+};
+
+// ===================================================================
+// === TrackReporterComposite ========================================
+// ===================================================================
+
+/**
+ * Maximum number of reporters that can be combined.
+ */
+#if !defined(REPORTER_CHILDREN)
+#define REPORTER_CHILDREN 4
+#endif
+
+/**
+ * Merges several reporters (possibly of different types) into one
+ * contact address space. The contacts of the first reporter come
+ * first, followed by those of the second one and so on. The composite
+ * itself does not keep any contact state, so it is cheap. Events are
+ * taken from the reporters in order, so they are not sorted by time
+ * across reporters, but they carry the merged contact numbers.
+ */
+class TrackReporterComposite : public TrackReporter {
+
+  private:
+
+  /**
+   * The reporters being combined.
+   */
+  TrackReporter *mChildren[REPORTER_CHILDREN];
+
+  /**
+   * The number of reporters being combined.
+   */
+  int mCount;
+
+  /**
+   * Finds the reporter for the given contact and turns the index
+   * into a local one. Returns NULL if there is none.
+   */
+  TrackReporter *find(int &index);
+
+  public:
+
+  /**
+   * Creates a new, empty TrackReporterComposite.
+   */
+  TrackReporterComposite();
+
+  /**
+   * Appends the given reporter. Returns false if there are already
+   * too many.
+   */
+  boolean add(TrackReporter &reporter);
+
+  virtual void refresh();
+
+  virtual int getSize();
+
+  virtual boolean getValue(int index);
+
+  virtual boolean hasChanged(int index);
+
+  virtual int nextChange(int index);
+
+  virtual boolean getEvent(TrackEvent &event);
+
+  virtual word getOverflows();
+
+  virtual void setDebounce(int index, byte samples);
+
+  virtual void setHold(int index, byte ticks);
+
+  virtual void setHoldTick(word time);
+
+};
+
+// ===================================================================
+// === TrackScheduler ================================================
+// ===================================================================
+
+/**
+ * Starts the body of a task's run() method. The body is a stackless
+ * coroutine: it returns to the scheduler at every TASK_YIELD() and
+ * continues right after it on the next call. Local variables do not
+ * survive a yield, so keep state in members of the task. Don't use
+ * switch statements across a yield.
+ */
+#define TASK_BEGIN() switch (mState) { case 0:
+
+/**
+ * Returns to the scheduler and continues here once the condition set
+ * up by the preceding sleep(), waitForContact() or request() is met.
+ * Without such a call, the task just continues on the next update().
+ */
+#define TASK_YIELD() do { mState = __LINE__; return; case __LINE__:; } while (0)
+
+/**
+ * Ends the body of a task's run() method. The task is finished when
+ * it gets here.
+ */
+#define TASK_END() } mState = 0; finish();
+
+class TrackScheduler;
+
+/**
+ * A piece of automation logic, for instance the commuting of a single
+ * train, that shares the Arduino with other tasks. Instead of calling
+ * delay() or waiting for a contact in a loop, a task tells what it is
+ * waiting for and returns, and the scheduler calls run() again once
+ * that has happened. run() can be written as a state machine, with a
+ * switch on some member, or, more conveniently, as a coroutine using
+ * the TASK_* macros:
+ *
+ *   void run() {
+ *     TASK_BEGIN();
+ *     setLocoSpeed(LOCO, 100);
+ *     TASK_YIELD();
+ *     waitForContact(3, true, 0);
+ *     TASK_YIELD();
+ *     setLocoSpeed(LOCO, 0);
+ *     TASK_YIELD();
+ *     sleep(2000);
+ *     TASK_YIELD();
+ *     TASK_END();
+ *   }
+ *
+ * Tasks are chained through mNext, so the scheduler doesn't need any
+ * extra memory for them.
+ */
+class TrackTask {
+
+  friend class TrackScheduler;
+
+  private:
+
+  /**
+   * The scheduler running this task.
+   */
+  TrackScheduler *mScheduler;
+
+  /**
+   * The next task of the same scheduler.
+   */
+  TrackTask *mNext;
+
+  /**
+   * What the task is waiting for (one of the TASK_* states in the
+   * implementation).
+   */
+  byte mWait;
+
+  /**
+   * Whether the most recent wait ended with success.
+   */
+  boolean mResult;
+
+  /**
+   * The contact and edge to wait for.
+   */
+  int mContact;
+  boolean mActive;
+
+  /**
+   * When the most recent wait started (ms) and how long it may take.
+   */
+  unsigned long mStart;
+  word mTimeout;
+
+  /**
+   * The most recent request, replaced by the response once it
+   * arrives.
+   */
+  TrackMessage mMessage;
+
+  /**
+   * Reflects whether the task should be run now. Sets the result of
+   * waits that end here.
+   */
+  boolean isDue(TrackReporter *reporter, unsigned long now);
+
+  protected:
+
+  /**
+   * The current position in the coroutine or state machine. Starts
+   * at 0. Used by the TASK_* macros.
+   */
+  word mState;
+
+  /**
+   * Makes the scheduler call run() again after the given time (ms).
+   */
+  void sleep(word time);
+
+  /**
+   * Makes the scheduler call run() again once the given contact of
+   * the scheduler's reporter changes to the given state, or after
+   * the timeout (ms, zero means forever) expired. getResult() tells
+   * which of the two happened.
+   */
+  void waitForContact(int index, boolean active, word timeout);
+
+  /**
+   * Sends a message and makes the scheduler call run() again once
+   * the matching response arrived or the timeout (ms) expired. The
+   * response has the same command and the same first four data bytes
+   * (the address). getResult() tells whether it arrived,
+   * getResponse() returns it.
+   */
+  void request(TrackMessage &message, word timeout);
+
+  /**
+   * Non-blocking versions of the TrackController methods of the same
+   * name. They work like request() with a timeout of one second.
+   * setLocoDirection() relies on the Gleisbox to stop the loco,
+   * which it does on any change of direction.
+   */
+  void setLocoSpeed(word address, word speed);
+  void setLocoDirection(word address, byte direction);
+  void setLocoFunction(word address, byte function, byte power);
+  void setAccessory(word address, byte position, byte power);
+
+  /**
+   * Reflects whether the most recent wait ended with success, that
+   * is, not with a timeout.
+   */
+  boolean getResult();
+
+  /**
+   * Returns the response to the most recent request.
+   */
+  TrackMessage &getResponse();
+
+  /**
+   * Ends the task. It is removed from the scheduler after run()
+   * returns.
+   */
+  void finish();
+
+  public:
+
+  /**
+   * Creates a new task.
+   */
+  TrackTask();
+
+  /**
+   * Does the next step of the task. Is called by the scheduler.
+   */
+  virtual void run() = 0;
+
+  /**
+   * Reflects whether the task is currently being run by a scheduler.
+   */
+  boolean isRunning();
+
+};
+
+/**
+ * Runs any number of tasks cooperatively, so a single Arduino can
+ * handle several trains without a blocking call anywhere. Call
+ * update() from loop() as often as possible. Each update() refreshes
+ * the reporter (if any), polls the controller for answers (see
+ * TrackController::poll()) and then calls all tasks whose timer
+ * expired, whose contact changed or whose request was answered. Tasks
+ * must not block, but may use the blocking TrackController methods
+ * for the odd quick call.
+ */
+class TrackScheduler : public TrackListener {
+
+  private:
+
+  /**
+   * The controller used for requests.
+   */
+  TrackController *mController;
+
+  /**
+   * The reporter used for contacts, may be NULL.
+   */
+  TrackReporter *mReporter;
+
+  /**
+   * The first task.
+   */
+  TrackTask *mTasks;
+
+  public:
+
+  /**
+   * Creates a new scheduler that sends requests via the given
+   * controller and, optionally, takes contacts from the given
+   * reporter.
+   */
+  TrackScheduler(TrackController &controller, TrackReporter *reporter);
+
+  /**
+   * Is called when a TrackScheduler is being destroyed. Does the
+   * necessary cleanup. No need to call this manually.
+   */
+  ~TrackScheduler();
+
+  /**
+   * Starts a task from the beginning. Does nothing if it is already
+   * running.
+   */
+  void start(TrackTask &task);
+
+  /**
+   * Stops a task. It can be started again later.
+   */
+  void stop(TrackTask &task);
+
+  /**
+   * Returns the number of tasks running.
+   */
+  int getCount();
+
+  /**
+   * Does one round of work. Call this from loop().
+   */
+  void update();
+
+  /**
+   * Completes requests. Internal method.
+   */
+  virtual void messageReceived(TrackMessage &message);
+
+  /**
+   * Sends a message. Internal method.
+   */
+  boolean sendMessage(TrackMessage &message);
+
+};
+
+// ===================================================================
+// === TrackLayout ===================================================
+// ===================================================================
+
+/**
+ * Addresses of locos and accessories by protocol, for use in layout
+ * descriptions instead of sums like ADDR_MM2 + 78.
+ */
+constexpr word locoMM2(word n) { return ADDR_MM2 + n; }
+constexpr word locoSX1(word n) { return ADDR_SX1 + n; }
+constexpr word locoMFX(word n) { return ADDR_MFX + n; }
+constexpr word locoDCC(word n) { return ADDR_DCC + n; }
+constexpr word accMM2(word n) { return ADDR_ACC_MM2 + n; }
+constexpr word accSX1(word n) { return ADDR_ACC_SX1 + n; }
+constexpr word accDCC(word n) { return ADDR_ACC_DCC + n; }
+
+/**
+ * Returns a bitmask with the given bits (0 to 31) set, for instance
+ * the turnouts of a route.
+ */
+constexpr unsigned long trackBits() {
+  return 0;
+}
+
+template<typename... Bits> constexpr unsigned long trackBits(int bit, Bits... bits) {
+  return (1UL << bit) | trackBits(bits...);
+}
+
+/**
+ * Describes a single block of a layout in the static block table.
+ * Trains run from a block to the next one only and are handed over
+ * from the first block whose next one it is. Blocks and contacts are
+ * counted from 1, 0 means none. A contact may enter one block and
+ * leave another, but not enter (or leave) several blocks.
+ */
+class TrackBlock {
+
+  public:
+
+  /**
+   * The contact a train hits when entering the block.
+   */
+  byte enter;
+
+  /**
+   * The contact a train hits when it has left the block. If there is
+   * none, the block is free as soon as the train enters the next one.
+   */
+  byte exit;
+
+  /**
+   * The block following this one.
+   */
+  byte next;
+
+  /**
+   * The signal protecting the end of the block, if any.
+   */
+  word signal;
+
+};
+
+/**
+ * Describes a route through the turnouts of a layout, which are
+ * counted from 0 for use in bitmasks (see trackBits()), so there can
+ * be up to 32 of them.
+ */
+class TrackRoute {
+
+  public:
+
+  /**
+   * The block the route starts in.
+   */
+  byte from;
+
+  /**
+   * The block the route ends in.
+   */
+  byte to;
+
+  /**
+   * The turnouts the route uses.
+   */
+  unsigned long turnouts;
+
+  /**
+   * The turnouts that have to be straight. All other turnouts the
+   * route uses have to be round.
+   */
+  unsigned long straight;
+
+};
+
+/**
+ * Internal helpers that look up blocks at compile time.
+ */
+constexpr byte trackEnteredAt(const TrackBlock *blocks, int count, int contact, int i = 0) {
+  return i == count ? 0 : blocks[i].enter == contact ? i + 1 : trackEnteredAt(blocks, count, contact, i + 1);
+}
+
+constexpr byte trackLeftAt(const TrackBlock *blocks, int count, int contact, int i = 0) {
+  return i == count ? 0 : blocks[i].exit == contact ? i + 1 : trackLeftAt(blocks, count, contact, i + 1);
+}
+
+constexpr byte trackPrevious(const TrackBlock *blocks, int count, int block, int i = 0) {
+  return i == count ? 0 : blocks[i].next == block ? i + 1 : trackPrevious(blocks, count, block, i + 1);
+}
+
+/**
+ * Internal list of the numbers 0 to N-1, for generating tables.
+ */
+template<int... I> struct TrackSequence {};
+
+template<int N, int... I> struct TrackCount : TrackCount<N - 1, N - 1, I...> {};
+
+template<int... I> struct TrackCount<0, I...> {
+  typedef TrackSequence<I...> type;
+};
+
+/**
+ * Lookup tables generated by the compiler from a block table that is
+ * a constexpr. They are in flash, so they don't cost any RAM. Use via
+ * TRACK_LAYOUT.
+ */
+template<const TrackBlock *B, int N, int C,
+    class Contacts = typename TrackCount<C + 1>::type,
+    class Blocks = typename TrackCount<N + 1>::type>
+class TrackBlockTables;
+
+template<const TrackBlock *B, int N, int C, int... I, int... J>
+class TrackBlockTables<B, N, C, TrackSequence<I...>, TrackSequence<J...> > {
+
+  public:
+
+  /**
+   * The block entered at each contact.
+   */
+  static const byte entered[C + 1];
+
+  /**
+   * The block left at each contact.
+   */
+  static const byte left[C + 1];
+
+  /**
+   * The block before each block.
+   */
+  static const byte previous[N + 1];
+
+};
+
+template<const TrackBlock *B, int N, int C, int... I, int... J>
+const byte TrackBlockTables<B, N, C, TrackSequence<I...>, TrackSequence<J...> >::entered[C + 1] PROGMEM = {
+  trackEnteredAt(B, N, I)...
+};
+
+template<const TrackBlock *B, int N, int C, int... I, int... J>
+const byte TrackBlockTables<B, N, C, TrackSequence<I...>, TrackSequence<J...> >::left[C + 1] PROGMEM = {
+  trackLeftAt(B, N, I)...
+};
+
+template<const TrackBlock *B, int N, int C, int... I, int... J>
+const byte TrackBlockTables<B, N, C, TrackSequence<I...>, TrackSequence<J...> >::previous[N + 1] PROGMEM = {
+  trackPrevious(B, N, J)...
+};
+
+/**
+ * Maximum number of routes, limited by the size of a conflict mask.
+ */
+#define TRACK_ROUTES 64
+
+/**
+ * Internal helpers that work out at compile time which routes are in
+ * conflict: those sharing a turnout or a block.
+ */
+constexpr boolean trackSameBlock(byte a, byte b) {
+  return a != 0 && a == b;
+}
+
+constexpr boolean trackConflict(const TrackRoute &a, const TrackRoute &b) {
+  return (a.turnouts & b.turnouts) != 0
+      || trackSameBlock(a.from, b.from) || trackSameBlock(a.from, b.to)
+      || trackSameBlock(a.to, b.from) || trackSameBlock(a.to, b.to);
+}
+
+constexpr uint64_t trackConflicts(const TrackRoute *routes, int count, int i, int j = 0) {
+  return j == count ? 0 : ((j != i && trackConflict(routes[i], routes[j]) ? 1ULL << j : 0) | trackConflicts(routes, count, i, j + 1));
+}
+
+/**
+ * The conflict matrix generated by the compiler from a route table
+ * that is a constexpr: one bitmask of conflicting routes per route,
+ * in flash. Use via TRACK_LAYOUT_WITH_ROUTES.
+ */
+template<const TrackRoute *R, int N, class Routes = typename TrackCount<N>::type>
+class TrackRouteTables;
+
+template<const TrackRoute *R, int N, int... I>
+class TrackRouteTables<R, N, TrackSequence<I...> > {
+
+  static_assert(N <= TRACK_ROUTES, "Too many routes");
+
+  public:
+
+  /**
+   * The routes in conflict with each route.
+   */
+  static const uint64_t conflicts[N];
+
+};
+
+template<const TrackRoute *R, int N, int... I>
+const uint64_t TrackRouteTables<R, N, TrackSequence<I...> >::conflicts[N] PROGMEM = {
+  trackConflicts(R, N, I)...
+};
+
+/**
+ * Describes a layout: its blocks, the turnouts and the routes through
+ * them. Everything lives in flash. Don't create a layout directly, use
+ * the macros below, which also generate the lookup tables. A layout
+ * is written like this:
+ *
+ *   enum { WEST = 1, EAST };   // Blocks
+ *   enum { W1, W2 };           // Turnouts
+ *
+ *   constexpr TrackBlock BLOCKS[] PROGMEM = {
+ *     { 1, 0, EAST, accMM2(10) },
+ *     { 2, 0, WEST, accMM2(11) }
+ *   };
+ *
+ *   const word TURNOUTS[] PROGMEM = { accMM2(1), accMM2(2) };
+ *
+ *   constexpr TrackRoute ROUTES[] PROGMEM = {
+ *     { WEST, EAST, trackBits(W1, W2), trackBits(W1) }
+ *   };
+ *
+ *   TRACK_LAYOUT_WITH_ROUTES(layout, BLOCKS, 16, TURNOUTS, ROUTES);
+ *
+ * The block and route tables have to be constexpr, so the compiler
+ * can work out which block belongs to which contact and which routes
+ * are in conflict.
+ */
+class TrackLayout {
+
+  private:
+
+  const TrackBlock *mBlocks;
+  byte mBlockCount;
+
+  byte mContactCount;
+  const byte *mEntered;
+  const byte *mLeft;
+  const byte *mPrevious;
+
+  const word *mTurnouts;
+  byte mTurnoutCount;
+
+  const TrackRoute *mRoutes;
+  const uint64_t *mConflicts;
+  byte mRouteCount;
+
+  public:
+
+  /**
+   * Creates a new layout. Internal method, use the macros below.
+   */
+  TrackLayout(const TrackBlock *blocks, byte blockCount, byte contactCount,
+              const byte *entered, const byte *left, const byte *previous,
+              const word *turnouts, byte turnoutCount,
+              const TrackRoute *routes, const uint64_t *conflicts, byte routeCount);
+
+  /**
+   * Return the numbers of blocks, contacts, turnouts and routes.
+   */
+  int getBlockCount();
+  int getContactCount();
+  int getTurnoutCount();
+  int getRouteCount();
+
+  /**
+   * Returns the given block, counting from 1.
+   */
+  TrackBlock getBlock(int index);
+
+  /**
+   * Returns the block a train enters (or leaves) at the given contact,
+   * or 0 if there is none.
+   */
+  int getEnteredBlock(int contact);
+  int getLeftBlock(int contact);
+
+  /**
+   * Returns the block before the given one, or 0 if there is none.
+   */
+  int getPreviousBlock(int index);
+
+  /**
+   * Returns the address of the given turnout, counting from 0.
+   */
+  word getTurnout(int index);
+
+  /**
+   * Returns the given route, counting from 1.
+   */
+  TrackRoute getRoute(int index);
+
+  /**
+   * Returns the routes in conflict with the given one as a bitmask,
+   * with bit 0 standing for route 1. A layout without routes has no
+   * conflicts.
+   */
+  uint64_t getConflicts(int index);
+
+};
+
+/**
+ * Defines a layout with the given name, block table (a constexpr in
+ * flash) and number of contacts.
+ */
+#define TRACK_LAYOUT(name, blocks, contacts)                                    \
+  TrackLayout name(blocks, sizeof(blocks) / sizeof(TrackBlock), contacts,       \
+    TrackBlockTables<blocks, sizeof(blocks) / sizeof(TrackBlock), contacts>::entered, \
+    TrackBlockTables<blocks, sizeof(blocks) / sizeof(TrackBlock), contacts>::left, \
+    TrackBlockTables<blocks, sizeof(blocks) / sizeof(TrackBlock), contacts>::previous, \
+    NULL, 0, NULL, NULL, 0)
+
+/**
+ * Defines a layout like TRACK_LAYOUT, plus a table of turnout
+ * addresses and a table of routes (a constexpr), both in flash.
+ */
+#define TRACK_LAYOUT_WITH_ROUTES(name, blocks, contacts, turnouts, routes)     \
+  TrackLayout name(blocks, sizeof(blocks) / sizeof(TrackBlock), contacts,       \
+    TrackBlockTables<blocks, sizeof(blocks) / sizeof(TrackBlock), contacts>::entered, \
+    TrackBlockTables<blocks, sizeof(blocks) / sizeof(TrackBlock), contacts>::left, \
+    TrackBlockTables<blocks, sizeof(blocks) / sizeof(TrackBlock), contacts>::previous, \
+    turnouts, sizeof(turnouts) / sizeof(word), routes,                          \
+    TrackRouteTables<routes, sizeof(routes) / sizeof(TrackRoute)>::conflicts,  \
+    sizeof(routes) / sizeof(TrackRoute))
+
+// ===================================================================
+// === TrackBlocks ===================================================
+// ===================================================================
+
+/**
+ * Maximum number of blocks. Each one costs 4 bytes of RAM plus 3 bits.
+ * Can be overridden via a compiler flag.
+ */
+#if !defined(TRACK_BLOCKS)
+#define TRACK_BLOCKS 32
+#endif
+
+/**
+ * Time (ms) a signal is powered when switched.
+ */
+#define BLOCK_SIGNAL_TIME 200
+
+/**
+ * Keeps track of which blocks are occupied and by which train, based
+ * on the contact changes seen by a reporter, and protects the trains:
+ * when the block ahead of a train is occupied, the signal at the end
+ * of its own block goes to red and the train is stopped, and when the
+ * block ahead gets free again, the signal goes to green and the train
+ * is sent on at its previous speed. All state lives in fixed arrays
+ * and bitsets, and update() only looks up the changed contacts in the
+ * layout's tables and walks the blocks once, so the time it takes is
+ * bounded by the size of the layout, no matter what happens on the
+ * track. Commands are sent without waiting for responses.
+ */
+class TrackBlocks {
+
+  private:
+
+  /**
+   * The controller used for stop and go commands.
+   */
+  TrackController *mController;
+
+  /**
+   * The reporter providing the contacts.
+   */
+  TrackReporter *mReporter;
+
+  /**
+   * The layout, with the static block table.
+   */
+  TrackLayout *mLayout;
+
+  /**
+   * The number of blocks in the layout.
+   */
+  int mCount;
+
+  /**
+   * The trains in the blocks and their speeds.
+   */
+  word mTrains[TRACK_BLOCKS];
+  word mSpeeds[TRACK_BLOCKS];
+
+  /**
+   * The occupied blocks.
+   */
+  byte mOccupied[(TRACK_BLOCKS + 7) / 8];
+
+  /**
+   * The blocks whose signal shows red.
+   */
+  byte mRed[(TRACK_BLOCKS + 7) / 8];
+
+  /**
+   * The signals that still need to be powered off.
+   */
+  byte mPowered[(TRACK_BLOCKS + 7) / 8];
+
+  /**
+   * When the last signal was switched (ms).
+   */
+  unsigned long mSwitched;
+
+  /**
+   * Sends a command without waiting for the response.
+   */
+  void send(byte command, word address, byte value1, byte value2);
+
+  /**
+   * Sets the signal of a block and stops or restarts its train.
+   */
+  void protect(int index, boolean red);
+
+  public:
+
+  /**
+   * Creates a new block engine for the given layout.
+   */
+  TrackBlocks(TrackController &controller, TrackReporter &reporter, TrackLayout &layout);
+
+  /**
+   * Puts a train into a block, so it can be tracked and protected
+   * from there on. The speed is the one to restore after a stop.
+   */
+  void setTrain(int index, word address, word speed);
+
+  /**
+   * Returns the train in the given block, or 0 if none is known.
+   */
+  word getTrain(int index);
+
+  /**
+   * Reflects whether the given block is occupied.
+   */
+  boolean isOccupied(int index);
+
+  /**
+   * Reflects whether the signal at the end of the given block shows
+   * red, that is, whether its train has to stop.
+   */
+  boolean isRed(int index);
+
+  /**
+   * Clears all occupancy and sets all signals to green.
+   */
+  void reset();
+
+  /**
+   * Processes the contact changes of the reporter's most recent
+   * refresh(). Call this after each refresh().
+   */
+  void update();
+
+};
+
+// ===================================================================
+// === TrackInterlocking =============================================
+// ===================================================================
+
+/**
+ * Time (ms) turnouts are powered when a route is set.
+ */
+#define ROUTE_SWITCH_TIME 200
+
+/**
+ * Sets and locks routes of a layout. A route can only be set if none
+ * of the routes in conflict with it (see TrackLayout) is set and, if
+ * the interlocking knows the blocks, its target block is free. As the
+ * conflicts are precomputed bitmasks in flash, checking a route takes
+ * a single AND, no matter how many routes (up to 64) there are, so it
+ * is fine to do in every loop. The turnouts of all routes set since
+ * the last update() are switched together, in one batch of accessory
+ * commands that are powered off together, too. Routes are released
+ * explicitly or, if the interlocking knows the blocks, as soon as the
+ * train has left the start block and arrived in the target block.
+ * Routes count from 1. Those that don't exist are never set or free.
+ */
+class TrackInterlocking {
+
+  private:
+
+  /**
+   * The controller used for switching turnouts.
+   */
+  TrackController *mController;
+
+  /**
+   * The layout with routes, turnouts and conflicts.
+   */
+  TrackLayout *mLayout;
+
+  /**
+   * The blocks, may be NULL.
+   */
+  TrackBlocks *mBlocks;
+
+  /**
+   * The routes currently set, bit 0 standing for route 1.
+   */
+  uint64_t mSet;
+
+  /**
+   * The positions of the turnouts, 1 meaning straight.
+   */
+  unsigned long mStraight;
+
+  /**
+   * The turnouts waiting to be switched, those being switched and
+   * the positions they are being switched to.
+   */
+  unsigned long mPending;
+  unsigned long mPowered;
+  unsigned long mPoweredStraight;
+
+  /**
+   * When the turnouts were switched (ms).
+   */
+  unsigned long mSwitched;
+
+  /**
+   * Sends an accessory command for the given turnout without waiting
+   * for the response.
+   */
+  void send(int turnout, boolean straight, byte power);
+
+  /**
+   * Reflects whether the given route exists.
+   */
+  boolean isValid(int route);
+
+  public:
+
+  /**
+   * Creates a new interlocking for the given layout. Pass the blocks
+   * to take occupancy into account, or NULL.
+   */
+  TrackInterlocking(TrackController &controller, TrackLayout &layout, TrackBlocks *blocks);
+
+  /**
+   * Reflects whether the given route is set.
+   */
+  boolean isSet(int route);
+
+  /**
+   * Reflects whether the given route can be set, that is, whether
+   * neither a conflicting route is set nor the target block is
+   * occupied.
+   */
+  boolean isFree(int route);
+
+  /**
+   * Sets and locks the given route. The turnouts are switched on the
+   * next update(). The return value reflects whether the route exists
+   * and was free.
+   */
+  boolean setRoute(int route);
+
+  /**
+   * Releases the given route.
+   */
+  void releaseRoute(int route);
+
+  /**
+   * Releases all routes.
+   */
+  void reset();
+
+  /**
+   * Reflects whether turnouts are still waiting to be switched or
+   * being switched.
+   */
+  boolean isSwitching();
+
+  /**
+   * Switches turnouts and releases routes the trains have passed.
+   * Call this from loop(), after the blocks' update().
+   */
+  void update();
+
+};
+
+// ===================================================================
+// === TrackTimetable ================================================
+// ===================================================================
+
+/**
+ * Number of actions that can be scheduled at runtime, in addition to
+ * those in the timetable. Each one costs 10 bytes of RAM. Can be
+ * overridden via a compiler flag.
+ */
+#if !defined(TIMETABLE_ACTIONS)
+#define TIMETABLE_ACTIONS 8
+#endif
+
+/**
+ * Types of actions.
+ */
+#define ACTION_POWER     0 // value = 0 (stop) or 1 (go)
+#define ACTION_SPEED     1 // value = speed
+#define ACTION_DIRECTION 2 // value = DIR_* constant
+#define ACTION_FUNCTION  3 // value = function, power = on/off
+#define ACTION_ACCESSORY 4 // value = position, power = on/off
+
+/**
+ * A single timed action, either a line of a timetable in flash or an
+ * action scheduled at runtime.
+ */
+class TrackAction {
+
+  public:
+
+  /**
+   * When to do it, in ms after the start of the timetable (or after
+   * the call to schedule()).
+   */
+  unsigned long time;
+
+  /**
+   * What to do, one of the ACTION_* constants.
+   */
+  byte type;
+
+  /**
+   * The loco or accessory to do it with.
+   */
+  word address;
+
+  /**
+   * The speed, direction, function or position.
+   */
+  word value;
+
+  /**
+   * Power for functions and accessories.
+   */
+  byte power;
+
+};
+
+/**
+ * Runs a timetable of actions, such as the speeds and dwell times of a
+ * shuttle train, without blocking. The timetable is an array of
+ * actions in flash, sorted by time, so it can have hundreds of lines
+ * at no RAM cost. Additional actions can be scheduled at runtime and
+ * are kept in a small min-heap. All times are counted from the start
+ * of the timetable rather than from the previous action, so nothing
+ * drifts, and if a period is given, the timetable starts over after
+ * that time. Each action is sent a bit early to make up for the
+ * latency of the Gleisbox, which is estimated continuously as half
+ * the time it takes to answer.
+ * Accessories are not powered off automatically, so add an action
+ * for that. Call update() from loop() as often as possible. It polls
+ * the controller for the answers (see TrackController::poll()).
+ */
+class TrackTimetable : public TrackListener {
+
+  private:
+
+  /**
+   * The controller used for sending actions.
+   */
+  TrackController *mController;
+
+  /**
+   * The timetable in flash.
+   */
+  const TrackAction *mActions;
+
+  /**
+   * The number of actions in the timetable and the next one to do.
+   */
+  int mCount, mCursor;
+
+  /**
+   * The next action of the timetable, copied from flash.
+   */
+  TrackAction mNext;
+
+  /**
+   * The actions scheduled at runtime, as a min-heap with absolute
+   * times.
+   */
+  TrackAction mHeap[TIMETABLE_ACTIONS];
+
+  /**
+   * The number of actions in the heap.
+   */
+  byte mLength;
+
+  /**
+   * The start of the current period (ms) and the length of a period.
+   */
+  unsigned long mStart, mPeriod;
+
+  /**
+   * Whether the timetable is running.
+   */
+  boolean mRunning;
+
+  /**
+   * The estimated latency of the Gleisbox (ms).
+   */
+  word mLatency;
+
+  /**
+   * The command sent last and when it was sent, for measuring the
+   * latency.
+   */
+  byte mCommand;
+  unsigned long mSent;
+
+  /**
+   * The worst lateness of an action so far (ms).
+   */
+  word mLateness;
+
+  /**
+   * Copies the next action of the timetable from flash, if any.
+   */
+  void fetch();
+
+  /**
+   * Sends an action.
+   */
+  void execute(TrackAction &action);
+
+  /**
+   * Removes the earliest action from the heap.
+   */
+  void pop();
+
+  public:
+
+  /**
+   * Creates a new timetable engine using the given controller.
+   */
+  TrackTimetable(TrackController &controller);
+
+  /**
+   * Is called when a TrackTimetable is being destroyed. Does the
+   * necessary cleanup. No need to call this manually.
+   */
+  ~TrackTimetable();
+
+  /**
+   * Starts running the given timetable (in flash, sorted by time).
+   * A period of zero runs it once.
+   */
+  void begin(const TrackAction *actions, int count, unsigned long period);
+
+  /**
+   * Stops running the timetable and forgets all scheduled actions.
+   */
+  void end();
+
+  /**
+   * Reflects whether there is anything left to do.
+   */
+  boolean isRunning();
+
+  /**
+   * Schedules an action at runtime. The time is counted from now.
+   * Returns false if there are too many actions already.
+   */
+  boolean schedule(TrackAction &action);
+
+  /**
+   * Sets the estimated latency of the Gleisbox (ms). It is refined
+   * with every response.
+   */
+  void setLatency(word latency);
+
+  /**
+   * Returns the estimated latency of the Gleisbox (ms).
+   */
+  word getLatency();
+
+  /**
+   * Returns the worst lateness of an action so far (ms).
+   */
+  word getLateness();
+
+  /**
+   * Does all actions that are due. Call this from loop().
+   */
+  void update();
+
+  /**
+   * Measures the latency. Internal method.
+   */
+  virtual void messageReceived(TrackMessage &message);
+
+};
+
+// ===================================================================
+// === TrackStopper ==================================================
+// ===================================================================
+
+/**
+ * States of a TrackStopper.
+ */
+#define STOPPER_IDLE      0 // Not armed
+#define STOPPER_ARMED     1 // Waiting for the first contact
+#define STOPPER_MEASURING 2 // Waiting for the second contact
+#define STOPPER_WAITING   3 // Waiting for the time to brake
+#define STOPPER_BRAKING   4 // Brake ramp sent, done
+
+/**
+ * Stops a train precisely at a given point, no matter how fast it
+ * goes or how busy loop() is. The train passes two contacts a known
+ * distance apart. Their time stamps give its velocity, and from that
+ * the stopper works out when to start braking so the train comes to
+ * a halt the given distance behind the second contact. All times are
+ * counted from the time stamps of the contact events, not from when
+ * they are processed, and the brake is a non-blocking ramp of the
+ * controller, so neither the refresh rate nor other work in loop()
+ * changes where the train stops. On AVR boards, a compare interrupt
+ * of Timer0 (the one behind millis()) sends the first brake command
+ * on time even while loop() is busy, and update() hands the rest of
+ * the ramp to the controller. For this to work, the contacts need
+ * precise time stamps: the I/O expander and CAN reporters take them
+ * in the interrupt handler, while S88 time stamps are only as good as
+ * the refresh rate. The stopper takes the events from the reporter's
+ * queue, so don't use getEvent() elsewhere. Call update() from loop()
+ * as often as possible, and the update() of the controller, too,
+ * because that is what sends the brake ramp. Like brakeLoco(), this
+ * assumes the velocity of the loco is proportional to its speed.
+ */
+class TrackStopper {
+
+  private:
+
+  /**
+   * The controller used for braking.
+   */
+  TrackController *mController;
+
+  /**
+   * The reporter providing the contact events.
+   */
+  TrackReporter *mReporter;
+
+  /**
+   * The loco and its current speed.
+   */
+  word mAddress, mSpeed;
+
+  /**
+   * The two contacts, their distance and the distance of the stop
+   * point behind the second one (mm).
+   */
+  word mFirst, mSecond, mDistance, mTarget;
+
+  /**
+   * The preferred brake time and the reaction time of the loco (ms).
+   */
+  word mBrakeTime, mLatency;
+
+  /**
+   * What we are doing right now, one of the STOPPER_* constants, and
+   * whether the brake ramp is with the controller yet.
+   */
+  volatile byte mState;
+  boolean mRamped;
+
+  /**
+   * The time the first contact was hit, later the time to brake (us).
+   */
+  unsigned long mTime;
+
+  /**
+   * The measured velocity (mm/s) and the brake time actually used.
+   */
+  word mVelocity, mBrake;
+
+  /**
+   * How late the first brake command was sent (us).
+   */
+  volatile unsigned long mLateness;
+
+  /**
+   * Works out when to brake, given the time of the second contact.
+   */
+  void plan(unsigned long time);
+
+  /**
+   * Sends the first brake command. Called by the timer interrupt.
+   */
+  void brake();
+
+  /**
+   * Hands the rest of the brake ramp to the controller.
+   */
+  void ramp();
+
+  public:
+
+  /**
+   * The next stopper watched by the timer interrupt. Internal field.
+   */
+  TrackStopper *mNextStopper;
+
+  /**
+   * Creates a new TrackStopper using the given controller and
+   * reporter.
+   */
+  TrackStopper(TrackController &controller, TrackReporter &reporter);
+
+  /**
+   * Destroys the TrackStopper.
+   */
+  ~TrackStopper();
+
+  /**
+   * Sets the two contacts used for measuring, the distance between
+   * them and the distance of the stop point behind the second one
+   * (all in mm).
+   */
+  void setContacts(word first, word second, word distance, word target);
+
+  /**
+   * Sets the time (ms) the train should take to brake. If the stop
+   * point is too close for that, it brakes harder. Zero stops at once,
+   * which is fine for locos with deceleration in the decoder.
+   */
+  void setBrakeTime(word time);
+
+  /**
+   * Sets the time (ms) a loco takes to react to a command, including
+   * the Gleisbox.
+   */
+  void setLatency(word latency);
+
+  /**
+   * Arms the stopper for the given loco, which is (or will soon be)
+   * running at the given speed.
+   */
+  void arm(word address, word speed);
+
+  /**
+   * Disarms the stopper, leaving the train alone.
+   */
+  void disarm();
+
+  /**
+   * Returns what the stopper is doing, one of the STOPPER_* constants.
+   */
+  byte getState();
+
+  /**
+   * Returns the velocity measured between the contacts (mm/s).
+   */
+  word getVelocity();
+
+  /**
+   * Returns how late the first brake command was sent (us), which is
+   * the error caused by a busy loop() or, on AVR boards, by other
+   * interrupts.
+   */
+  unsigned long getLateness();
+
+  /**
+   * Handles contact events and brakes when it is time, unless the
+   * timer interrupt already did. Call this from loop(), after the
+   * refresh() of the reporter.
+   */
+  void update();
+
+  /**
+   * Brakes if it is time to and returns the time (us) left until
+   * then, or -1 if there is nothing to wait for. Called by the timer
+   * interrupt. Internal method.
+   */
+  long tick(unsigned long now);
+
+};
+
+// ===================================================================
+// === TrackMonitor ==================================================
+// ===================================================================
+
+/**
+ * Times (ms) between two health checks, without an answer from the
+ * Gleisbox until it is considered lost, and between two attempts to
+ * recover. Can be overridden via compiler flags.
+ */
+#if !defined(MONITOR_INTERVAL)
+#define MONITOR_INTERVAL 1000
+#endif
+
+#if !defined(MONITOR_TIMEOUT)
+#define MONITOR_TIMEOUT 3000
+#endif
+
+#if !defined(MONITOR_RETRY)
+#define MONITOR_RETRY 250
+#endif
+
+/**
+ * States of the bus.
+ */
+#define HEALTH_OK         0 // All fine
+#define HEALTH_WARNING    1 // Many bus errors, but still working
+#define HEALTH_RECOVERING 2 // Bus-off or Gleisbox lost, trying to fix it
+
+/**
+ * Keeps an eye on the CAN bus and the Gleisbox and gets things going
+ * again when they fail. Every MONITOR_INTERVAL, the monitor reads the
+ * error counters of the CAN hardware and pings the Gleisbox. If the
+ * CAN hardware is bus-off or the Gleisbox hasn't answered for
+ * MONITOR_TIMEOUT, for instance because it was restarted, the
+ * controller is restarted and pinged every MONITOR_RETRY until the
+ * Gleisbox answers again. So a failure is noticed within
+ * MONITOR_TIMEOUT, and the bus is back within MONITOR_RETRY of the
+ * Gleisbox being ready. The time that took is reported, and printed
+ * if the controller is in debug mode. Nothing blocks. Note that the
+ * Gleisbox starts with track power off after a restart. Call update()
+ * from loop() as often as possible. It polls the controller for the
+ * answers (see TrackController::poll()). This doesn't work in
+ * loopback mode.
+ */
+class TrackMonitor : public TrackListener {
+
+  private:
+
+  /**
+   * The controller we are watching.
+   */
+  TrackController *mController;
+
+  /**
+   * The state of the bus, one of the HEALTH_* constants.
+   */
+  byte mState;
+
+  /**
+   * The error counters of the CAN hardware.
+   */
+  byte mTransmitErrors, mReceiveErrors;
+
+  /**
+   * Whether we have started checking.
+   */
+  boolean mRunning;
+
+  /**
+   * When we checked, heard from the Gleisbox and noticed a failure
+   * last (ms).
+   */
+  unsigned long mChecked, mAnswered, mFailed;
+
+  /**
+   * The number of recoveries and the time the last one took (ms).
+   */
+  word mRecoveries;
+  unsigned long mRecoveryTime;
+
+  /**
+   * Pings the Gleisbox.
+   */
+  void ping();
+
+  /**
+   * Notes a failure and starts recovering.
+   */
+  void fail();
+
+  public:
+
+  /**
+   * Creates a new monitor for the given controller.
+   */
+  TrackMonitor(TrackController &controller);
+
+  /**
+   * Is called when a TrackMonitor is being destroyed. Does the
+   * necessary cleanup. No need to call this manually.
+   */
+  ~TrackMonitor();
+
+  /**
+   * Returns the state of the bus, one of the HEALTH_* constants.
+   */
+  byte getState();
+
+  /**
+   * Return the error counters of the CAN hardware as of the last
+   * check.
+   */
+  byte getTransmitErrors();
+  byte getReceiveErrors();
+
+  /**
+   * Returns the number of recoveries so far.
+   */
+  word getRecoveries();
+
+  /**
+   * Returns the time (ms) from noticing the last failure to the
+   * Gleisbox answering again.
+   */
+  unsigned long getRecoveryTime();
+
+  /**
+   * Checks the bus and recovers, if necessary. Call this from loop().
+   */
+  void update();
 
   /**
-   * Returns the state of an individual contact. Note counting starts
-   * from 1 in order to stay compatible with the S88 reporter.
+   * Sees the answers of the Gleisbox. Internal method.
    */
-  boolean getValue(int index);
+  virtual void messageReceived(TrackMessage &message);
 
 };
 
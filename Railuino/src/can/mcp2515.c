@@ -292,34 +292,13 @@ uint8_t can_get_message(tCAN *message)
 }
 
 // ----------------------------------------------------------------------------
-uint8_t can_send_message(tCAN *message)
+// writes a message into the given transmit buffer (0x00, 0x02 or 0x04)
+// and requests it to be sent
+
+static void can_write_tx(uint8_t address, tCAN *message)
 {
-	uint8_t status = can_read_status(SPI_READ_STATUS);
-	
-	/* Statusbyte:
-	 *
-	 * Bit	Function
-	 *  2	TXB0CNTRL.TXREQ
-	 *  4	TXB1CNTRL.TXREQ
-	 *  6	TXB2CNTRL.TXREQ
-	 */
-	uint8_t address;
 	uint8_t t;
-//	SET(LED2_HIGH);
-	if (bit_is_clear(status, 2)) {
-		address = 0x00;
-	}
-	else if (bit_is_clear(status, 4)) {
-		address = 0x02;
-	} 
-	else if (bit_is_clear(status, 6)) {
-		address = 0x04;
-	}
-	else {
-		// all buffer used => could not send message
-		return 0;
-	}
-	
+
 	RESET(MCP2515_CS);
 	spi_putc(SPI_WRITE_TX | address);
 	
@@ -364,6 +343,107 @@ uint8_t can_send_message(tCAN *message)
 	address = (address == 0) ? 1 : address;
 	spi_putc(SPI_RTS | address);
 	SET(MCP2515_CS);
+}
+
+// ----------------------------------------------------------------------------
+// set while TXB0 has the raised priority of an urgent message
+
+static uint8_t can_urgent = 0;
+
+// ----------------------------------------------------------------------------
+uint8_t can_send_message(tCAN *message)
+{
+	// an emergency stop from an interrupt must not cut into this
+	uint8_t sreg = SREG;
+	cli();
+
+	uint8_t status = can_read_status(SPI_READ_STATUS);
 	
-	return address;
+	/* Statusbyte:
+	 *
+	 * Bit	Function
+	 *  2	TXB0CNTRL.TXREQ
+	 *  4	TXB1CNTRL.TXREQ
+	 *  6	TXB2CNTRL.TXREQ
+	 */
+	uint8_t address;
+//	SET(LED2_HIGH);
+	if (bit_is_clear(status, 2)) {
+		address = 0x00;
+		
+		// the urgent message is gone, so back to normal priority
+		if (can_urgent) {
+			can_write_register(TXB0CTRL, 0);
+			can_urgent = 0;
+		}
+	}
+	else if (bit_is_clear(status, 4)) {
+		address = 0x02;
+	} 
+	else if (bit_is_clear(status, 6)) {
+		address = 0x04;
+	}
+	else {
+		// all buffer used => could not send message
+		SREG = sreg;
+		return 0;
+	}
+	
+	can_write_tx(address, message);
+
+	SREG = sreg;
+
+	return (address == 0) ? 1 : address;
+}
+
+// ----------------------------------------------------------------------------
+// sends a message before anything else: aborts all pending transmissions
+// and puts the message into TXB0 with the highest priority. a frame that
+// is already on the wire can't be aborted, so this waits for it to end.
+
+uint8_t can_send_urgent(tCAN *message)
+{
+	uint8_t sreg = SREG;
+	cli();
+
+	can_bit_modify(CANCTRL, (1<<ABAT), (1<<ABAT));
+
+	// at 250 kbit/s, the longest frame takes about 0.6 ms, which is
+	// well below 1000 status reads
+	uint16_t n = 1000;
+	while ((can_read_status(SPI_READ_STATUS) & 0x54) != 0 && --n != 0)
+		;
+
+	can_bit_modify(CANCTRL, (1<<ABAT), 0);
+
+	if (n == 0) {
+		SREG = sreg;
+		return 0;
+	}
+
+	can_write_register(TXB0CTRL, (1<<TXP1)|(1<<TXP0));
+	can_urgent = 1;
+
+	can_write_tx(0x00, message);
+
+	SREG = sreg;
+
+	return 1;
+}
+
+// ----------------------------------------------------------------------------
+// reads the error counters and returns the error flags (EFLG)
+
+uint8_t can_read_errors(uint8_t *tec, uint8_t *rec)
+{
+	uint8_t sreg = SREG;
+	cli();
+
+	*tec = can_read_register(TEC);
+	*rec = can_read_register(REC);
+	uint8_t flags = can_read_register(EFLG);
+
+	SREG = sreg;
+
+	return flags;
 }
@@ -87,6 +87,14 @@ uint8_t can_get_message(tCAN *message);
 // ----------------------------------------------------------------------------
 uint8_t can_send_message(tCAN *message);
 
+// ----------------------------------------------------------------------------
+// send a message right away, aborting all pending ones
+uint8_t can_send_urgent(tCAN *message);
+
+// ----------------------------------------------------------------------------
+// read the error counters, return the error flags
+uint8_t can_read_errors(uint8_t *tec, uint8_t *rec);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,531 @@
+// ===================================================================
+// === TrackSimulator ================================================
+// ===================================================================
+
+/**
+ * A simulated Gleisbox (plus the odd MS2) on a simulated CAN bus. See
+ * the class comment in Railuino.h. The functions at the end of this
+ * file replace the MCP2515 driver, so the rest of the library does
+ * not notice the difference.
+ */
+
+#define SIM_HASH     0x3b32 // Gleisbox
+#define SIM_MS2_HASH 0x4f0b // Simulated throttles
+
+TrackSimulator simulator;
+
+TrackSimulator::TrackSimulator() {
+    mLatency = 0;
+    mLoss = 0;
+    mOffline = false;
+    mThrottleCount = 0;
+
+    reset(false);
+}
+
+void TrackSimulator::reset(boolean loopback) {
+    mLoopback = loopback;
+    mBusOff = false;
+    mDropped = 0;
+    mPower = false;
+    mLocoCount = 0;
+    mAccessoryCount = 0;
+    mConfigCount = 0;
+    mRead = 0;
+    mLength = 0;
+}
+
+void TrackSimulator::setLatency(word latency) {
+    mLatency = latency;
+}
+
+void TrackSimulator::setLoss(byte percent) {
+    mLoss = percent;
+}
+
+boolean TrackSimulator::addThrottle(word address, word interval) {
+    if (mThrottleCount == SIM_THROTTLES) {
+        return false;
+    }
+
+    mThrottles[mThrottleCount] = address;
+    mIntervals[mThrottleCount] = interval;
+    mLast[mThrottleCount] = millis();
+    mThrottleCount++;
+
+    return true;
+}
+
+void TrackSimulator::setBusOff(boolean off) {
+    mBusOff = off;
+}
+
+boolean TrackSimulator::isBusOff() {
+    return mBusOff;
+}
+
+void TrackSimulator::setOffline(boolean offline) {
+    mOffline = offline;
+}
+
+word TrackSimulator::getDropped() {
+    return mDropped;
+}
+
+boolean TrackSimulator::getPower() {
+    return mPower;
+}
+
+word TrackSimulator::getLocoSpeed(word address) {
+    return mSpeeds[findLoco(address)];
+}
+
+int TrackSimulator::findLoco(word address) {
+    for (int i = 0; i < mLocoCount; i++) {
+        if (mLocos[i] == address) {
+            return i;
+        }
+    }
+
+    if (mLocoCount == SIM_LOCOS) {
+        mLocoCount--;
+        memmove(mLocos, mLocos + 1, mLocoCount * sizeof(word));
+        memmove(mSpeeds, mSpeeds + 1, mLocoCount * sizeof(word));
+        memmove(mDirections, mDirections + 1, mLocoCount);
+        memmove(mFunctions, mFunctions + 1, mLocoCount * sizeof(unsigned long));
+    }
+
+    int i = mLocoCount++;
+
+    mLocos[i] = address;
+    mSpeeds[i] = 0;
+    mDirections[i] = DIR_FORWARD;
+    mFunctions[i] = 0;
+
+    return i;
+}
+
+int TrackSimulator::findAccessory(word address) {
+    for (int i = 0; i < mAccessoryCount; i++) {
+        if (mAccessories[i] == address) {
+            return i;
+        }
+    }
+
+    if (mAccessoryCount == SIM_ACCESSORIES) {
+        mAccessoryCount--;
+        memmove(mAccessories, mAccessories + 1, mAccessoryCount * sizeof(word));
+        memmove(mPositions, mPositions + 1, mAccessoryCount);
+        memmove(mPowers, mPowers + 1, mAccessoryCount);
+    }
+
+    int i = mAccessoryCount++;
+
+    mAccessories[i] = address;
+    mPositions[i] = ACC_ROUND;
+    mPowers[i] = 0;
+
+    return i;
+}
+
+int TrackSimulator::findConfig(word address, word number) {
+    for (int i = 0; i < mConfigCount; i++) {
+        if (mConfigLocos[i] == address && mConfigNumbers[i] == number) {
+            return i;
+        }
+    }
+
+    if (mConfigCount == SIM_CONFIGS) {
+        mConfigCount--;
+        memmove(mConfigLocos, mConfigLocos + 1, mConfigCount * sizeof(word));
+        memmove(mConfigNumbers, mConfigNumbers + 1, mConfigCount * sizeof(word));
+        memmove(mConfigValues, mConfigValues + 1, mConfigCount);
+    }
+
+    int i = mConfigCount++;
+
+    mConfigLocos[i] = address;
+    mConfigNumbers[i] = number;
+    mConfigValues[i] = 0;
+
+    return i;
+}
+
+void TrackSimulator::post(TrackMessage &message, word hash, boolean response, unsigned long time) {
+    if (mLength == SIM_FRAMES) {
+        mDropped++;
+        return;
+    }
+
+    byte i = (mRead + mLength) % SIM_FRAMES;
+
+    mFrames[i] = message;
+    mFrames[i].hash = hash;
+    mFrames[i].response = response;
+    mTimes[i] = time;
+    mLength++;
+}
+
+void TrackSimulator::inject(TrackMessage &message) {
+    post(message, message.hash, message.response, micros());
+}
+
+void TrackSimulator::receive(TrackMessage &message, unsigned long time) {
+    if ((mOffline && !mLoopback) || (mLoss != 0 && random(100) < mLoss)) {
+        mDropped++;
+        return;
+    }
+
+    if (mLoopback) {
+        post(message, message.hash, false, time);
+    } else {
+        process(message, time);
+    }
+}
+
+void TrackSimulator::process(TrackMessage &message, unsigned long time) {
+    TrackMessage response = message;
+
+    word address = word(message.data[2], message.data[3]);
+
+    switch (message.command) {
+        case 0x00: // System
+            if (message.length >= 5) {
+                if (message.data[4] == 0x00) {
+                    mPower = false;
+                } else if (message.data[4] == 0x01) {
+                    mPower = true;
+                } else if (message.data[4] == 0x03 && address != 0) {
+                    mSpeeds[findLoco(address)] = 0;
+                }
+            }
+            break;
+
+        case 0x04: { // Speed
+            int i = findLoco(address);
+            if (message.length >= 6) {
+                // The Gleisbox never goes beyond 1000
+                word speed = word(message.data[4], message.data[5]);
+                mSpeeds[i] = speed > 1000 ? 1000 : speed;
+            } else {
+                response.length = 6;
+                response.data[4] = highByte(mSpeeds[i]);
+                response.data[5] = lowByte(mSpeeds[i]);
+            }
+            break;
+        }
+
+        case 0x05: { // Direction
+            int i = findLoco(address);
+            if (message.length >= 5) {
+                byte direction = message.data[4];
+                if (direction == DIR_CHANGE) {
+                    direction = mDirections[i] == DIR_FORWARD ? DIR_REVERSE : DIR_FORWARD;
+                }
+                if (direction != DIR_CURRENT && direction != mDirections[i]) {
+                    mDirections[i] = direction;
+                    mSpeeds[i] = 0;
+                }
+            } else {
+                response.length = 5;
+                response.data[4] = mDirections[i];
+            }
+            break;
+        }
+
+        case 0x06: { // Function
+            int i = findLoco(address);
+            byte function = message.data[4] & 0x1f;
+            if (message.length >= 6) {
+                bitWrite(mFunctions[i], function, message.data[5] != 0);
+            } else {
+                response.length = 6;
+                response.data[5] = bitRead(mFunctions[i], function);
+            }
+            break;
+        }
+
+        case 0x07: { // Read config
+            int i = findConfig(address, word(message.data[4], message.data[5]));
+            response.length = 7;
+            response.data[6] = mConfigValues[i];
+            break;
+        }
+
+        case 0x08: { // Write config
+            int i = findConfig(address, word(message.data[4], message.data[5]));
+            mConfigValues[i] = message.data[6];
+            response.length = 8;
+            response.data[7] = 0xc0; // Written and verified
+            break;
+        }
+
+        case 0x0b: { // Accessory
+            int i = findAccessory(address);
+            if (message.length >= 6) {
+                mPositions[i] = message.data[4];
+                mPowers[i] = message.data[5];
+            } else {
+                response.length = 6;
+                response.data[4] = mPositions[i];
+                response.data[5] = mPowers[i];
+            }
+            break;
+        }
+
+        case 0x18: // Ping
+            response.length = 8;
+            response.data[0] = 0x47;
+            response.data[1] = 0x11;
+            response.data[2] = 0x00;
+            response.data[3] = 0x01;
+            response.data[4] = highByte(TRACKBOX_VERSION);
+            response.data[5] = lowByte(TRACKBOX_VERSION);
+            response.data[6] = 0x00;
+            response.data[7] = 0x10;
+            break;
+
+        default: // Nothing else gets answered
+            return;
+    }
+
+    post(response, SIM_HASH, true, time + mLatency * 1000UL);
+}
+
+boolean TrackSimulator::transmit(TrackMessage &message, unsigned long &time) {
+    unsigned long now = millis();
+
+    // Let the throttles speed up their locos a bit
+    for (int i = 0; i < mThrottleCount; i++) {
+        if (now - mLast[i] >= mIntervals[i]) {
+            mLast[i] = now;
+
+            word speed = (mSpeeds[findLoco(mThrottles[i])] + 77) % 1001;
+
+            TrackMessage command;
+
+            command.clear();
+            command.command = 0x04;
+            command.length = 0x06;
+            command.data[2] = highByte(mThrottles[i]);
+            command.data[3] = lowByte(mThrottles[i]);
+            command.data[4] = highByte(speed);
+            command.data[5] = lowByte(speed);
+
+            post(command, SIM_MS2_HASH, false, micros());
+            process(command, micros());
+        }
+    }
+
+    if (mLength == 0 || (long) (micros() - mTimes[mRead]) < 0) {
+        return false;
+    }
+
+    message = mFrames[mRead];
+    time = mTimes[mRead];
+    mRead = (mRead + 1) % SIM_FRAMES;
+    mLength--;
+
+    return true;
+}
+
+// ===================================================================
+// === Simulated CAN driver ==========================================
+// ===================================================================
+
+// The next message for the controller, fetched but not yet received,
+// and when it arrived (us), which is when the interrupt would fire
+TrackMessage simulatorMessage;
+unsigned long simulatorArrival;
+boolean simulatorPending = false;
+
+// The three transmit buffers of the MCP2515: the frame, its priority
+// (TXP), when it was loaded and whether it still waits for the bus
+// (TXREQ). Only one frame at a time is on the wire, so a frame may
+// have to wait for up to three others.
+#define SIM_BUFFERS  3
+#define SIM_BIT_TIME 4 // us per bit at 250 kbit/s
+
+tCAN simulatorBuffers[SIM_BUFFERS];
+byte simulatorPriorities[SIM_BUFFERS];
+unsigned long simulatorLoaded[SIM_BUFFERS];
+boolean simulatorRequests[SIM_BUFFERS];
+
+// The buffer on the wire (-1 if none) and when the wire is free
+int simulatorWire = -1;
+unsigned long simulatorFree = 0;
+
+void simulateDelivery(tCAN *message, unsigned long time) {
+    TrackMessage received;
+
+    received.clear();
+    received.command = (message->id >> 17) & 0xff;
+    received.hash = message->id & 0xffff;
+    received.response = bitRead(message->id, 16);
+    received.length = message->length;
+
+    for (int i = 0; i < message->length; i++) {
+        received.data[i] = message->data[i];
+    }
+
+    simulator.receive(received, time);
+}
+
+// Moves frames over the wire until now. Whenever the wire becomes
+// free, the buffer with the highest priority that is waiting goes
+// next (the higher buffer number on a tie, as in the MCP2515).
+
+void simulateBus() {
+    unsigned long now = micros();
+
+    for (;;) {
+        if (simulatorWire != -1) {
+            if ((long) (now - simulatorFree) < 0) {
+                return;
+            }
+
+            simulatorRequests[simulatorWire] = false;
+            simulateDelivery(&simulatorBuffers[simulatorWire], simulatorFree);
+            simulatorWire = -1;
+        }
+
+        // The next frame starts when the wire got free or, if it was
+        // idle by then, when the first waiting frame was loaded
+        int next = -1;
+        unsigned long start = 0;
+
+        for (int i = 0; i < SIM_BUFFERS; i++) {
+            if (simulatorRequests[i] && (next == -1 || (long) (simulatorLoaded[i] - start) < 0)) {
+                start = simulatorLoaded[i];
+                next = i;
+            }
+        }
+
+        if (next == -1) {
+            return;
+        }
+
+        if ((long) (start - simulatorFree) < 0) {
+            start = simulatorFree;
+        }
+
+        for (int i = 0; i < SIM_BUFFERS; i++) {
+            if (simulatorRequests[i] && (long) (simulatorLoaded[i] - start) <= 0
+                    && (simulatorPriorities[i] > simulatorPriorities[next]
+                        || (simulatorPriorities[i] == simulatorPriorities[next] && i > next))) {
+                next = i;
+            }
+        }
+
+        simulatorWire = next;
+        simulatorFree = start + (67 + 8 * simulatorBuffers[next].length) * SIM_BIT_TIME;
+    }
+}
+
+uint8_t can_init(uint8_t speed, bool loopback) {
+    simulator.reset(loopback);
+    simulatorPending = false;
+
+    for (int i = 0; i < SIM_BUFFERS; i++) {
+        simulatorRequests[i] = false;
+    }
+
+    simulatorWire = -1;
+
+    return 1;
+}
+
+uint8_t can_check_message(void) {
+    simulateBus();
+
+    if (!simulatorPending) {
+        simulatorPending = simulator.transmit(simulatorMessage, simulatorArrival);
+    }
+
+    return simulatorPending ? 1 : 0;
+}
+
+uint8_t can_check_free_buffer(void) {
+    simulateBus();
+
+    return !simulatorRequests[0] || !simulatorRequests[1] || !simulatorRequests[2];
+}
+
+uint8_t can_get_message(tCAN *message) {
+    if (!can_check_message()) {
+        return 0;
+    }
+
+    simulatorPending = false;
+
+    message->id = ((uint32_t) simulatorMessage.command) << 17 | (uint32_t) simulatorMessage.hash;
+    if (simulatorMessage.response) {
+        message->id |= 1UL << 16;
+    }
+    message->flags.extended = 1;
+    message->flags.rtr = 0;
+    message->length = simulatorMessage.length;
+
+    for (int i = 0; i < simulatorMessage.length; i++) {
+        message->data[i] = simulatorMessage.data[i];
+    }
+
+    return 1;
+}
+
+void simulateLoad(int buffer, tCAN *message, byte priority) {
+    simulatorBuffers[buffer] = *message;
+    simulatorPriorities[buffer] = priority;
+    simulatorLoaded[buffer] = micros();
+    simulatorRequests[buffer] = true;
+}
+
+uint8_t can_send_message(tCAN *message) {
+    if (simulator.isBusOff()) {
+        return 0;
+    }
+
+    simulateBus();
+
+    for (int i = 0; i < SIM_BUFFERS; i++) {
+        if (!simulatorRequests[i]) {
+            simulateLoad(i, message, 0);
+            return i + 1;
+        }
+    }
+
+    // All buffers used
+    return 0;
+}
+
+uint8_t can_send_urgent(tCAN *message) {
+    if (simulator.isBusOff()) {
+        return 0;
+    }
+
+    simulateBus();
+
+    // ABAT: whatever waits is dropped, the frame on the wire completes
+    for (int i = 0; i < SIM_BUFFERS; i++) {
+        if (i != simulatorWire) {
+            simulatorRequests[i] = false;
+        }
+    }
+
+    while (simulatorWire != -1) {
+        simulateBus();
+    }
+
+    simulateLoad(0, message, 3);
+
+    return 1;
+}
+
+uint8_t can_read_errors(uint8_t *tec, uint8_t *rec) {
+    boolean off = simulator.isBusOff();
+
+    *tec = off ? 255 : 0;
+    *rec = 0;
+
+    return off ? 0x20 : 0x00; // TXBO
+}
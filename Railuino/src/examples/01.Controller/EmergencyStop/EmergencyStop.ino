@@ -0,0 +1,48 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ * 
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+ 
+#include <Railuino.h>
+
+/**
+ * Drives a loco back and forth until the button on pin 3 is pressed,
+ * which stops everything right away, even while the sketch is busy
+ * waiting. The button connects the pin to ground. Pin 2 is taken by
+ * the CAN shield.
+ */
+
+const word    LOCO   = ADDR_MM2 + 78;
+const int     BUTTON = 3;
+const boolean DEBUG  = false;
+
+TrackController ctrl(0xdf24, DEBUG);
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+  ctrl.setEmergencyPin(BUTTON);
+
+  Serial.println("Power on");
+  ctrl.setPower(true);
+}
+
+void loop() {
+  ctrl.toggleLocoDirection(LOCO);
+  ctrl.setLocoSpeed(LOCO, 300);
+
+  delay(5000);
+}
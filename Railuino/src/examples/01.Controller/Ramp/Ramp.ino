@@ -0,0 +1,62 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+const word    LOCO1 = ADDR_MM2 + 78;
+const word    LOCO2 = ADDR_MM2 + 12;
+const word    SPEED = 400;
+const word    TIME  = 10000;
+const boolean DEBUG = true;
+
+TrackController ctrl(0xdf24, DEBUG);
+
+boolean running = false;
+
+unsigned long last = 0;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+  
+  ctrl.begin();
+  
+  Serial.println("Power on");
+  ctrl.setPower(true);
+}
+
+void loop() {
+  // Both locos start and stop smoothly at the same time
+  if (millis() - last >= TIME) {
+    last = millis();
+    running = !running;
+
+    // We know where they start, so nothing needs to be queried
+    if (running) {
+      Serial.println("Go");
+      ctrl.rampLocoSpeed(LOCO1, 0, SPEED, 3000, RAMP_S_CURVE);
+      ctrl.rampLocoSpeed(LOCO2, 0, SPEED, 5000, RAMP_LINEAR);
+    } else {
+      Serial.println("Stop");
+      ctrl.rampLocoSpeed(LOCO1, SPEED, 0, 3000, RAMP_S_CURVE);
+      ctrl.rampLocoSpeed(LOCO2, SPEED, 0, 2000, RAMP_LINEAR);
+    }
+  }
+
+  // Does the ramps in the background and ends them when the MS2
+  // stops everything
+  ctrl.update();
+}
@@ -0,0 +1,67 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Protects two trains running on a loop of four blocks. Each block
+ * starts at an S88 contact and ends at a signal. The layout is
+ * described at compile time and lives in flash. Whenever the block
+ * ahead of a train is occupied, the train stops and its signal goes
+ * to red. When the block gets free, the train is sent on.
+ */
+
+const boolean DEBUG = false;
+
+// Blocks
+enum { WEST = 1, NORTH, EAST, SOUTH };
+
+// Trains
+const word V200 = locoMM2(78);
+const word BR89 = locoMM2(12);
+
+// Enter contact, exit contact, next block, signal
+constexpr TrackBlock BLOCKS[] PROGMEM = {
+  { 1, 0, NORTH, accMM2(1) },
+  { 2, 0, EAST,  accMM2(2) },
+  { 3, 0, SOUTH, accMM2(3) },
+  { 4, 0, WEST,  accMM2(4) }
+};
+
+TRACK_LAYOUT(layout, BLOCKS, 16);
+
+TrackController ctrl(0xdf24, DEBUG);
+
+TrackReporterS88 rprt(1);
+
+TrackBlocks blocks(ctrl, rprt, layout);
+
+void setup() {
+  ctrl.begin();
+  ctrl.setPower(true);
+
+  // Where the trains are at the beginning
+  blocks.setTrain(WEST, V200, 100);
+  blocks.setTrain(EAST, BR89, 100);
+
+  ctrl.setLocoSpeed(V200, 100);
+  ctrl.setLocoSpeed(BR89, 100);
+}
+
+void loop() {
+  rprt.refresh();
+  blocks.update();
+}
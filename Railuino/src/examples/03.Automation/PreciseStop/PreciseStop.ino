@@ -0,0 +1,97 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Shuttles a train between two stations and stops it right at the
+ * platform, no matter how fast it goes. Before each station, the
+ * train passes two contacts of an L88 that are 200 mm apart, which
+ * tells us its velocity. The platform starts 500 mm behind the second
+ * contact. Try different speeds: the train should always stop at the
+ * same point. The measured velocity and the lateness of the brake
+ * command are printed.
+ */
+
+const boolean DEBUG = false;
+
+const word LOCO = locoMM2(78);
+
+const word SPEED = 400;
+
+// Contacts before the stations, as seen from the train
+const word EAST_FIRST  = 1;
+const word EAST_SECOND = 2;
+const word WEST_FIRST  = 4;
+const word WEST_SECOND = 3;
+
+TrackController ctrl(0xdf24, DEBUG);
+
+TrackReporterCAN rprt(ctrl, 0, 16);
+
+TrackStopper stopper(ctrl, rprt);
+
+byte direction = DIR_FORWARD;
+
+unsigned long stopped;
+
+void depart() {
+  if (direction == DIR_FORWARD) {
+    stopper.setContacts(EAST_FIRST, EAST_SECOND, 200, 500);
+  } else {
+    stopper.setContacts(WEST_FIRST, WEST_SECOND, 200, 500);
+  }
+
+  ctrl.setLocoDirection(LOCO, direction);
+  ctrl.setLocoSpeed(LOCO, SPEED);
+  stopper.arm(LOCO, SPEED);
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+  ctrl.setPower(true);
+
+  stopper.setBrakeTime(1500);
+  stopper.setLatency(20);
+
+  depart();
+}
+
+void loop() {
+  rprt.refresh();
+  stopper.update();
+  ctrl.update();
+
+  if (stopper.getState() == STOPPER_BRAKING && !ctrl.isRamping(LOCO)) {
+    Serial.print("Velocity ");
+    Serial.print(stopper.getVelocity());
+    Serial.print(" mm/s, late by ");
+    Serial.print(stopper.getLateness());
+    Serial.println(" us");
+
+    stopper.disarm();
+    stopped = millis();
+  }
+
+  // Ten seconds at the station, then back
+  if (stopper.getState() == STOPPER_IDLE && millis() - stopped > 10000) {
+    direction = direction == DIR_FORWARD ? DIR_REVERSE : DIR_FORWARD;
+    depart();
+  }
+}
@@ -0,0 +1,87 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * A tiny signal box for a station with two tracks on the serial
+ * console. Type the number of a route to set it, or a minus and the
+ * number to release it. Conflicting routes are refused, and routes
+ * are released automatically once the train has arrived.
+ */
+
+const boolean DEBUG = false;
+
+// Blocks
+enum { WEST = 1, TRACK1, TRACK2, EAST };
+
+// Turnouts
+enum { W1, W2 };
+
+// Enter contact, exit contact, next block, signal
+constexpr TrackBlock BLOCKS[] PROGMEM = {
+  { 1, 0, 0, 0 },
+  { 2, 0, 0, accMM2(11) },
+  { 3, 0, 0, accMM2(12) },
+  { 4, 0, 0, 0 }
+};
+
+const word TURNOUTS[] PROGMEM = { accMM2(1), accMM2(2) };
+
+// From, to, turnouts used, turnouts straight
+constexpr TrackRoute ROUTES[] PROGMEM = {
+  { WEST,   TRACK1, trackBits(W1), trackBits(W1) },
+  { WEST,   TRACK2, trackBits(W1), 0 },
+  { TRACK1, EAST,   trackBits(W2), trackBits(W2) },
+  { TRACK2, EAST,   trackBits(W2), 0 }
+};
+
+TRACK_LAYOUT_WITH_ROUTES(layout, BLOCKS, 16, TURNOUTS, ROUTES);
+
+TrackController ctrl(0xdf24, DEBUG);
+
+TrackReporterS88 rprt(1);
+
+TrackBlocks blocks(ctrl, rprt, layout);
+
+TrackInterlocking lock(ctrl, layout, &blocks);
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+  ctrl.setPower(true);
+
+  Serial.println(F("Route?"));
+}
+
+void loop() {
+  if (Serial.available() > 0) {
+    int route = Serial.parseInt();
+
+    if (route < 0) {
+      lock.releaseRoute(-route);
+      Serial.println(F("Released"));
+    } else if (route > 0 && route <= layout.getRouteCount()) {
+      Serial.println(lock.setRoute(route) ? F("Set") : F("Refused"));
+    }
+  }
+
+  rprt.refresh();
+  blocks.update();
+  lock.update();
+}
@@ -0,0 +1,57 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Runs a shuttle train back and forth with fixed running and dwell
+ * times, over and over, like on a demonstration layout. The timetable
+ * lives in flash, so it could easily be much longer. Nothing blocks,
+ * so the loop is free for other things.
+ */
+
+const boolean DEBUG = false;
+
+const word V200 = locoMM2(78);
+
+// Time (ms), action, address, value, power
+const TrackAction TIMETABLE[] PROGMEM = {
+  {     0, ACTION_FUNCTION,  V200, 0,           1 },
+  {     0, ACTION_DIRECTION, V200, DIR_FORWARD, 0 },
+  {  1000, ACTION_SPEED,     V200, 300,         0 },
+  {  9000, ACTION_SPEED,     V200, 100,         0 },
+  { 11000, ACTION_SPEED,     V200, 0,           0 },
+  { 20000, ACTION_DIRECTION, V200, DIR_REVERSE, 0 },
+  { 21000, ACTION_SPEED,     V200, 300,         0 },
+  { 29000, ACTION_SPEED,     V200, 100,         0 },
+  { 31000, ACTION_SPEED,     V200, 0,           0 }
+};
+
+TrackController ctrl(0xdf24, DEBUG);
+
+TrackTimetable timetable(ctrl);
+
+void setup() {
+  ctrl.begin();
+  ctrl.setPower(true);
+
+  // Start over every 40 seconds
+  timetable.begin(TIMETABLE, sizeof(TIMETABLE) / sizeof(TrackAction), 40000);
+}
+
+void loop() {
+  timetable.update();
+}
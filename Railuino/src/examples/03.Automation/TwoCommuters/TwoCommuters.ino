@@ -0,0 +1,104 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Runs two commuter trains at the same time on a single Arduino. Each
+ * train shuttles between two contacts on its own track and waits a
+ * while at both ends. Nothing blocks, so more trains (or a signal box,
+ * or a user interface) can be added by starting more tasks.
+ */
+
+const word    SPEED = 100;
+const word    TIME  = 2000;
+const boolean DEBUG = false;
+
+TrackController ctrl(0xdf24, DEBUG);
+
+TrackReporterS88 rprt(1);
+
+TrackScheduler sched(ctrl, &rprt);
+
+class Commuter : public TrackTask {
+
+  private:
+
+  word mLoco;
+
+  int mStart, mEnd;
+
+  public:
+
+  Commuter(word loco, int start, int end) {
+    mLoco = loco;
+    mStart = start;
+    mEnd = end;
+  }
+
+  void run() {
+    TASK_BEGIN();
+
+    setLocoFunction(mLoco, 0, 1);
+    TASK_YIELD();
+
+    for (;;) {
+      setLocoDirection(mLoco, DIR_FORWARD);
+      TASK_YIELD();
+      setLocoSpeed(mLoco, SPEED);
+      TASK_YIELD();
+      waitForContact(mEnd, true, 0);
+      TASK_YIELD();
+      setLocoSpeed(mLoco, 0);
+      TASK_YIELD();
+      sleep(TIME);
+      TASK_YIELD();
+
+      setLocoDirection(mLoco, DIR_REVERSE);
+      TASK_YIELD();
+      setLocoSpeed(mLoco, SPEED);
+      TASK_YIELD();
+      waitForContact(mStart, true, 0);
+      TASK_YIELD();
+      setLocoSpeed(mLoco, 0);
+      TASK_YIELD();
+      sleep(TIME);
+      TASK_YIELD();
+    }
+
+    TASK_END();
+  }
+
+};
+
+Commuter v200(ADDR_MM2 + 78, 1, 2);
+
+Commuter br89(ADDR_MM2 + 12, 3, 4);
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+  ctrl.setPower(true);
+
+  sched.start(v200);
+  sched.start(br89);
+}
+
+void loop() {
+  sched.update();
+}
@@ -0,0 +1,48 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Captures the traffic on the CAN bus in the binary format described
+ * in Railuino.h and writes it to the serial port, for instance to be
+ * stored on a PC with something like
+ *
+ *   stty -F /dev/ttyACM0 115200 raw && cat /dev/ttyACM0 > layout.rlc
+ *
+ * The Replay example can play such a capture back later. Don't open
+ * the serial monitor, the output is binary.
+ */
+
+TrackController ctrl(0xdf24, false);
+
+TrackCapture capture;
+
+TrackMessage message;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+
+  capture.begin(ctrl, Serial);
+}
+
+void loop() {
+  // Passes everything on to the capture
+  ctrl.receiveMessage(message);
+}
@@ -0,0 +1,159 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Measures the hot paths of the library and prints the results as
+ * CSV (benchmark, runs, nanoseconds per operation, heap bytes per
+ * operation), so they can be collected and compared over time. The
+ * cost of the measuring loop itself is subtracted. The CAN
+ * benchmarks run in loopback mode, so they need the CAN shield, but
+ * no track. With the library built against the CAN simulator they
+ * run without any hardware. On the ESP boards they need the
+ * simulator. On a PC, "make bench" in "extras/host" runs everything
+ * against the simulator.
+ *
+ * On the PC, the heap column counts every byte allocated. On the
+ * boards, it is the growth of the heap, which shows leaks, but not
+ * memory that is allocated and freed again.
+ */
+
+// Number of runs per benchmark
+const long RUNS = 1000;
+
+// Internal helper of the library, not in the header
+size_t printHex(Print &p, unsigned long hex, int digits);
+
+// Swallows everything, so printing is measured without the UART
+class NullPrint : public Print {
+  public:
+  size_t write(uint8_t c) {
+    return 1;
+  }
+};
+
+NullPrint null;
+
+// Keeps the compiler from optimizing things away
+volatile long sink;
+
+// Time (us) of an empty run, subtracted from all results
+unsigned long overhead;
+
+#if defined(__AVR__)
+extern char *__brkval;
+extern char __heap_start;
+#endif
+
+// Returns the bytes allocated so far, or the top of the heap, so
+// growth (and leaks) can be seen
+long heapTop() {
+#if defined(HOST_ARDUINO_H)
+  return hostAllocated;
+#elif defined(__AVR__)
+  return (long) (__brkval == 0 ? &__heap_start : __brkval);
+#elif defined(__ESP__)
+  return -(long) ESP.getFreeHeap();
+#else
+  return 0;
+#endif
+}
+
+void report(const __FlashStringHelper *name, unsigned long time, long heap) {
+  double ns = (time > overhead ? time - overhead : 0) * 1000.0 / RUNS;
+
+  Serial.print(name);
+  Serial.print(',');
+  Serial.print(RUNS);
+  Serial.print(',');
+  Serial.print(ns, 1);
+  Serial.print(',');
+  Serial.println((double) heap / RUNS, 2);
+}
+
+// Runs the given statement RUNS times and reports time and heap growth
+#define BENCH(name, statement) {                    \
+  long heap = heapTop();                            \
+  unsigned long start = micros();                   \
+  for (long i = 0; i < RUNS; i++) {                 \
+    statement;                                      \
+  }                                                 \
+  unsigned long time = micros() - start;            \
+  report(F(name), time, heapTop() - heap);          \
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  TrackMessage message;
+  TrackMessage other;
+
+  message.clear();
+  message.command = 0x04;
+  message.length = 0x06;
+  message.data[3] = 0x4e;
+  message.data[4] = 0x01;
+  message.data[5] = 0xf4;
+
+  String text = "df24 R 04 6 00 00 00 4e 01 f4";
+
+  byte contacts[16];
+  memset(contacts, 0x5a, sizeof(contacts));
+  byte state[16];
+  memset(state, 0, sizeof(state));
+
+  TrackFilter filter;
+  filter.setDebounce(0, 3);
+  filter.setHold(0, 4);
+
+  byte runs[IR_RUNS];
+
+  // Measure the measuring loop first
+  unsigned long start = micros();
+  for (long i = 0; i < RUNS; i++) {
+    sink = i;
+  }
+  overhead = micros() - start;
+
+  Serial.println();
+  Serial.println(F("benchmark,runs,ns_per_op,heap_per_op"));
+
+  BENCH("message_clear", other.clear());
+  BENCH("message_print_to", sink = message.printTo(null));
+  BENCH("message_parse_from", sink = other.parseFrom(text));
+  BENCH("print_hex", sink = printHex(null, i, 4));
+  BENCH("filter_apply_128", filter.apply(contacts, state, 16));
+  BENCH("infrared_encode", sink = TrackControllerInfrared::encode(i, 12, false, runs));
+
+  // The ESP boards only have a TrackController with the simulator
+#if !defined(__ESP__) || defined(CAN_SIMULATOR)
+  TrackController ctrl;
+  ctrl.init(0xdf24, false, true);
+  ctrl.begin();
+
+  BENCH("can_send_receive", ctrl.sendMessage(message); while (!ctrl.receiveMessage(other)));
+  BENCH("can_exchange", sink = ctrl.exchangeMessage(message, other, 1000));
+
+  ctrl.end();
+#endif
+
+  Serial.println(F("done"));
+}
+
+void loop() {
+}
@@ -0,0 +1,67 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ * 
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+ 
+#include <Railuino.h>
+
+/**
+ * Shows the health of the CAN bus once a second: state, error
+ * counters and recoveries so far. Unplug the Gleisbox or switch it
+ * off and on again to see the monitor recover. Track power is
+ * switched on again after each recovery.
+ */
+
+const boolean DEBUG = true;
+
+TrackController ctrl(0xdf24, DEBUG);
+
+TrackMonitor monitor(ctrl);
+
+word recoveries = 0;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+  ctrl.setPower(true);
+}
+
+void loop() {
+  static unsigned long time = 0;
+
+  monitor.update();
+
+  if (monitor.getRecoveries() != recoveries) {
+    recoveries = monitor.getRecoveries();
+    ctrl.setPower(true);
+  }
+
+  if (millis() - time >= 1000) {
+    time = millis();
+
+    Serial.print("State ");
+    Serial.print(monitor.getState());
+    Serial.print(", TEC ");
+    Serial.print(monitor.getTransmitErrors());
+    Serial.print(", REC ");
+    Serial.print(monitor.getReceiveErrors());
+    Serial.print(", recoveries ");
+    Serial.print(recoveries);
+    Serial.print(", last took ");
+    Serial.print(monitor.getRecoveryTime());
+    Serial.println(" ms");
+  }
+}
@@ -0,0 +1,126 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Checks the IR transmitter against a real receiver. Connect a 36 kHz
+ * IR receiver module (TSOP or similar) to pin 2 and point the IR LED
+ * at it. The sketch sends a few commands, decodes what the receiver
+ * sees and shows the largest timing error per frame. Expect an error
+ * of up to 100-200 us, which is the receiver, not the transmitter.
+ * Frames from a Delta remote are shown, too.
+ */
+
+const int RECEIVER = 2;
+
+// Edges seen by the receiver, filled by the interrupt handler
+const int EDGES = 64;
+
+volatile word durations[EDGES];
+volatile boolean marks[EDGES];
+volatile byte head = 0;
+volatile byte tail = 0;
+volatile unsigned long last = 0;
+
+TrackControllerInfrared ctrl;
+TrackDecoderInfrared decoder;
+
+void edge() {
+  unsigned long now = micros();
+  byte next = (head + 1) % EDGES;
+
+  if (next != tail) {
+    // The receiver is active low, so a mark has just ended if it is high now
+    marks[head] = digitalRead(RECEIVER) == HIGH;
+    durations[head] = min(now - last, 0xffffUL);
+    head = next;
+  }
+
+  last = now;
+}
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  // Stop all locos first, but don't monitor that
+  ctrl.start();
+  while (ctrl.isBusy()) {
+    ctrl.update();
+  }
+
+  pinMode(RECEIVER, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(RECEIVER), edge, CHANGE);
+
+  Serial.println();
+  Serial.println("ADR\tCMD\tT\tERR");
+}
+
+// Sends one of a few commands every other second
+void send() {
+  static unsigned long time = 0;
+  static int step = 0;
+
+  if (millis() - time < 2000) {
+    return;
+  }
+
+  time = millis();
+
+  switch (step++ % 4) {
+    case 0: ctrl.setPower(true); break;
+    case 1: ctrl.toggleLocoFunction(2, 3); break;
+    case 2: ctrl.setTurnout(3, false); break;
+    case 3: ctrl.setPower(false); break;
+  }
+}
+
+void loop() {
+  send();
+  ctrl.update();
+
+  boolean mark = false;
+  word duration = 0;
+  boolean idle = false;
+
+  noInterrupts();
+  if (tail != head) {
+    mark = marks[tail];
+    duration = durations[tail];
+    tail = (tail + 1) % EDGES;
+  } else if (micros() - last > 10000) {
+    idle = true;
+  }
+  interrupts();
+
+  if (idle) {
+    mark = false;
+    duration = 0xffff;
+  } else if (duration == 0) {
+    return;
+  }
+
+  if (decoder.feed(mark, duration)) {
+    Serial.print(decoder.getAddress(), HEX);
+    Serial.print("\t");
+    Serial.print(decoder.getCommand(), HEX);
+    Serial.print("\t");
+    Serial.print(decoder.getToggle() ? 1 : 0);
+    Serial.print("\t");
+    Serial.println(decoder.getTimingError());
+  }
+}
@@ -0,0 +1,96 @@
+/*********************************************************************
+ * Railuino - Hacking your Märklin
+ *
+ * Copyright (C) 2012 Joerg Pleumann
+ *
+ * This example is free software; you can redistribute it and/or
+ * modify it under the terms of the Creative Commons Zero License,
+ * version 1.0, as published by the Creative Commons Organisation.
+ * This effectively puts the file into the public domain.
+ *
+ * This example is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * LICENSE file for more details.
+ */
+
+#include <Railuino.h>
+
+/**
+ * Plays a capture made with the Capture example back into the CAN
+ * simulator, so a sketch can be tested against real traffic without
+ * a layout. Build the library with CAN_SIMULATOR defined (see the
+ * README) and send the capture to the serial port, for instance with
+ *
+ *   stty -F /dev/ttyACM0 115200 raw && cat layout.rlc > /dev/ttyACM0
+ *
+ * Messages are played at their original pace divided by SPEED. Once a
+ * second the sketch prints how many messages were played, how many
+ * the controller received and how many the simulator had to drop.
+ */
+
+// 1 = original pace, 10 = ten times faster, 0 = as fast as possible
+const int SPEED = 1;
+
+TrackController ctrl(0xdf24, false);
+
+TrackMessage message;
+
+TrackMessage received;
+
+boolean pending = false;
+
+unsigned long due;
+
+unsigned long start;
+
+unsigned long played = 0;
+
+unsigned long count = 0;
+
+void setup() {
+  Serial.begin(115200);
+  while (!Serial);
+
+  ctrl.begin();
+
+  // Wait for the capture to arrive
+  Serial.setTimeout(60000);
+  while (!TrackCapture::readHeader(Serial));
+  Serial.setTimeout(1000);
+
+  start = millis();
+}
+
+void report() {
+  static unsigned long last = 0;
+
+  if (millis() - last >= 1000) {
+    last = millis();
+
+    Serial.print(F("played="));
+    Serial.print(played);
+    Serial.print(F(" received="));
+    Serial.print(count);
+    Serial.print(F(" dropped="));
+    Serial.println(simulator.getDropped());
+  }
+}
+
+void loop() {
+  if (!pending && Serial.available() > 0) {
+    pending = TrackCapture::readRecord(Serial, message, &due);
+  }
+
+  if (pending && (SPEED == 0 || millis() - start >= due / SPEED)) {
+    simulator.inject(message);
+    pending = false;
+    played++;
+  }
+
+  while (ctrl.receiveMessage(received)) {
+    count++;
+  }
+
+  report();
+}
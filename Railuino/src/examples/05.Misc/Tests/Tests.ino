@@ -22,6 +22,11 @@
 // Controls whether stress tests are included
 #define STRESS true
 
+// Controls whether the suite waits for <Return> before starting. Set
+// to false for unattended runs, for instance with the library built
+// against the CAN simulator (see README).
+#define INTERACTIVE true
+
 // Locomotive that is being used during the tests (DCC required for reading CVs)
 #define LOCO ADDR_MM2 + 78
 
@@ -35,6 +40,17 @@
 int pass = 0;
 int fail = 0;
 
+// Timing facility for the stress tests. Counts the latencies (us) of
+// all operations in a histogram with four buckets per power of two, so
+// percentiles are exact below 8 us and within 25 % above, no matter
+// how many operations there are. Reports rate, percentiles and maximum
+// in a format that is easy to pick up from the serial log.
+#define BUCKETS 60
+
+word buckets[BUCKETS];
+unsigned long sampleCount = 0;
+word sampleMax = 0;
+
 // Assertion facility, macros and helper functions
 #define TEST __TEST__(__FUNCTION__);
 #define PASS pass++; return;
@@ -42,6 +58,8 @@ int fail = 0;
 #define ASSERT(x, y) if(!__ASSERT__(x, y, __FUNCTION__)) { FAIL; }
 
 void __TEST__(const char funcName[]) {
+  __CLEAR__();
+
   Serial.println();
   Serial.print("***** ");
   Serial.print(funcName);
@@ -63,6 +81,79 @@ boolean __ASSERT__(int assertNo, boolean exprValue, const char funcName[]) {
   return true;
 }
 
+void __CLEAR__() {
+  memset(buckets, 0, sizeof(buckets));
+  sampleCount = 0;
+  sampleMax = 0;
+}
+
+// Returns the bucket of the given latency
+byte __BUCKET__(word latency) {
+  if (latency < 8) {
+    return latency;
+  }
+
+  byte e = 15;
+  while (!bitRead(latency, e)) {
+    e--;
+  }
+
+  return 8 + 4 * (e - 3) + ((latency >> (e - 2)) & 3);
+}
+
+// Returns the largest latency of the given bucket
+word __UPPER__(byte bucket) {
+  if (bucket < 8) {
+    return bucket;
+  }
+
+  byte shift = (bucket - 8) / 4 + 1;
+  return ((4 + (bucket - 8) % 4 + 1) << shift) - 1;
+}
+
+// Returns the latency the given percentage of all samples stays within
+word __PERCENTILE__(int percent) {
+  unsigned long rank = (sampleCount * percent + 99) / 100;
+  unsigned long seen = 0;
+
+  for (int i = 0; i < BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return min(__UPPER__(i), sampleMax);
+    }
+  }
+
+  return sampleMax;
+}
+
+void __SAMPLE__(unsigned long latency) {
+  word value = min(latency, 0xffffUL);
+
+  buckets[__BUCKET__(value)]++;
+  sampleCount++;
+  sampleMax = max(sampleMax, value);
+}
+
+void __TIMING__(const char funcName[], long count, unsigned long time) {
+  Serial.print(F("##### TIMING "));
+  Serial.print(funcName);
+  Serial.print(F(" count="));
+  Serial.print(count);
+  Serial.print(F(" rate="));
+  Serial.print(time == 0 ? 0 : count * 1000000.0 / time);
+  if (sampleCount != 0) {
+    Serial.print(F(" p50="));
+    Serial.print(__PERCENTILE__(50));
+    Serial.print(F(" p99="));
+    Serial.print(__PERCENTILE__(99));
+    Serial.print(F(" max="));
+    Serial.print(sampleMax);
+  }
+  Serial.println();
+
+  __CLEAR__();
+}
+
 // One-time initializer actually does all the work
 void setup() {
   Serial.begin(115200);
@@ -77,7 +168,7 @@ void setup() {
   Serial.print(F("."));
   Serial.print(RAILUINO_VERSION & 0xff);
   Serial.println(F(" test suite..."));
-  while(true) {
+  while(INTERACTIVE) {
     int c = Serial.read();
     if (c == 10 || c == 13) {
       break;
@@ -87,15 +178,30 @@ void setup() {
   testMessageClear();
   testMessagePrintTo();
   testMessageParseFrom();
+
+  testFilter();
+  testEventQueue();
+  testReporterComposite();
+  testReporterCAN();
+  testLayout();
+  testBlocks();
+  testInterlocking();
+  testTimetable();
+  testEncodeRC5();
+  testDecodeRC5();
   
   testController();
   testInitController();
   testBeginEnd();
+  testBeginAsync();
   testSendReceiveMessage();
   testExchangeMessage();
+  testScheduler();
+  testEmergencyStop();
   
   testVersion();
   testPower();
+  testMonitor();
   testGetSetDirection();
   testToggleDirection();
   testGetSetSpeed();
@@ -106,6 +212,8 @@ void setup() {
   testSetAccessory();
   testSetTurnout();
   testReadWriteConfig();
+  testRampSpeed();
+  testStopper();
 
   if (STRESS) {
     testSendReceiveMessageStress1();
@@ -232,6 +340,586 @@ void testMessageParseFrom() {
   PASS;
 }
 
+// Tests debouncing and holding contact values
+void testFilter() {
+  TEST;
+
+  TrackFilter filter;
+  byte values[1];
+  byte state[1] = { 0x00 };
+
+  // Defaults pass everything through
+  values[0] = 0x5a;
+  filter.apply(values, state, 1);
+  ASSERT(0, state[0] == 0x5a);
+
+  values[0] = 0x00;
+  filter.apply(values, state, 1);
+  ASSERT(1, state[0] == 0x00);
+
+  // Contact 1 needs three samples, a glitch starts over
+  filter.setDebounce(1, 3);
+
+  values[0] = 0x01;
+  filter.apply(values, state, 1);
+  ASSERT(2, state[0] == 0x00);
+
+  values[0] = 0x00;
+  filter.apply(values, state, 1);
+  ASSERT(3, state[0] == 0x00);
+
+  for (int i = 0; i < 2; i++) {
+    values[0] = 0x01;
+    filter.apply(values, state, 1);
+    ASSERT(4, state[0] == 0x00);
+  }
+
+  values[0] = 0x01;
+  filter.apply(values, state, 1);
+  ASSERT(5, state[0] == 0x01);
+
+  // Contact 2 stays occupied for two more samples
+  filter.setHold(2, 2);
+
+  values[0] = 0x03;
+  filter.apply(values, state, 1);
+  ASSERT(6, state[0] == 0x03);
+
+  for (int i = 0; i < 2; i++) {
+    values[0] = 0x01;
+    filter.apply(values, state, 1);
+    ASSERT(7, state[0] == 0x03);
+  }
+
+  values[0] = 0x01;
+  filter.apply(values, state, 1);
+  ASSERT(8, state[0] == 0x01);
+
+  // Only the changes are left in the values
+  values[0] = 0x03;
+  filter.apply(values, state, 1);
+  ASSERT(9, state[0] == 0x03 && values[0] == 0x02);
+
+  // Contacts beyond the filter are passed through
+  TrackFilter wide;
+  byte all[REPORTER_BYTES];
+  byte wideState[REPORTER_BYTES];
+
+  wide.setDebounce(0, 3);
+  wide.setDebounce(8 * REPORTER_BYTES, 3);
+
+  memset(all, 0xff, sizeof(all));
+  memset(wideState, 0x00, sizeof(wideState));
+  wide.apply(all, wideState, REPORTER_BYTES);
+  ASSERT(10, wideState[0] == 0x00 && all[0] == 0x00);
+  ASSERT(11, wideState[REPORTER_BYTES - 1] == (FILTER_BYTES < REPORTER_BYTES ? 0xff : 0x00));
+  ASSERT(12, all[REPORTER_BYTES - 1] == wideState[REPORTER_BYTES - 1]);
+
+  PASS;
+}
+
+// Tests buffering contact events
+void testEventQueue() {
+  TEST;
+
+  TrackEventQueue queue;
+  TrackEvent event;
+
+  ASSERT(0, !queue.pop(event));
+
+  queue.push(1, true, 100);
+  queue.push(512, false, 200);
+
+  ASSERT(1, queue.pop(event));
+  ASSERT(2, event.contact == 1);
+  ASSERT(3, event.active);
+  ASSERT(4, event.time == 100);
+
+  ASSERT(5, queue.pop(event));
+  ASSERT(6, event.contact == 512);
+  ASSERT(7, !event.active);
+  ASSERT(8, event.time == 200);
+
+  ASSERT(9, !queue.pop(event));
+
+  // Overflowing events are dropped and counted
+  for (int i = 0; i < REPORTER_EVENTS + 3; i++) {
+    queue.push(i + 1, true, i);
+  }
+
+  ASSERT(10, queue.getOverflows() == 3);
+
+  for (int i = 0; i < REPORTER_EVENTS; i++) {
+    ASSERT(11, queue.pop(event));
+    ASSERT(12, event.contact == i + 1);
+  }
+
+  ASSERT(13, !queue.pop(event));
+
+  PASS;
+}
+
+// Creates an S88 event as sent by an L88 or LinkS88
+TrackMessage s88Event(word device, word contact, boolean value) {
+  TrackMessage message;
+
+  message.clear();
+  message.command = 0x11;
+  message.length = 0x08;
+  message.data[0] = highByte(device);
+  message.data[1] = lowByte(device);
+  message.data[2] = highByte(contact);
+  message.data[3] = lowByte(contact);
+  message.data[4] = value ? 0 : 1;
+  message.data[5] = value ? 1 : 0;
+
+  return message;
+}
+
+// Tests merging CAN reporters into one address space
+void testReporterComposite() {
+  TEST;
+
+  TrackController ctrl;
+  TrackReporterCAN first(ctrl, 0, 20);
+  TrackReporterCAN second(ctrl, 1, 30);
+  TrackReporterComposite rprt;
+  TrackMessage message;
+  TrackEvent event;
+
+  ASSERT(0, rprt.add(first));
+  ASSERT(1, rprt.add(second));
+  ASSERT(2, rprt.getSize() == 50);
+
+  message = s88Event(0, 3, true);
+  first.messageReceived(message);
+  second.messageReceived(message);
+
+  message = s88Event(1, 30, true);
+  first.messageReceived(message);
+  second.messageReceived(message);
+
+  rprt.refresh();
+
+  ASSERT(3, rprt.getValue(3));
+  ASSERT(4, !rprt.getValue(23));
+  ASSERT(5, rprt.getValue(50));
+  ASSERT(6, rprt.hasChanged(50));
+  ASSERT(7, !rprt.hasChanged(4));
+
+  ASSERT(8, rprt.nextChange(0) == 3);
+  ASSERT(9, rprt.nextChange(3) == 50);
+  ASSERT(10, rprt.nextChange(50) == 0);
+
+  ASSERT(11, rprt.getEvent(event));
+  ASSERT(12, event.contact == 3 && event.active);
+  ASSERT(13, rprt.getEvent(event));
+  ASSERT(14, event.contact == 50 && event.active);
+  ASSERT(15, !rprt.getEvent(event));
+
+  PASS;
+}
+
+// Tests that the CAN reporter doesn't take messages from the sketch
+void testReporterCAN() {
+  TEST;
+
+  TrackController ctrl;
+  ctrl.init(0x7f7f, false, true);
+  ctrl.begin();
+
+  TrackReporterCAN rprt(ctrl, 0, 8);
+  TrackMessage message;
+
+  // Nobody else receives, so the reporter does
+  message = s88Event(0, 3, true);
+  ctrl.sendMessage(message);
+  delay(1);
+  rprt.refresh();
+
+  ASSERT(0, rprt.getValue(3));
+
+  // Now the sketch does, and the reporter listens
+  message = s88Event(0, 4, true);
+  ctrl.sendMessage(message);
+  delay(1);
+  message = s88Event(0, 5, true);
+  ctrl.sendMessage(message);
+  delay(1);
+
+  ASSERT(1, ctrl.receiveMessage(message) && message.data[3] == 4);
+  rprt.refresh();
+  ASSERT(2, ctrl.receiveMessage(message) && message.data[3] == 5);
+  rprt.refresh();
+
+  ASSERT(3, rprt.getValue(4) && rprt.getValue(5));
+
+  // All supported contacts are available, others don't exist
+  TrackReporterCAN full(ctrl, 0, 512);
+  int last = min(512, 8 * CAN_REPORTER_BYTES);
+
+  ASSERT(4, full.getSize() == last);
+
+  message = s88Event(0, last, true);
+  full.messageReceived(message);
+  full.refresh();
+
+  ASSERT(5, full.getValue(last) && full.hasChanged(last));
+  ASSERT(6, full.nextChange(0) == last);
+  ASSERT(7, !full.getValue(0) && !full.getValue(last + 1));
+  ASSERT(8, !full.hasChanged(-1) && !full.hasChanged(last + 1));
+
+  ctrl.end();
+
+  PASS;
+}
+
+// A loop of three blocks with a few routes for the tests below
+constexpr TrackBlock testBlockTable[] PROGMEM = {
+  { 1, 0, 2, TURN },
+  { 2, 0, 3, 0 },
+  { 3, 5, 1, 0 }
+};
+
+const word testTurnoutTable[] PROGMEM = { accMM2(1), accMM2(2), accMM2(3) };
+
+constexpr TrackRoute testRouteTable[] PROGMEM = {
+  { 1, 3, trackBits(0, 2), trackBits(2) },
+  { 2, 3, trackBits(1), 0 },
+  { 0, 0, trackBits(1), trackBits(1) }
+};
+
+TRACK_LAYOUT_WITH_ROUTES(layout, testBlockTable, 8, testTurnoutTable, testRouteTable);
+
+TRACK_LAYOUT(plainLayout, testBlockTable, 8);
+
+// Tests the tables generated for a layout
+void testLayout() {
+  TEST;
+
+  ASSERT(0, layout.getBlockCount() == 3 && layout.getContactCount() == 8);
+  ASSERT(1, layout.getEnteredBlock(2) == 2 && layout.getEnteredBlock(4) == 0);
+  ASSERT(2, layout.getLeftBlock(5) == 3 && layout.getLeftBlock(3) == 0);
+  ASSERT(3, layout.getEnteredBlock(9) == 0);
+  ASSERT(4, layout.getPreviousBlock(1) == 3 && layout.getPreviousBlock(2) == 1);
+  ASSERT(5, layout.getBlock(1).signal == TURN && layout.getBlock(3).next == 1);
+  ASSERT(6, layout.getTurnoutCount() == 3 && layout.getTurnout(2) == ADDR_ACC_MM2 + 3);
+  ASSERT(7, layout.getRouteCount() == 3);
+  ASSERT(8, layout.getRoute(1).turnouts == 0b101 && layout.getRoute(1).straight == 0b100);
+  ASSERT(9, locoMM2(78) == ADDR_MM2 + 78);
+  ASSERT(10, layout.getConflicts(1) == 0b010);
+  ASSERT(11, layout.getConflicts(2) == 0b101);
+  ASSERT(12, layout.getConflicts(3) == 0b010);
+  ASSERT(13, plainLayout.getRouteCount() == 0 && plainLayout.getConflicts(1) == 0);
+
+  PASS;
+}
+
+// Tests occupancy and protection with a loop of three blocks
+void testBlocks() {
+  TEST;
+
+  TrackController ctrl;
+  ctrl.init(0x7f7f, false, true);
+  ctrl.begin();
+
+  TrackReporterCAN rprt(ctrl, 0, 8);
+  TrackBlocks blocks(ctrl, rprt, layout);
+  TrackMessage message;
+
+  blocks.setTrain(1, 10, 50);
+  blocks.setTrain(2, 20, 60);
+
+  rprt.refresh();
+  blocks.update();
+
+  // First train has to wait for the second one
+  ASSERT(0, blocks.isOccupied(1) && blocks.isOccupied(2) && !blocks.isOccupied(3));
+  ASSERT(1, blocks.isRed(1) && !blocks.isRed(2) && blocks.isRed(3));
+
+  // Give the loopback frames time to come back
+  delay(10);
+
+  boolean signal = false, stop = false;
+  while (ctrl.receiveMessage(message)) {
+    signal |= message.command == 0x0b && word(message.data[2], message.data[3]) == TURN && message.data[4] == ACC_RED;
+    stop |= message.command == 0x04 && message.data[3] == 10 && message.data[5] == 0;
+  }
+
+  ASSERT(2, signal && stop);
+
+  // Second train moves on, first one follows, but has to wait then
+  message = s88Event(0, 3, true);
+  rprt.messageReceived(message);
+  rprt.refresh();
+  blocks.update();
+
+  ASSERT(3, !blocks.isOccupied(2) && blocks.isOccupied(3));
+  ASSERT(4, blocks.getTrain(3) == 20 && blocks.getTrain(2) == 0);
+  ASSERT(5, !blocks.isRed(1) && blocks.isRed(2) && blocks.isRed(3));
+
+  delay(10);
+
+  boolean go = false;
+  while (ctrl.receiveMessage(message)) {
+    go |= message.command == 0x04 && message.data[3] == 10 && message.data[5] == 50;
+  }
+
+  ASSERT(6, go);
+
+  // An unknown train leaves a block without exit contact, too
+  blocks.reset();
+  message = s88Event(0, 1, true);
+  rprt.messageReceived(message);
+  rprt.refresh();
+  blocks.update();
+  ASSERT(7, blocks.isOccupied(1) && blocks.getTrain(1) == 0);
+
+  message = s88Event(0, 2, true);
+  rprt.messageReceived(message);
+  rprt.refresh();
+  blocks.update();
+  ASSERT(8, !blocks.isOccupied(1) && blocks.isOccupied(2));
+
+  ctrl.end();
+
+  PASS;
+}
+
+// Tests setting and releasing routes
+void testInterlocking() {
+  TEST;
+
+  TrackController ctrl;
+  ctrl.init(0x7f7f, false, true);
+  ctrl.begin();
+
+  TrackInterlocking lock(ctrl, layout, NULL);
+  TrackMessage message;
+
+  ASSERT(0, lock.isFree(1) && lock.isFree(2) && lock.isFree(3));
+  ASSERT(1, lock.setRoute(1));
+  ASSERT(2, lock.isSet(1) && !lock.isFree(2) && lock.isFree(3));
+  ASSERT(3, !lock.setRoute(2));
+  ASSERT(4, lock.setRoute(3));
+  ASSERT(5, lock.isSwitching());
+
+  // All three turnouts are switched in one batch
+  lock.update();
+
+  // Give the loopback frames time to come back
+  delay(10);
+
+  int on = 0, straight = 0;
+  while (ctrl.receiveMessage(message)) {
+    if (message.command == 0x0b && message.data[5] == 1) {
+      on++;
+      straight += message.data[4];
+    }
+  }
+
+  ASSERT(6, on == 3 && straight == 2);
+
+  unsigned long time = millis();
+  while (lock.isSwitching() && millis() - time < 1000) {
+    lock.update();
+  }
+
+  delay(10);
+
+  int off = 0;
+  while (ctrl.receiveMessage(message)) {
+    off += message.command == 0x0b && message.data[5] == 0;
+  }
+
+  ASSERT(7, off == 3);
+
+  lock.releaseRoute(1);
+  ASSERT(8, !lock.isSet(1) && !lock.isFree(2));
+  lock.releaseRoute(3);
+  ASSERT(9, lock.isFree(2));
+
+  // Routes that don't exist are neither set nor free
+  ASSERT(10, !lock.setRoute(0) && !lock.setRoute(4) && !lock.isSet(-1) && !lock.isFree(65));
+  lock.releaseRoute(64);
+
+  // The batch being switched is powered off in its own positions,
+  // even if a new route changes them in the meantime
+  ASSERT(11, lock.setRoute(3));
+  lock.update();
+  lock.releaseRoute(3);
+  ASSERT(12, lock.setRoute(2));
+
+  time = millis();
+  while (lock.isSwitching() && millis() - time < 1000) {
+    lock.update();
+  }
+
+  delay(10);
+
+  int straightOff = 0, roundOn = 0;
+  while (ctrl.receiveMessage(message)) {
+    if (message.command == 0x0b && word(message.data[2], message.data[3]) == accMM2(2)) {
+      straightOff += message.data[4] == ACC_STRAIGHT && message.data[5] == 0;
+      roundOn += message.data[4] == ACC_ROUND && message.data[5] == 1;
+    }
+  }
+
+  ASSERT(13, straightOff == 1 && roundOn == 1);
+
+  ctrl.end();
+
+  PASS;
+}
+
+// Remembers when the messages reflected by loopback arrived
+class TrackListenerCounter : public TrackListener {
+
+  public:
+
+  int count = 0;
+
+  unsigned long times[16];
+
+  void messageReceived(TrackMessage &message) {
+    if (count < 16) {
+      times[count] = millis();
+    }
+
+    count++;
+  }
+
+};
+
+// A short timetable for the test below
+const TrackAction testActionTable[] PROGMEM = {
+  {   0, ACTION_SPEED,    LOCO, 100, 0 },
+  {  50, ACTION_FUNCTION, LOCO,   1, 1 },
+  { 100, ACTION_SPEED,    LOCO,   0, 0 }
+};
+
+// Tests running a timetable twice plus an action scheduled at runtime
+void testTimetable() {
+  TEST;
+
+  TrackController ctrl;
+  ctrl.init(0x7f7f, false, true);
+  ctrl.begin();
+
+  TrackTimetable timetable(ctrl);
+  TrackListenerCounter counter;
+  ctrl.addListener(&counter);
+
+  TrackAction action = { 20, ACTION_ACCESSORY, TURN, ACC_GREEN, 1 };
+
+  timetable.begin(testActionTable, 3, 150);
+  ASSERT(0, timetable.schedule(action));
+  ASSERT(1, timetable.isRunning());
+
+  unsigned long time = millis();
+  while (millis() - time < 240) {
+    timetable.update();
+  }
+
+  // 0, 20, 50, 100, 150 and 200 ms, but not 250 ms
+  ASSERT(2, counter.count == 6);
+  ASSERT(3, counter.times[1] - counter.times[0] >= 18);
+  ASSERT(4, counter.times[5] - counter.times[0] >= 198);
+  ASSERT(5, timetable.getLateness() <= 5);
+
+  timetable.end();
+  ASSERT(6, !timetable.isRunning());
+
+  ctrl.removeListener(&counter);
+  ctrl.end();
+
+  PASS;
+}
+
+// Tests encoding RC5 frames into marks and spaces
+void testEncodeRC5() {
+  TEST;
+
+  byte runs[IR_RUNS];
+
+  // Loco 1, FASTER, as half bits: 101 10 01 01 10 10 10 10 01 10 10 10 10
+  byte faster[] = { 1, 1, 2, 2, 1, 1, 2, 1, 1, 1, 1, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1 };
+
+  byte count = TrackControllerInfrared::encode(0x610, 12, false, runs);
+  ASSERT(0, count == sizeof(faster));
+  for (int i = 0; i < count; i++) {
+    ASSERT(1, runs[i] == faster[i]);
+  }
+
+  // Extended frames have a zero as second start bit
+  count = TrackControllerInfrared::encode(0x610, 12, true, runs);
+  ASSERT(2, count == sizeof(faster));
+  ASSERT(3, runs[0] == 2 && runs[1] == 1 && runs[2] == 1);
+
+  // All ones alternate every half bit and end with a mark
+  count = TrackControllerInfrared::encode(0xfff, 12, false, runs);
+  ASSERT(4, count == 27);
+  for (int i = 0; i < count; i++) {
+    ASSERT(5, runs[i] == 1);
+  }
+
+  // 14 bits, all zeros, still fit
+  count = TrackControllerInfrared::encode(0, 14, true, runs);
+  ASSERT(6, count <= IR_RUNS);
+
+  PASS;
+}
+
+// Feeds an encoded frame into a decoder, with some jitter on the edges
+boolean feedRC5(TrackDecoderInfrared &decoder, unsigned long data, bool extended, int jitter) {
+  byte runs[IR_RUNS];
+  byte count = TrackControllerInfrared::encode(data, 12, extended, runs);
+
+  for (int i = 0; i < count; i++) {
+    int error = (i % 2 == 0) ? jitter : -jitter;
+    decoder.feed(i % 2 == 0, runs[i] * 889 + error);
+  }
+
+  return decoder.feed(false, 0xffff);
+}
+
+// Tests decoding RC5 frames from marks and spaces
+void testDecodeRC5() {
+  TEST;
+
+  TrackDecoderInfrared decoder;
+
+  // Loco 1, FASTER, toggle bit set
+  ASSERT(0, feedRC5(decoder, 0xe10, false, 0));
+  ASSERT(1, decoder.getAddress() == 0b11000);
+  ASSERT(2, decoder.getCommand() == 0b0010000);
+  ASSERT(3, decoder.getToggle());
+  ASSERT(4, decoder.getTimingError() == 0);
+
+  // Loco 2, function 3 (extended), some jitter
+  ASSERT(5, feedRC5(decoder, 0x653, true, 120));
+  ASSERT(6, decoder.getAddress() == 0b11001);
+  ASSERT(7, decoder.getCommand() == 0b1010011);
+  ASSERT(8, !decoder.getToggle());
+  ASSERT(9, decoder.getTimingError() == 120);
+
+  // Frames ending with a zero bit, so the last space merges into the gap
+  ASSERT(10, feedRC5(decoder, 0x382, false, 0));
+  ASSERT(11, decoder.getAddress() == 0b01110);
+  ASSERT(12, decoder.getCommand() == 0b0000010);
+
+  // Marks of three half bits don't exist
+  decoder.feed(true, 889);
+  decoder.feed(false, 889);
+  decoder.feed(true, 3 * 889);
+  ASSERT(13, !decoder.feed(false, 0xffff));
+
+  ASSERT(14, decoder.getFrames() == 3);
+  ASSERT(15, decoder.getErrors() == 1);
+
+  PASS;
+}
+
 // Tests creating the controller
 void testController() {
   TEST;
@@ -290,13 +978,69 @@ void testBeginEnd() {
   ctrl.init(0, DEBUG, false);
   ctrl.begin();
   ASSERT(1, ctrl.getHash() != 0);
-  ASSERT(2, ctrl.getHash() & 0x0300 == 0x0300);
-  ASSERT(3, ctrl.getHash() | 0xff7f == 0xff7f);
+  ASSERT(2, (ctrl.getHash() & 0x0300) == 0x0300);
+  ASSERT(3, (ctrl.getHash() | 0xff7f) == 0xff7f);
   ctrl.end();
   
   PASS;
 }
 
+// Counts calls of the ready handler
+int readyCount = 0;
+
+void countReady(TrackController &controller) {
+  readyCount++;
+}
+
+// Tests starting up in the background with commands queued meanwhile
+void testBeginAsync() {
+  TEST;
+
+  TrackController ctrl;
+  TrackMessage message;
+
+  ctrl.init(0, DEBUG, false);
+  ctrl.setReadyHandler(countReady);
+  readyCount = 0;
+
+  unsigned long time = millis();
+  ctrl.begin();
+
+  ASSERT(0, millis() - time < 10);
+  ASSERT(1, !ctrl.isReady() && readyCount == 0);
+
+  // Queued until the controller is ready
+  message.clear();
+  message.command = 0x04;
+  message.length = 0x06;
+  message.data[3] = 78;
+  message.data[5] = 100;
+
+  ASSERT(2, ctrl.sendMessage(message));
+
+  // Nothing overtakes the startup, so a full queue refuses more
+  for (int i = 1; i < CONTROLLER_QUEUE; i++) {
+    ctrl.sendMessage(message);
+  }
+
+  ASSERT(3, !ctrl.sendMessage(message));
+  ASSERT(4, !ctrl.isReady());
+
+  while (!ctrl.isReady() && millis() - time < 5000) {
+    ctrl.update();
+  }
+
+  ASSERT(5, ctrl.isReady() && readyCount == 1);
+  ASSERT(6, ctrl.getHash() != 0);
+
+  word speed = 0;
+  ASSERT(7, ctrl.getLocoSpeed(ADDR_MM2 + 78, &speed) && speed == 100);
+
+  ctrl.end();
+
+  PASS;
+}
+
 // Tests sending and receiving messages
 void testSendReceiveMessage() {
   TEST;
@@ -392,6 +1136,7 @@ void testSendReceiveMessageStress2() {
   ctrl.begin();
 
   int a = 0;
+  unsigned long time = 0;
 
   // Bunch of "fill buffer, then empty it"
   for (int i = 0; i < 32; i++) {
@@ -412,7 +1157,11 @@ void testSendReceiveMessageStress2() {
     }
     
     for (int j = 0; j < 32; j++) {
+      unsigned long start = micros();
       ASSERT(a++, ctrl.receiveMessage(in));
+      unsigned long latency = micros() - start;
+      __SAMPLE__(latency);
+      time += latency;
     
       ASSERT(a++, in.response);
      
@@ -426,6 +1175,8 @@ void testSendReceiveMessageStress2() {
     }
   }
 
+  __TIMING__(__FUNCTION__, 32L * 32, time);
+
   PASS;
 }
 
@@ -493,6 +1244,89 @@ void testExchangeMessage() {
   PASS;
 }
 
+// A task that walks through all kinds of waits
+class TestTask : public TrackTask {
+
+  public:
+
+  int steps;
+
+  boolean results[3];
+
+  void run() {
+    TASK_BEGIN();
+    steps = 1;
+    sleep(50);
+    TASK_YIELD();
+
+    steps = 2;
+    setLocoSpeed(LOCO, 100);
+    TASK_YIELD();
+    results[0] = getResult() && getResponse().response;
+
+    steps = 3;
+    waitForContact(3, true, 0);
+    TASK_YIELD();
+    results[1] = getResult();
+
+    waitForContact(4, true, 100);
+    TASK_YIELD();
+    results[2] = !getResult();
+
+    steps = 4;
+    TASK_END();
+  }
+
+};
+
+void testScheduler() {
+  TEST;
+
+  TrackController ctrl;
+  ctrl.init(0x7f7f, DEBUG, true);
+  ctrl.begin();
+
+  TrackReporterCAN rprt(ctrl, 0, 8);
+  TrackScheduler sched(ctrl, &rprt);
+  TrackMessage message;
+  TestTask first, second;
+
+  sched.start(first);
+  sched.start(second);
+  ASSERT(0, sched.getCount() == 2);
+  ASSERT(1, first.isRunning() && second.isRunning());
+
+  unsigned long time = millis();
+  sched.update();
+  ASSERT(2, first.steps == 1 && second.steps == 1);
+
+  // Timer, then request answered by loopback
+  while ((first.steps < 3 || second.steps < 3) && millis() - time < 1000) {
+    sched.update();
+  }
+
+  ASSERT(3, millis() - time >= 50);
+  ASSERT(4, first.steps == 3 && second.steps == 3);
+  ASSERT(5, first.results[0] && second.results[0]);
+
+  // Contact, then contact timeout
+  message = s88Event(0, 3, true);
+  rprt.messageReceived(message);
+
+  time = millis();
+  while (sched.getCount() != 0 && millis() - time < 1000) {
+    sched.update();
+  }
+
+  ASSERT(6, first.steps == 4 && second.steps == 4);
+  ASSERT(7, first.results[1] && first.results[2]);
+  ASSERT(8, !first.isRunning() && !second.isRunning());
+
+  ctrl.end();
+
+  PASS;
+}
+
 // Tests exchanging many messages one-by-one 
 void testExchangeMessageStress() {
   TEST;
@@ -503,6 +1337,8 @@ void testExchangeMessageStress() {
   
   ctrl.init(0x7f7f, DEBUG, true);
   ctrl.begin();
+
+  unsigned long time = 0;
   
   // Bunch of execute calls 
   for (int i = 0; i < 1000; i++) {
@@ -518,7 +1354,11 @@ void testExchangeMessageStress() {
       out.data[j] = random(256);
     }
   
+    unsigned long start = micros();
     ASSERT(a + 1, ctrl.exchangeMessage(out, in, 1000));
+    unsigned long latency = micros() - start;
+    __SAMPLE__(latency);
+    time += latency;
   
     ASSERT(a + 2, in.response);
    
@@ -531,6 +1371,72 @@ void testExchangeMessageStress() {
     }
   }
   
+  __TIMING__(__FUNCTION__, 1000, time);
+  
+  PASS;
+}
+
+// Tests the emergency stop and measures the time until it is on the bus
+void testEmergencyStop() {
+  TEST;
+
+  TrackController ctrl;
+  TrackMessage message;
+
+  ctrl.init(0x7f7f, DEBUG, true);
+  ctrl.begin();
+
+  unsigned long worst = 0, total = 0;
+
+  for (int i = 0; i < 100; i++) {
+    // Something pending that the stop has to overtake
+    message.clear();
+    message.command = 0x04;
+    message.length = 0x06;
+    message.data[3] = i;
+
+    for (int j = 0; j < 3; j++) {
+      ctrl.sendMessage(message);
+    }
+
+    unsigned long start = micros();
+    ASSERT(0, ctrl.emergencyStop());
+
+    boolean stop = false;
+    int overtaken = 3;
+    unsigned long time = millis();
+    while (!stop && millis() - time < 100) {
+      while (ctrl.receiveMessage(message)) {
+        if (message.command == 0x04 && message.data[3] == i) {
+          overtaken--;
+        } else if (message.command == 0x00 && message.length == 5 && message.data[4] == 0x00) {
+          // Time stamps have a resolution of 16 us
+          long latency = ctrl.getReceiveTime() - start;
+          if (latency < 0) {
+            latency = 0;
+          }
+          __SAMPLE__(latency);
+          total += latency;
+          if (latency > worst) {
+            worst = latency;
+          }
+          stop = true;
+        }
+      }
+    }
+
+    // Only the frame already on the wire got through
+    ASSERT(1, stop && overtaken >= 2);
+  }
+
+  __TIMING__(__FUNCTION__, 100, total);
+
+  // Worst case is the frame on the wire plus the stop itself, about
+  // 0.9 ms at 250 kbit/s. Waiting for all three would take 1.8 ms.
+  ASSERT(2, worst < 1500);
+
+  ctrl.end();
+
   PASS;
 }
 
@@ -581,6 +1487,70 @@ void testPower() {
   PASS;
 }
 
+// Tests watching the bus and the Gleisbox
+void testMonitor() {
+  TEST;
+
+  TrackController ctrl;
+  TrackMonitor monitor(ctrl);
+
+  ctrl.init(0, DEBUG, false);
+  ctrl.begin();
+
+  unsigned long time = millis();
+  while (millis() - time < 1500) {
+    monitor.update();
+  }
+
+  ASSERT(0, monitor.getState() == HEALTH_OK);
+  ASSERT(1, monitor.getRecoveries() == 0);
+
+#if defined(CAN_SIMULATOR)
+  // A bus-off is noticed with the next check and fixed by a restart
+  simulator.setBusOff(true);
+
+  time = millis();
+  while (monitor.getState() != HEALTH_RECOVERING && millis() - time < 2000) {
+    monitor.update();
+  }
+
+  ASSERT(2, millis() - time <= MONITOR_INTERVAL + 10);
+
+  while (monitor.getState() == HEALTH_RECOVERING && millis() - time < 4000) {
+    monitor.update();
+  }
+
+  ASSERT(3, monitor.getState() == HEALTH_OK && monitor.getRecoveries() == 1);
+  ASSERT(4, monitor.getRecoveryTime() <= MONITOR_RETRY + 10);
+
+  // A Gleisbox that is gone is noticed after the timeout
+  simulator.setOffline(true);
+
+  time = millis();
+  while (monitor.getState() != HEALTH_RECOVERING && millis() - time < 6000) {
+    monitor.update();
+  }
+
+  ASSERT(5, monitor.getState() == HEALTH_RECOVERING);
+  ASSERT(6, millis() - time <= MONITOR_TIMEOUT + MONITOR_INTERVAL + 10);
+
+  // Once it is back, it takes at most one more try
+  simulator.setOffline(false);
+
+  time = millis();
+  while (monitor.getState() == HEALTH_RECOVERING && millis() - time < 2000) {
+    monitor.update();
+  }
+
+  ASSERT(7, millis() - time <= MONITOR_RETRY + 10);
+  ASSERT(8, monitor.getState() == HEALTH_OK && monitor.getRecoveries() == 2);
+#endif
+
+  ctrl.end();
+
+  PASS;
+}
+
 // Tests getting/setting the direction of a loco
 void testGetSetDirection() {
   TEST;
@@ -898,3 +1868,171 @@ void testReadWriteConfig() {
   
   PASS;
 }
+
+void testRampSpeed() {
+  TEST;
+
+  TrackController ctrl;
+  TrackMessage message;
+
+  ctrl.init(0x7f7f, false, true);
+  ctrl.begin();
+
+  ASSERT(0, ctrl.rampLocoSpeed(LOCO, 500, 200, RAMP_LINEAR));
+  ASSERT(1, ctrl.rampLocoSpeed(LOCO + 1, 300, 200, RAMP_S_CURVE));
+  ASSERT(2, ctrl.isRamping(LOCO) && ctrl.isRamping(LOCO + 1));
+
+  int frames[2] = { 0, 0 };
+  word last[2] = { 0, 0 };
+  boolean rising = true;
+
+  unsigned long time = millis();
+  // Until the last frames are back from the wire
+  while ((ctrl.isRamping(LOCO) || ctrl.isRamping(LOCO + 1) || last[0] != 500 || last[1] != 300)
+      && millis() - time < 1000) {
+    ctrl.update();
+
+    while (ctrl.receiveMessage(message)) {
+      int i = word(message.data[2], message.data[3]) - (LOCO);
+      word speed = word(message.data[4], message.data[5]);
+
+      if (message.command == 0x04 && i >= 0 && i <= 1) {
+        rising &= speed > last[i];
+        last[i] = speed;
+        frames[i]++;
+      }
+    }
+  }
+
+  // Both get there in time, taking turns
+  ASSERT(3, millis() - time < 300);
+  ASSERT(4, last[0] == 500 && last[1] == 300 && rising);
+  ASSERT(5, frames[0] >= 3 && frames[1] >= 3 && frames[0] + frames[1] <= 20);
+
+  // Power off ends all ramps
+  ASSERT(6, ctrl.rampLocoSpeed(LOCO, 0, 1000, RAMP_LINEAR));
+  ctrl.setPower(false);
+  ASSERT(7, !ctrl.isRamping(LOCO));
+
+  // So does an emergency stop, which may come from an interrupt
+  ASSERT(8, ctrl.rampLocoSpeed(LOCO, 0, 1000, RAMP_LINEAR));
+  ctrl.emergencyStop();
+  ctrl.update();
+  ASSERT(9, !ctrl.isRamping(LOCO));
+
+  ctrl.end();
+
+#if defined(CAN_SIMULATOR)
+  // A halt from the MS2 ends all ramps, even if the sketch doesn't
+  // receive messages itself
+  ctrl.init(0x7f7f, false, false);
+  ctrl.begin();
+
+  ASSERT(10, ctrl.rampLocoSpeed(LOCO, 0, 500, 1000, RAMP_LINEAR));
+
+  message.clear();
+  message.command = 0x00;
+  message.hash = 0x4f0b;
+  message.length = 0x05;
+  message.data[4] = 0x02;
+  simulator.inject(message);
+
+  time = millis();
+  while (ctrl.isRamping(LOCO) && millis() - time < 100) {
+    ctrl.update();
+  }
+
+  ASSERT(11, !ctrl.isRamping(LOCO));
+
+  ctrl.end();
+#endif
+
+  PASS;
+}
+
+// Tests stopping a train at a given point behind two contacts
+void testStopper() {
+  TEST;
+
+  TrackController ctrl;
+  ctrl.init(0x7f7f, false, true);
+  ctrl.begin();
+
+  TrackReporterCAN rprt(ctrl, 0, 8);
+  TrackStopper stop(ctrl, rprt);
+  TrackMessage message;
+
+  // 100 mm in 100 ms is 1000 mm/s, so braking takes 200 mm
+  stop.setContacts(1, 2, 100, 300);
+  stop.setBrakeTime(400);
+  stop.arm(LOCO, 500);
+
+  message = s88Event(0, 1, true);
+  ctrl.sendMessage(message);
+  delay(100);
+  message = s88Event(0, 2, true);
+  ctrl.sendMessage(message);
+
+  unsigned long time = micros();
+
+  // Being late to see the contact doesn't matter
+  delay(50);
+  rprt.refresh();
+  stop.update();
+
+  ASSERT(0, stop.getState() == STOPPER_WAITING);
+  ASSERT(1, stop.getVelocity() >= 950 && stop.getVelocity() <= 1050);
+
+  while (stop.getState() == STOPPER_WAITING && micros() - time < 1000000) {
+    stop.update();
+  }
+
+  // The remaining 100 mm at full speed
+  unsigned long elapsed = micros() - time;
+  ASSERT(2, elapsed >= 95000 && elapsed <= 105000);
+  ASSERT(3, ctrl.isRamping(LOCO) && stop.getLateness() < 1000);
+
+  word last = 500;
+  time = millis();
+  while ((ctrl.isRamping(LOCO) || last != 0) && millis() - time < 1000) {
+    ctrl.update();
+
+    while (ctrl.receiveMessage(message)) {
+      if (message.command == 0x04) {
+        last = word(message.data[4], message.data[5]);
+      }
+    }
+  }
+
+  elapsed = millis() - time;
+  ASSERT(4, last == 0 && elapsed >= 380 && elapsed <= 420);
+
+  // Too close for braking slowly, so it brakes harder right away
+  stop.setContacts(1, 2, 100, 150);
+  stop.setLatency(50);
+  stop.arm(LOCO, 500);
+
+  message = s88Event(0, 1, false);
+  ctrl.sendMessage(message);
+  message = s88Event(0, 2, false);
+  ctrl.sendMessage(message);
+  message = s88Event(0, 1, true);
+  ctrl.sendMessage(message);
+  delay(100);
+  message = s88Event(0, 2, true);
+  ctrl.sendMessage(message);
+  delay(1);
+
+  // We received messages above, so the reporter leaves them to us
+  while (ctrl.receiveMessage(message)) {
+  }
+
+  rprt.refresh();
+  stop.update();
+
+  ASSERT(5, stop.getState() == STOPPER_BRAKING);
+
+  ctrl.end();
+
+  PASS;
+}
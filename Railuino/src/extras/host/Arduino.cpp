@@ -0,0 +1,74 @@
+// ===================================================================
+// === Arduino on the host ===========================================
+// ===================================================================
+
+#include <new>
+#include <time.h>
+
+#include "Arduino.h"
+
+unsigned long hostMicros = 0;
+
+void (*hostDelayHook)(unsigned long us) = NULL;
+
+#if defined(HOST_REAL_TIME)
+
+static unsigned long long hostNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned long long hostStart = hostNanos();
+
+unsigned long hostClock() {
+    return (hostNanos() - hostStart) / 1000;
+}
+
+#endif
+
+unsigned long hostAllocated = 0;
+
+void *operator new(size_t size) {
+    void *p = malloc(size != 0 ? size : 1);
+
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+
+    hostAllocated += size;
+
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+int hostPins[64];
+
+HardwareSerial Serial;
+
+int HardwareSerial::available() {
+    return feof(stdin) ? 0 : 1;
+}
+
+int HardwareSerial::read() {
+    return getchar();
+}
+
+int HardwareSerial::peek() {
+    return ungetc(getchar(), stdin);
+}
+
+#if !defined(ESP32) && !defined(ESP8266)
+
+#define HOST_REGISTER(name) volatile uint8_t name;
+#define HOST_REGISTER16(name) volatile uint16_t name;
+
+#include "avr/registers.h"
+
+// SPI transfers complete at once
+volatile uint8_t SPSR = _BV(SPIF);
+
+#endif
@@ -0,0 +1,411 @@
+// ===================================================================
+// === Arduino on the host ===========================================
+// ===================================================================
+
+/**
+ * Just enough of the Arduino core to build the library and the test
+ * suite on a PC. Time is virtual: micros() advances by one on every
+ * call and delay() advances by the given amount without waiting, so
+ * runs are fast and repeatable. Pins and AVR registers are plain
+ * variables that the host programs can inspect. A host program can
+ * also register a hook that is called before every delay, for instance
+ * to record output levels over time. With HOST_REAL_TIME defined, the
+ * clock follows the monotonic clock of the PC instead, so durations
+ * can be measured, but delays still skip ahead without waiting.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#if !defined(ESP32) && !defined(ESP8266)
+#include "avr/io.h"
+#endif
+
+#include "avr/pgmspace.h"
+
+typedef uint8_t byte;
+typedef uint16_t word;
+typedef bool boolean;
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+
+#define A0 14
+#define SS 10
+#define MOSI 11
+#define MISO 12
+#define SCK 13
+
+#if !defined(F_CPU)
+#define F_CPU 16000000UL
+#endif
+
+#define bitRead(value, bit) (((value) >> (bit)) & 1)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, x) ((x) ? bitSet(value, bit) : bitClear(value, bit))
+
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+
+#define _BV(bit) (1 << (bit))
+
+#if defined(ESP32) || defined(ESP8266)
+#include <algorithm>
+using std::min;
+using std::max;
+#else
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define constrain(x, a, b) ((x) < (a) ? (a) : ((x) > (b) ? (b) : (x)))
+
+inline word makeWord(byte h, byte l) {
+    return (h << 8) | l;
+}
+
+#define word(h, l) makeWord(h, l)
+
+#define ISR(vector) extern "C" void vector(void)
+
+#define digitalPinToInterrupt(pin) ((pin) == 2 ? 0 : 1)
+
+// ===================================================================
+// === Time ==========================================================
+// ===================================================================
+
+/**
+ * The virtual clock (us). With HOST_REAL_TIME, only the time skipped
+ * by delays.
+ */
+extern unsigned long hostMicros;
+
+/**
+ * Called before the clock is advanced by a delay, if set.
+ */
+extern void (*hostDelayHook)(unsigned long us);
+
+#if defined(HOST_REAL_TIME)
+
+/**
+ * The real time (us) since the program started.
+ */
+unsigned long hostClock();
+
+inline unsigned long micros() {
+    return hostClock() + hostMicros;
+}
+
+inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+#else
+
+inline unsigned long micros() {
+    return hostMicros++;
+}
+
+inline unsigned long millis() {
+    return ++hostMicros / 1000;
+}
+
+#endif
+
+inline void delayMicroseconds(unsigned int us) {
+    if (hostDelayHook != NULL) {
+        hostDelayHook(us);
+    }
+
+    hostMicros += us;
+}
+
+inline void delay(unsigned long ms) {
+    if (hostDelayHook != NULL) {
+        hostDelayHook(ms * 1000);
+    }
+
+    hostMicros += ms * 1000;
+}
+
+inline void yield() {
+}
+
+// ===================================================================
+// === Memory ========================================================
+// ===================================================================
+
+/**
+ * The number of bytes allocated with new so far.
+ */
+extern unsigned long hostAllocated;
+
+// ===================================================================
+// === I/O ===========================================================
+// ===================================================================
+
+/**
+ * The pin levels.
+ */
+extern int hostPins[64];
+
+inline void pinMode(int pin, int mode) {
+}
+
+inline void digitalWrite(int pin, int value) {
+    hostPins[pin] = value;
+}
+
+inline int digitalRead(int pin) {
+    return hostPins[pin];
+}
+
+inline int analogRead(int pin) {
+    return 0;
+}
+
+inline void noInterrupts() {
+}
+
+inline void interrupts() {
+}
+
+inline void attachInterrupt(int number, void (*handler)(void), int mode) {
+}
+
+inline void detachInterrupt(int number) {
+}
+
+inline long random(long howbig) {
+    return rand() % howbig;
+}
+
+inline long random(long howsmall, long howbig) {
+    return howsmall + rand() % (howbig - howsmall);
+}
+
+inline void randomSeed(unsigned long seed) {
+    srand(seed);
+}
+
+// ===================================================================
+// === Strings and printing ==========================================
+// ===================================================================
+
+class __FlashStringHelper;
+
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+
+class String {
+
+  private:
+
+  std::string mText;
+
+  public:
+
+  String() {
+  }
+
+  String(const char *text) : mText(text) {
+  }
+
+  String(unsigned long value, int base) {
+      char buffer[40];
+      snprintf(buffer, sizeof(buffer), base == HEX ? "%lx" : "%lu", value);
+      mText = buffer;
+  }
+
+  unsigned int length() const {
+      return mText.size();
+  }
+
+  char charAt(unsigned int index) const {
+      return index < mText.size() ? mText[index] : 0;
+  }
+
+  const char *c_str() const {
+      return mText.c_str();
+  }
+
+};
+
+class Print;
+
+class Printable {
+
+  public:
+
+  virtual size_t printTo(Print &p) const = 0;
+
+};
+
+class Print {
+
+  public:
+
+  virtual size_t write(uint8_t c) = 0;
+
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+      size_t n = 0;
+
+      while (size--) {
+          n += write(*buffer++);
+      }
+
+      return n;
+  }
+
+  size_t print(const char *s) {
+      size_t n = 0;
+
+      while (*s) {
+          n += write(*s++);
+      }
+
+      return n;
+  }
+
+  size_t print(const __FlashStringHelper *s) {
+      return print(reinterpret_cast<const char *>(s));
+  }
+
+  size_t print(const String &s) {
+      return print(s.c_str());
+  }
+
+  size_t print(char c) {
+      return write(c);
+  }
+
+  size_t print(unsigned long value, int base = DEC) {
+      char buffer[40];
+      snprintf(buffer, sizeof(buffer), base == HEX ? "%lx" : "%lu", value);
+      return print(buffer);
+  }
+
+  size_t print(long value, int base = DEC) {
+      if (base != DEC) {
+          return print((unsigned long) value, base);
+      }
+
+      char buffer[40];
+      snprintf(buffer, sizeof(buffer), "%ld", value);
+      return print(buffer);
+  }
+
+  size_t print(int value, int base = DEC) {
+      return print((long) value, base);
+  }
+
+  size_t print(unsigned int value, int base = DEC) {
+      return print((unsigned long) value, base);
+  }
+
+  size_t print(unsigned char value, int base = DEC) {
+      return print((unsigned long) value, base);
+  }
+
+  size_t print(double value, int digits = 2) {
+      char buffer[40];
+      snprintf(buffer, sizeof(buffer), "%.*f", digits, value);
+      return print(buffer);
+  }
+
+  size_t print(const Printable &p) {
+      return p.printTo(*this);
+  }
+
+  size_t println() {
+      return print("\r\n");
+  }
+
+  template<class T> size_t println(const T &value) {
+      size_t n = print(value);
+      return n + println();
+  }
+
+  template<class T> size_t println(const T &value, int format) {
+      size_t n = print(value, format);
+      return n + println();
+  }
+
+};
+
+class Stream : public Print {
+
+  public:
+
+  virtual int available() = 0;
+
+  virtual int read() = 0;
+
+  virtual int peek() = 0;
+
+  size_t readBytes(char *buffer, size_t length) {
+      size_t n = 0;
+      int c;
+
+      while (n < length && (c = read()) >= 0) {
+          buffer[n++] = c;
+      }
+
+      return n;
+  }
+
+};
+
+/**
+ * The serial port is connected to stdin and stdout.
+ */
+class HardwareSerial : public Stream {
+
+  public:
+
+  void begin(long speed) {
+  }
+
+  void flush() {
+      fflush(stdout);
+  }
+
+  operator bool() {
+      return true;
+  }
+
+  virtual size_t write(uint8_t c) {
+      return putchar(c) == EOF ? 0 : 1;
+  }
+
+  using Print::write;
+
+  virtual int available();
+
+  virtual int read();
+
+  virtual int peek();
+
+};
+
+extern HardwareSerial Serial;
+
+#endif // HOST_ARDUINO_H
@@ -0,0 +1,2 @@
+// Printable is part of Arduino.h on the host
+#include "Arduino.h"
@@ -0,0 +1,2 @@
+// Interrupt vectors are plain functions on the host, see ISR()
+#include "../Arduino.h"
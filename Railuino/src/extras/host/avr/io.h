@@ -0,0 +1,56 @@
+// ===================================================================
+// === AVR registers on the host =====================================
+// ===================================================================
+
+/**
+ * The registers the library uses on the ATmega328P, as plain
+ * variables (see Arduino.cpp).
+ */
+
+#ifndef HOST_IO_H
+#define HOST_IO_H
+
+#include <stdint.h>
+
+#define HOST_REGISTER(name) extern volatile uint8_t name;
+#define HOST_REGISTER16(name) extern volatile uint16_t name;
+
+#include "registers.h"
+
+#undef HOST_REGISTER
+#undef HOST_REGISTER16
+
+extern volatile uint8_t SPSR;
+
+// SPI
+#define SPR0 0
+#define SPR1 1
+#define MSTR 4
+#define SPE 6
+#define SPIF 7
+
+// Timer 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define OCF0A 1
+#define OCF0B 2
+
+// Timer 1
+#define CS10 0
+#define CS11 1
+#define WGM12 3
+#define OCIE1A 1
+#define OCF1A 1
+
+// Timer 2
+#define CS20 0
+#define CS21 1
+#define WGM20 0
+#define WGM21 1
+#define WGM22 3
+#define COM2B1 5
+#define TOIE2 0
+#define OCIE2A 1
+#define TOV2 0
+
+#endif // HOST_IO_H
@@ -0,0 +1,10 @@
+// The registers, see io.h
+HOST_REGISTER(SPCR) HOST_REGISTER(SPDR)
+HOST_REGISTER(PORTB) HOST_REGISTER(DDRB) HOST_REGISTER(PINB)
+HOST_REGISTER(PORTD) HOST_REGISTER(DDRD) HOST_REGISTER(PIND)
+HOST_REGISTER(EIFR) HOST_REGISTER(WDTCSR) HOST_REGISTER(MCUSR)
+HOST_REGISTER(TCNT0) HOST_REGISTER(OCR0A) HOST_REGISTER(OCR0B) HOST_REGISTER(TIMSK0) HOST_REGISTER(TIFR0)
+HOST_REGISTER(TCCR1A) HOST_REGISTER(TCCR1B) HOST_REGISTER(TIMSK1) HOST_REGISTER(TIFR1)
+HOST_REGISTER16(TCNT1) HOST_REGISTER16(OCR1A)
+HOST_REGISTER(TCCR2A) HOST_REGISTER(TCCR2B) HOST_REGISTER(TCNT2)
+HOST_REGISTER(OCR2A) HOST_REGISTER(OCR2B) HOST_REGISTER(TIMSK2) HOST_REGISTER(TIFR2)
@@ -0,0 +1,20 @@
+// ===================================================================
+// === Benchmarks on the host ========================================
+// ===================================================================
+
+/**
+ * Runs Benchmark.ino against the CAN simulator, with the clock of the
+ * PC (see HOST_REAL_TIME). The times only say something compared to
+ * earlier runs on the same machine, but they do show regressions in
+ * the library code.
+ */
+
+#include "Railuino.h"
+
+#include "../../examples/05.Misc/Benchmark/Benchmark.ino"
+
+int main() {
+    setup();
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+// ===================================================================
+// === RMT driver on the host ========================================
+// ===================================================================
+
+/**
+ * The part of the ESP-IDF RMT driver the library uses. The functions
+ * are implemented by the host program, see rmt.cpp.
+ */
+
+#ifndef HOST_RMT_H
+#define HOST_RMT_H
+
+#include <stdint.h>
+
+typedef int esp_err_t;
+typedef int gpio_num_t;
+
+#define ESP_OK 0
+#define ESP_ERR_TIMEOUT 0x107
+
+#define portMAX_DELAY 0xffffffff
+
+typedef enum {
+    RMT_CHANNEL_0
+} rmt_channel_t;
+
+typedef enum {
+    RMT_CARRIER_LEVEL_LOW,
+    RMT_CARRIER_LEVEL_HIGH
+} rmt_carrier_level_t;
+
+typedef enum {
+    RMT_IDLE_LEVEL_LOW,
+    RMT_IDLE_LEVEL_HIGH
+} rmt_idle_level_t;
+
+typedef struct {
+    uint32_t duration0 : 15;
+    uint32_t level0 : 1;
+    uint32_t duration1 : 15;
+    uint32_t level1 : 1;
+} rmt_item32_t;
+
+typedef struct {
+    bool carrier_en;
+    uint32_t carrier_freq_hz;
+    uint8_t carrier_duty_percent;
+    rmt_carrier_level_t carrier_level;
+    bool idle_output_en;
+    rmt_idle_level_t idle_level;
+} rmt_tx_config_t;
+
+typedef struct {
+    rmt_channel_t channel;
+    gpio_num_t gpio_num;
+    uint8_t clk_div;
+    rmt_tx_config_t tx_config;
+} rmt_config_t;
+
+#define RMT_DEFAULT_CONFIG_TX(gpio, channel) { channel, gpio, 80, { false, 38000, 33, RMT_CARRIER_LEVEL_HIGH, true, RMT_IDLE_LEVEL_LOW } }
+
+esp_err_t rmt_config(const rmt_config_t *config);
+
+esp_err_t rmt_driver_install(rmt_channel_t channel, int rx_buf_size, int intr_alloc_flags);
+
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *items, int count, bool wait_tx_done);
+
+esp_err_t rmt_wait_tx_done(rmt_channel_t channel, uint32_t wait_time);
+
+#endif // HOST_RMT_H
@@ -0,0 +1,233 @@
+// ===================================================================
+// === RC5 transmitter check =========================================
+// ===================================================================
+
+/**
+ * Records the output of both AVR transmitters as a timeline of marks
+ * and spaces and compares them: the blocking sendRC5(), which uses
+ * mark() and space(), and the background one, which plays the schedule
+ * from rc5Schedule() in the compare interrupt of Timer0. The timer
+ * ticks along with the virtual clock, and the interrupt is called when
+ * it reaches the compare register. Both timelines
+ * are also run through TrackDecoderInfrared. Then checks that the
+ * merging of queued speed changes leaves the locomotive at the speed
+ * the controller models. Prints the largest edge deviation and the
+ * number of interrupts per frame and exits with 1 if anything doesn't
+ * match.
+ */
+
+// Before Arduino.h, which defines min() and max() as macros
+#include <vector>
+
+#include "Railuino.h"
+
+// Functions of ir/infrared.c, not in the header
+void initIR();
+void sendRC5(unsigned long data, int nbits, bool extended);
+void startRC5(unsigned long data, int nbits, bool extended);
+bool isIRBusy();
+extern "C" void TIMER0_COMPA_vect();
+
+// Speed commands of ir/infrared.c
+#define CMD_FASTER 0x10
+#define CMD_SLOWER 0x11
+
+// Timer0 tick in ns, the timer runs at 1/64 of the clock
+#define TICK (64000UL / (F_CPU / 1000000UL))
+
+struct Run {
+    bool mark;
+    unsigned long duration; // ns
+};
+
+std::vector<Run> timeline;
+
+unsigned long interruptCount;
+
+int failures = 0;
+
+#define CHECK(x) if (!(x)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x); failures++; }
+
+// Whether the PWM output is connected to the pin
+bool isMark() {
+    return (TCCR2A & _BV(COM2B1)) != 0;
+}
+
+// Extends the timeline by the given time at the current output level
+void record(unsigned long ns) {
+    if (ns == 0) {
+        return;
+    }
+
+    if (!timeline.empty() && timeline.back().mark == isMark()) {
+        timeline.back().duration += ns;
+    } else {
+        Run run = { isMark(), ns };
+        timeline.push_back(run);
+    }
+}
+
+// Called for every delay of the blocking transmitter
+void recordDelay(unsigned long us) {
+    record(us * 1000);
+}
+
+std::vector<Run> recordBlocking(unsigned long data, bool extended) {
+    timeline.clear();
+
+    hostDelayHook = recordDelay;
+    sendRC5(data, 12, extended);
+    hostDelayHook = NULL;
+
+    return timeline;
+}
+
+// Advances Timer0 by one tick, calling the interrupt on a match
+void tick() {
+    TCNT0++;
+
+    if (TCNT0 == OCR0A && (TIMSK0 & _BV(OCIE0A))) {
+        TIMER0_COMPA_vect();
+        interruptCount++;
+    }
+}
+
+std::vector<Run> recordInterrupt(unsigned long data, bool extended) {
+    timeline.clear();
+
+    startRC5(data, 12, extended);
+
+    while (isIRBusy()) {
+        tick();
+        record(TICK);
+    }
+
+    return timeline;
+}
+
+// Decodes a timeline and checks the result against the frame
+void decode(const std::vector<Run> &runs, unsigned long data, bool extended) {
+    TrackDecoderInfrared decoder;
+    bool valid = false;
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        valid = decoder.feed(runs[i].mark, min(runs[i].duration / 1000, 0xffffUL));
+    }
+
+    // The blocking transmitter leaves the gap to the caller
+    if (!valid) {
+        valid = decoder.feed(false, 0xffff);
+    }
+
+    CHECK(valid);
+    CHECK(decoder.getAddress() == ((data >> 6) & 0x1f));
+    CHECK(decoder.getCommand() == ((data & 0x3f) | (extended ? 0x40 : 0)));
+    CHECK(decoder.getToggle() == ((data & 0x800) != 0));
+}
+
+// Queues random speed changes while the transmitter is busy, then
+// plays the queued frames on a locomotive that stops at steps 0 and 14
+void checkQueue() {
+    TrackControllerInfrared ctrl;
+    int speed = 0;
+
+    srand(1);
+
+    for (int i = 0; i < 10000; i++) {
+        startRC5(0, 12, false);
+
+        for (int j = rand() % IR_QUEUE; j >= 0; j--) {
+            if (rand() % 2) {
+                ctrl.accelerateLoco(1);
+            } else {
+                ctrl.decelerateLoco(1);
+            }
+        }
+
+        unsigned long data;
+        int nbits;
+        bool extended;
+
+        while (ctrl.nextFrame(&data, &nbits, &extended)) {
+            CHECK(nbits == 12);
+
+            if ((data & 0x3f) == CMD_FASTER) {
+                speed = min(speed + 1, 14);
+            } else if ((data & 0x3f) == CMD_SLOWER) {
+                speed = max(speed - 1, 0);
+            }
+        }
+
+        byte step = 0xff;
+        ctrl.getLocoSpeedStep(1, &step);
+
+        CHECK(step == speed);
+
+        while (isIRBusy()) {
+            tick();
+        }
+    }
+}
+
+int main() {
+    unsigned long worst = 0;
+    unsigned long gap = 0xffffffff;
+    int frames = 0;
+
+    initIR();
+
+    for (int extended = 0; extended < 2; extended++) {
+        for (unsigned long data = 0; data < 0x1000; data++) {
+            std::vector<Run> expected = recordBlocking(data, extended);
+            std::vector<Run> actual = recordInterrupt(data, extended);
+
+            decode(expected, data, extended);
+            decode(actual, data, extended);
+
+            // Same sequence of marks and spaces, followed by the gap
+            CHECK(expected.front().mark && actual.front().mark);
+            CHECK(!actual.back().mark);
+            CHECK(actual.size() == expected.size() + (expected.back().mark ? 1 : 0));
+
+            if (actual.size() < expected.size()) {
+                continue;
+            }
+
+            // Compare the times of all edges within the frame
+            unsigned long t1 = 0;
+            unsigned long t2 = 0;
+
+            for (size_t i = 0; i + 1 < expected.size(); i++) {
+                t1 += expected[i].duration;
+                t2 += actual[i].duration;
+
+                CHECK(expected[i].mark == actual[i].mark);
+
+                worst = max(worst, t1 > t2 ? t1 - t2 : t2 - t1);
+            }
+
+            // The last space of the frame merges into the gap
+            unsigned long rest = actual.back().duration;
+            if (!expected.back().mark) {
+                rest -= min(rest, expected.back().duration);
+            }
+
+            gap = min(gap, rest);
+            frames++;
+        }
+    }
+
+    printf("rc5: %d frames, largest edge error %lu ns, shortest gap %lu us, %lu interrupts per frame\n",
+        frames, worst, gap / 1000, interruptCount / frames);
+
+    // The decoder allows a quarter of a half bit, the gap is 50 ms
+    CHECK(worst < 889000 / 4);
+    CHECK(gap >= 50000000UL);
+
+    // One per half bit of frame and gap
+    CHECK(interruptCount / frames < 100);
+
+    checkQueue();
+
+    return failures == 0 ? 0 : 1;
+}
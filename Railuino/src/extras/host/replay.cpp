@@ -0,0 +1,184 @@
+// ===================================================================
+// === Capture replay ================================================
+// ===================================================================
+
+/**
+ * Plays a capture made with the Capture example back into the CAN
+ * simulator at its original pace, like the Replay example does on a
+ * board, but on the virtual clock, so even long captures take only a
+ * moment. The capture is read from the file given as the argument or
+ * from stdin. A second TrackCapture records what the controller
+ * receives, while the controller is only polled every POLL ms, like
+ * a busy loop() would. Then checks that every message came through
+ * unchanged, with a time stamp that is off by no more than 1 ms.
+ * Prints the number of records, the number of messages received and
+ * dropped and the largest time stamp error, and exits with 1 if
+ * anything doesn't match.
+ */
+
+// Before Arduino.h, which defines min() and max() as macros
+#include <vector>
+
+#include "Railuino.h"
+
+// Time between two polls of the controller (ms)
+#define POLL 10
+
+/**
+ * A stream on a file.
+ */
+class FileStream : public Stream {
+
+  private:
+
+  FILE *mFile;
+
+  public:
+
+  FileStream(FILE *file) {
+      mFile = file;
+  }
+
+  virtual size_t write(uint8_t c) {
+      return fputc(c, mFile) == EOF ? 0 : 1;
+  }
+
+  using Print::write;
+
+  virtual int available() {
+      return feof(mFile) ? 0 : 1;
+  }
+
+  virtual int read() {
+      return fgetc(mFile);
+  }
+
+  virtual int peek() {
+      return ungetc(fgetc(mFile), mFile);
+  }
+
+  void rewind() {
+      ::rewind(mFile);
+  }
+
+};
+
+struct Record {
+    TrackMessage message;
+    unsigned long time; // ms
+};
+
+TrackController ctrl(0xdf24, false);
+
+int failures = 0;
+
+#define CHECK(x) if (!(x)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x); failures++; }
+
+boolean isSame(TrackMessage &a, TrackMessage &b) {
+    if (a.command != b.command || a.hash != b.hash || a.response != b.response || a.length != b.length) {
+        return false;
+    }
+
+    return memcmp(a.data, b.data, a.length) == 0;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    FileStream input(file);
+
+    if (!TrackCapture::readHeader(input)) {
+        printf("replay: not a capture\n");
+        return 1;
+    }
+
+    TrackMessage message;
+
+    ctrl.begin();
+    while (ctrl.receiveMessage(message));
+
+    FileStream output(tmpfile());
+    TrackCapture capture;
+
+    capture.begin(ctrl, output);
+
+    std::vector<Record> played;
+    Record record;
+
+    unsigned long start = millis();
+    unsigned long polled = 0;
+    unsigned long received = 0;
+
+    boolean pending = TrackCapture::readRecord(input, record.message, &record.time);
+
+    for (;;) {
+        while (pending && millis() - start >= record.time) {
+            simulator.inject(record.message);
+            played.push_back(record);
+
+            pending = TrackCapture::readRecord(input, record.message, &record.time);
+        }
+
+        unsigned long now = millis() - start;
+
+        if (now - polled >= POLL) {
+            polled = now;
+
+            while (ctrl.receiveMessage(message)) {
+                received++;
+            }
+
+            if (!pending) {
+                break;
+            }
+        }
+
+        // Skip ahead to whatever comes next
+        unsigned long next = polled + POLL;
+
+        if (pending && record.time < next) {
+            next = record.time;
+        }
+
+        delay(next - now);
+    }
+
+    capture.end();
+
+    // Every message recorded must be the next one played, apart from
+    // the ones the simulator dropped
+    output.rewind();
+    CHECK(TrackCapture::readHeader(output));
+
+    unsigned long error = 0;
+    size_t k = 0;
+
+    while (TrackCapture::readRecord(output, record.message, &record.time)) {
+        while (k < played.size() && !isSame(played[k].message, record.message)) {
+            k++;
+        }
+
+        CHECK(k < played.size());
+        if (k == played.size()) {
+            break;
+        }
+
+        unsigned long time = played[k++].time;
+
+        error = max(error, record.time > time ? record.time - time : time - record.time);
+    }
+
+    printf("replay: %d records, %lu received, %u dropped, largest time error %lu ms\n",
+           (int) played.size(), received, simulator.getDropped(), error);
+
+    CHECK(received == capture.getCount());
+    CHECK(received + simulator.getDropped() == played.size());
+    CHECK(error <= 1);
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+// ===================================================================
+// === RMT transmitter check =========================================
+// ===================================================================
+
+/**
+ * Checks the RMT items the ESP32 transmitter generates against the
+ * reference timing of the blocking transmitter: a start bit mark, the
+ * second start bit (inverted for RC5X), then the bits MSB first, each
+ * as two half bits of 889 us, and the 50 ms gap, which the peripheral
+ * sends as trailing space. The RMT driver is stubbed and keeps the
+ * items of the last frame. Exits with 1 if anything doesn't match.
+ */
+
+#include <vector>
+
+#include "Railuino.h"
+#include "driver/rmt.h"
+
+// Functions of ir/infraredESP32.c, not in the header
+void initIR();
+void startRC5(const uint64_t data, uint16_t nbits, bool extended);
+bool isIRBusy();
+
+#define HALF_BIT 889
+
+#define GAP 50000
+
+rmt_config_t config;
+
+std::vector<rmt_item32_t> items;
+
+unsigned long started;
+
+unsigned long duration;
+
+esp_err_t rmt_config(const rmt_config_t *c) {
+    config = *c;
+    return ESP_OK;
+}
+
+esp_err_t rmt_driver_install(rmt_channel_t channel, int rx_buf_size, int intr_alloc_flags) {
+    return ESP_OK;
+}
+
+esp_err_t rmt_write_items(rmt_channel_t channel, const rmt_item32_t *data, int count, bool wait_tx_done) {
+    items.assign(data, data + count);
+
+    started = micros();
+    duration = 0;
+
+    for (int i = 0; i < count; i++) {
+        duration += data[i].duration0 + data[i].duration1;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t rmt_wait_tx_done(rmt_channel_t channel, uint32_t wait_time) {
+    return micros() - started >= duration ? ESP_OK : ESP_ERR_TIMEOUT;
+}
+
+int failures = 0;
+
+#define CHECK(x) if (!(x)) { printf("%s:%d: %s failed\n", __FILE__, __LINE__, #x); failures++; }
+
+// The half bits (1 = mark) of the blocking transmitter
+std::vector<bool> reference(unsigned long data, bool extended) {
+    std::vector<bool> result;
+
+    result.push_back(true);
+    result.push_back(extended);
+    result.push_back(!extended);
+
+    for (int i = 11; i >= 0; i--) {
+        boolean one = bitRead(data, i);
+        result.push_back(!one);
+        result.push_back(one);
+    }
+
+    return result;
+}
+
+// Appends a level for the given time (us), merging equal levels
+void append(std::vector<bool> &levels, std::vector<unsigned long> &times, bool level, unsigned long time) {
+    if (time == 0) {
+        return;
+    }
+
+    if (!levels.empty() && levels.back() == level) {
+        times.back() += time;
+    } else {
+        levels.push_back(level);
+        times.push_back(time);
+    }
+}
+
+int main() {
+    unsigned long gap = 0xffffffff;
+    int frames = 0;
+
+    initIR();
+
+    // Ticks of 1 us and a 36 kHz carrier, idle low
+    CHECK(config.clk_div == 80);
+    CHECK(config.tx_config.carrier_en);
+    CHECK(config.tx_config.carrier_freq_hz == 36000);
+    CHECK(config.tx_config.idle_output_en);
+    CHECK(config.tx_config.idle_level == RMT_IDLE_LEVEL_LOW);
+
+    for (int extended = 0; extended < 2; extended++) {
+        for (unsigned long data = 0; data < 0x1000; data++) {
+            startRC5(data, 12, extended);
+
+            CHECK(isIRBusy());
+
+            // The gap is split in two, as an item holds at most 32767
+            // ticks. It starts after the space of a trailing zero bit.
+            rmt_item32_t &last = items.back();
+            rmt_item32_t &before = items[items.size() - 2];
+            unsigned long trailing = bitRead(data, 0) ? 0 : HALF_BIT;
+
+            CHECK(last.level0 == 0 && last.duration0 == GAP / 2);
+            CHECK(last.level1 == 0 && last.duration1 == 0);
+            CHECK(before.level1 == 0 && before.duration1 == trailing + GAP / 2);
+
+            // Expand the items into marks and spaces
+            std::vector<bool> levels;
+            std::vector<unsigned long> times;
+
+            for (size_t i = 0; i < items.size(); i++) {
+                append(levels, times, items[i].level0, items[i].duration0);
+                append(levels, times, items[i].level1, items[i].duration1);
+            }
+
+            // Same half bits, then the gap
+            std::vector<bool> halfBits = reference(data, extended);
+            size_t k = 0;
+
+            for (size_t i = 0; i < levels.size() && k < halfBits.size(); i++) {
+                unsigned long n = times[i] / HALF_BIT;
+
+                CHECK(n >= 1);
+                CHECK(times[i] % HALF_BIT == 0 || k + n >= halfBits.size());
+
+                for (unsigned long j = 0; j < n && k < halfBits.size(); j++) {
+                    CHECK(halfBits[k++] == levels[i]);
+                }
+            }
+
+            CHECK(k == halfBits.size());
+            CHECK(!levels.back());
+
+            unsigned long rest = times.back();
+            if (!halfBits.back()) {
+                rest -= HALF_BIT;
+            }
+
+            gap = min(gap, rest);
+
+            // The peripheral stays busy until the gap is over
+            delay(duration / 1000 + 1);
+            CHECK(!isIRBusy());
+
+            frames++;
+        }
+    }
+
+    printf("rmt: %d frames, shortest gap %lu us\n", frames, gap);
+
+    CHECK(gap >= GAP);
+
+    return failures == 0 ? 0 : 1;
+}
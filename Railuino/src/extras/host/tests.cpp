@@ -0,0 +1,20 @@
+// ===================================================================
+// === Test suite on the host ========================================
+// ===================================================================
+
+/**
+ * Runs Tests.ino against the CAN simulator. The Arduino IDE generates
+ * the prototypes of a sketch, here the Makefile does (tests.h). The
+ * exit code reflects whether all tests passed.
+ */
+
+#include "Railuino.h"
+#include "tests.h"
+
+#include "../../examples/05.Misc/Tests/Tests.ino"
+
+int main() {
+    setup();
+
+    return fail == 0 ? 0 : 1;
+}
@@ -19,6 +19,7 @@
 
 #define SYSCLOCK 16000000  // main Arduino clock
 #define RC5_T1      889
+#define RC5_GAP     50     // minimum time between two frames (ms)
 #define TOPBIT 0x80000000
 
 void mark(int time) {
@@ -93,3 +94,103 @@ void sendRC5(unsigned long data, int nbits, bool extended)
   }
   space(0); // Turn off at end
 }
+
+// ===================================================================
+// === Background transmission =======================================
+// ===================================================================
+
+/**
+ * Timer0, which also drives millis(), runs at 1/64 of the clock and
+ * wraps every 256 ticks. Its compare A interrupt fires once per half
+ * bit and connects or disconnects the PWM output of the carrier timer
+ * according to a schedule of half bits computed upfront. A half bit
+ * isn't a whole number of ticks, so the handler carries the remaining
+ * quarter ticks over to the next one. This way a frame of 12 bits
+ * costs 27 interrupts of a few microseconds, plus one per half bit of
+ * the gap, instead of blocking for 25 ms. After each frame the
+ * handler waits for the gap and then asks irNextFrame() for the next
+ * one, so a whole queue of frames is sent without any help from the
+ * main program. While a frame is sent, the compare register belongs
+ * to the transmitter, so analogWrite() on the OC0A pin doesn't work.
+ */
+
+#define RC5_GAP_HALF_BITS ((RC5_GAP * 1000L + RC5_T1 - 1) / RC5_T1)
+
+// Timer0 quarter ticks per half bit
+#define RC5_QUARTERS (RC5_T1 * (F_CPU / 1000000L) / 16)
+
+volatile unsigned long irSchedule; // Half bits to send, MSB first, 1 = mark
+volatile byte irHalfBits;          // Number of half bits left
+volatile byte irGap;               // Number of half bits left in the gap
+volatile byte irQuarters;          // Quarter ticks carried over
+volatile boolean irActive;         // Whether a frame or gap is running
+
+// Provides the next queued frame, if any. Called with interrupts off.
+bool irNextFrame(unsigned long *data, int *nbits, bool *extended);
+
+void irLoad(unsigned long data, int nbits, bool extended) {
+  byte halfBits = 3 + 2 * nbits;
+
+  irSchedule = rc5Schedule(data, nbits, extended) << (32 - halfBits);
+  irHalfBits = halfBits;
+  irGap = RC5_GAP_HALF_BITS;
+}
+
+ISR(TIMER0_COMPA_vect) {
+  // The next half bit, counted from this one, so nothing drifts
+  unsigned int quarters = irQuarters + RC5_QUARTERS;
+  OCR0A += quarters / 4;
+  irQuarters = quarters % 4;
+
+  if (irHalfBits != 0) {
+    if (irSchedule & TOPBIT) {
+      TCCR2A |= _BV(COM2B1);
+    } else {
+      TCCR2A &= ~(_BV(COM2B1));
+    }
+
+    irSchedule <<= 1;
+    irHalfBits--;
+    return;
+  }
+
+  TCCR2A &= ~(_BV(COM2B1)); // Frame done, disable PWM output
+
+  if (irGap != 0) {
+    irGap--;
+    return;
+  }
+
+  unsigned long data;
+  int nbits;
+  bool extended;
+
+  if (irNextFrame(&data, &nbits, &extended)) {
+    irLoad(data, nbits, extended);
+  } else {
+    TIMSK0 &= ~_BV(OCIE0A);
+    irActive = false;
+  }
+}
+
+void initIR() {
+  enableIROut(36);
+}
+
+// Reflects whether a frame or the gap following it is still running
+bool isIRBusy() {
+  return irActive;
+}
+
+// Same as sendRC5(), but returns immediately. At most 14 bits.
+void startRC5(unsigned long data, int nbits, bool extended)
+{
+  noInterrupts();
+  irLoad(data, nbits, extended);
+  irActive = true;
+  irQuarters = 0;
+  OCR0A = TCNT0 + 1; // Start with the next tick
+  TIFR0 = _BV(OCF0A);
+  TIMSK0 |= _BV(OCIE0A);
+  interrupts();
+}
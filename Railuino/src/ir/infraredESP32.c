@@ -7,8 +7,12 @@
 * I took the original infrared2.c and tried to rewrite the code according to
 * IRSend.cpp by David Conran
 * https://github.com/crankyoldgit/IRremoteESP8266
+*
+* On the ESP32 the frames are sent by the RMT peripheral, which also
+* generates the carrier, so nothing blocks and nothing depends on
+* interrupt latency. The ESP8266 has no such thing, so it still does
+* the carrier in software.
 */
-#define ESP32
 // From the datasheet
 // https://www.espressif.com/sites/default/files/documentation/esp32-wroom-32_datasheet_en.pdf
 // CPU clock frequency is adjustable from 80 MHz to 240 MHz
@@ -72,7 +76,8 @@ const int8_t outputOff = LOW;
 
 uint8_t _dutycycle;
 
-boolean modulation = false;
+// The Delta receiver only reacts to a 36 kHz carrier
+boolean modulation = true;
 
 
 #if ALLOW_DELAY_CALLS
@@ -113,15 +118,6 @@ void ledOn() {
     digitalWrite(IRpin, outputOn);
 }
 
-void initIR() {
-    if (modulation)
-    _dutycycle = kDutyDefault;
-    else
-    _dutycycle = kDutyMax;
-    pinMode(IRpin, OUTPUT);
-    ledOff();  // Ensure the LED is in a known safe state when we start.
-}
-
 // Modulate the IR LED for the given period (usec) and at the duty cycle set.
 /// @param[in] usec The period of time to modulate the IR LED for, in
 ///  microseconds.
@@ -141,7 +137,7 @@ void mark(uint16_t usec) {
         ledOn();
         _delayMicroseconds(usec);
         ledOff();
-        //        return 1;
+        return;
     }
 
     // I have no idea (yet) if we will need frequency modulation, so I assume, we do.
@@ -261,59 +257,137 @@ void enableIROut(uint32_t khz) {
     //
 }
 
+//  Minimum time between two frames (ms).
+const uint32_t kRc5Gap = 50;
+
+//  Time (us) of the trailing space of a frame ending with a zero bit.
+//  encode() leaves it out, but the gap only starts after it.
+uint16_t trailingSpace(const uint64_t data) {
+    return bitRead(data, 0) ? 0 : kRc5T1;
+}
+
+#if defined(ESP32)
+
+// ===================================================================
+// === RMT transmission (ESP32) ======================================
+// ===================================================================
+
+#include "driver/rmt.h"
+
+const rmt_channel_t kRmtChannel = RMT_CHANNEL_0;
+
+//  One item per mark/space pair, plus one for the rest of the gap.
+rmt_item32_t irItems[IR_RUNS / 2 + 2];
+
+void initIR() {
+    // Ticks of 1 us, 36 kHz carrier with 25 % duty cycle
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX((gpio_num_t) IRpin, kRmtChannel);
+    config.clk_div = 80;
+    config.tx_config.carrier_en = true;
+    config.tx_config.carrier_freq_hz = 36000;
+    config.tx_config.carrier_duty_percent = 25;
+    config.tx_config.carrier_level = RMT_CARRIER_LEVEL_HIGH;
+    config.tx_config.idle_output_en = true;
+    config.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+
+    rmt_config(&config);
+    rmt_driver_install(kRmtChannel, 0, 0);
+}
+
+/// Reflects whether a frame or the gap following it is still running.
+bool isIRBusy() {
+    return rmt_wait_tx_done(kRmtChannel, 0) != ESP_OK;
+}
+
+/// Same as sendRC5(), but returns immediately. The gap is sent as
+/// part of the frame (as trailing space), so the peripheral stays busy
+/// until the next frame may start.
+void startRC5(const uint64_t data, uint16_t nbits, bool extended) {
+    byte runs[IR_RUNS];
+    byte count = TrackControllerInfrared::encode(data, nbits, extended, runs);
+
+    // Runs alternate between mark and space and end with a mark. An
+    // item holds at most 32767 ticks, so the gap is split in two.
+    int items = 0;
+    for (int i = 0; i < count; i += 2) {
+        irItems[items].level0 = 1;
+        irItems[items].duration0 = runs[i] * kRc5T1;
+        irItems[items].level1 = 0;
+        irItems[items].duration1 = i + 1 < count ? runs[i + 1] * kRc5T1 : trailingSpace(data) + kRc5Gap * 500;
+        items++;
+    }
+
+    irItems[items].level0 = 0;
+    irItems[items].duration0 = kRc5Gap * 500;
+    irItems[items].level1 = 0;
+    irItems[items].duration1 = 0;
+    items++;
+
+    rmt_write_items(kRmtChannel, irItems, items, false);
+}
+
+/// Sends a frame and waits for it (and the gap) to complete.
+void sendRC5(const uint64_t data, uint16_t nbits, bool extended) {
+    startRC5(data, nbits, extended);
+    rmt_wait_tx_done(kRmtChannel, portMAX_DELAY);
+}
+
+#else
+
+// ===================================================================
+// === Software transmission (ESP8266) ===============================
+// ===================================================================
+
+//  Time the last frame ended (ms).
+uint32_t irEnd = 0;
+
+void initIR() {
+    if (modulation)
+    _dutycycle = kDutyDefault;
+    else
+    _dutycycle = kDutyMax;
+    pinMode(IRpin, OUTPUT);
+    ledOff();  // Ensure the LED is in a known safe state when we start.
+}
+
 /// Send a Philips RC-5/RC-5X packet.
-/// Status: RC-5 (stable), RC-5X (alpha)
 /// @param[in] data The message to be sent.
 /// @param[in] nbits The number of bits of message to be sent.
-/// @param[in] repeat The number of times the command is to be repeated.
+/// @param[in] extended Whether bit 6 of the command is to be sent
+///   (inverted) as second start bit (RC-5X).
 /// @note Caller needs to take care of flipping the toggle bit.
 ///   That bit differentiates between key press & key release.
-///   For RC-5 it is the MSB of the data.
-///   For RC-5X it is the 2nd MSB of the data.
-/// @todo Testing of the RC-5X components.
 void sendRC5(const uint64_t data, uint16_t nbits, bool extended) {
-    uint64_t sdata = data;
-    if (nbits > sizeof(sdata) * 8) return;  // We can't send something that big.
-    bool skipSpace = true;
-    bool field_bit = true;
+    byte runs[IR_RUNS];
+    byte count = TrackControllerInfrared::encode(data, nbits, extended, runs);
+
     // Set 36kHz IR carrier frequency & a 1/4 (25%) duty cycle.
     enableIROut(36);
 
-    // Binary Left Shift Operator.
-    // The left operands value is moved left
-    // by the number of bits specified by the right operand.
-    sdata = sdata << (32 - nbits);
-
-    IRtimer usecTimer = IRtimer();
-//    for (uint16_t i = 0; i <= repeat; i++) {
-        usecTimer.reset();
-
-        // Header
-        // First start bit (0x1). space, then mark.
-        if (skipSpace)
-        skipSpace = false;  // First time through, we assume the leading space().
-        else
-        space(kRc5T1);
-        mark(kRc5T1);
-        // Field/Second start bit.
-        if (field_bit) {  // Send a 1. Normal for RC-5.
-            space(kRc5T1);
-            mark(kRc5T1);
-        } else {  // Send a 0. Special case for RC-5X. Means 7th command bit is 1.
-            mark(kRc5T1);
-            space(kRc5T1);
+    // Runs alternate between mark and space, starting with a mark.
+    for (int i = 0; i < count; i++) {
+        if (i % 2 == 0) {
+            mark(runs[i] * kRc5T1);
+        } else {
+            space(runs[i] * kRc5T1);
         }
+    }
 
-        // Data
-        for (uint64_t mask = 1ULL << (nbits - 1); mask; mask >>= 1)
-        if (sdata & mask) {  // 1
-            space(kRc5T1);    // 1 is space, then mark.
-            mark(kRc5T1);
-        } else {         // 0
-            mark(kRc5T1);  // 0 is mark, then space.
-            space(kRc5T1);
-        }
-        // Footer
-        space(std::max(kRc5MinGap, kRc5MinCommandLength - usecTimer.elapsed()));
-//    }
+    space(trailingSpace(data));
+    ledOff();
+    irEnd = millis();
+}
+
+/// Reflects whether the gap following the last frame is still running.
+bool isIRBusy() {
+    return millis() - irEnd < kRc5Gap;
 }
+
+/// Same as sendRC5(), but meant to return immediately. There is no
+/// background transmission on the ESP8266, so this still blocks for
+/// the frame itself, but leaves the gap to the caller.
+void startRC5(const uint64_t data, uint16_t nbits, bool extended) {
+    sendRC5(data, nbits, extended);
+}
+
+#endif
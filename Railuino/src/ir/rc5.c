@@ -0,0 +1,47 @@
+// ===================================================================
+// === RC5 encoding ==================================================
+// ===================================================================
+
+/**
+ * RC5 uses Manchester code with half bits of 889 us: a one is sent as
+ * space followed by mark, a zero as mark followed by space. Instead
+ * of working through a frame bit by bit, the transmitters look up the
+ * half bits for four bits at a time in a small table in flash that is
+ * generated by the compiler.
+ */
+
+// Half bits for a single bit (1 = mark)
+constexpr byte rc5Bit(byte value) {
+  return value ? 0b01 : 0b10;
+}
+
+// Half bits for four bits, MSB first
+constexpr byte rc5Nibble(byte value) {
+  return rc5Bit(value & 8) << 6 | rc5Bit(value & 4) << 4 | rc5Bit(value & 2) << 2 | rc5Bit(value & 1);
+}
+
+const byte rc5Nibbles[16] PROGMEM = {
+  rc5Nibble(0),  rc5Nibble(1),  rc5Nibble(2),  rc5Nibble(3),
+  rc5Nibble(4),  rc5Nibble(5),  rc5Nibble(6),  rc5Nibble(7),
+  rc5Nibble(8),  rc5Nibble(9),  rc5Nibble(10), rc5Nibble(11),
+  rc5Nibble(12), rc5Nibble(13), rc5Nibble(14), rc5Nibble(15)
+};
+
+/**
+ * Returns the half bits of a frame of up to 14 bits, including the
+ * start bits, right-aligned and MSB first. The frame has 3 + 2 * nbits
+ * half bits, the first of which (the mark of the first start bit) is
+ * always a one.
+ */
+unsigned long rc5Schedule(unsigned long data, int nbits, bool extended) {
+  unsigned long halfBits = 0;
+
+  for (int i = 12; i >= 0; i -= 4) {
+    halfBits = (halfBits << 8) | pgm_read_byte(&rc5Nibbles[(data >> i) & 0x0f]);
+  }
+
+  // First start bit (mark only), second start bit or inverted bit 6
+  unsigned long start = extended ? 0b110 : 0b101;
+
+  return (start << (2 * nbits)) | (halfBits & ((1UL << (2 * nbits)) - 1));
+}